@@ -49,6 +49,12 @@
  *        was found. ENTRYLO is not actually used, but must be set; 0
  *        should be passed.
  *
+ *   tlb_setasid: set the address space ID that the processor matches
+ *        TLB entries against. The other functions overwrite it with
+ *        the PID field of the ENTRYHI they are given (or, for
+ *        tlb_read, of the entry read), so it must be reset after them
+ *        when using ASIDs.
+ *
  *        IMPORTANT NOTE: An entry may be matching even if the valid bit
  *        is not set. To completely invalidate the TLB, load it with
  *        translations for addresses in one of the unmapped address
@@ -59,14 +65,15 @@ void tlb_random(uint32_t entryhi, uint32_t entrylo);
 void tlb_write(uint32_t entryhi, uint32_t entrylo, uint32_t index);
 void tlb_read(uint32_t *entryhi, uint32_t *entrylo, uint32_t index);
 int tlb_probe(uint32_t entryhi, uint32_t entrylo);
+void tlb_setasid(uint32_t asid);
 
 /*
  * TLB entry fields.
  *
- * Note that the MIPS has support for a 6-bit address space ID. In the
- * interests of simplicity, we don't use it. The fields related to it
- * (TLBLO_GLOBAL and TLBHI_PID) can be left always zero, as can the
- * bits that aren't assigned a meaning.
+ * Note that the MIPS has support for a 6-bit address space ID, kept in
+ * TLBHI_PID. An entry only matches while the same ID is loaded in the
+ * processor (see tlb_setasid) unless TLBLO_GLOBAL is set. The bits
+ * that aren't assigned a meaning can be left always zero.
  *
  * The TLBLO_DIRTY bit is actually a write privilege bit - it is not
  * ever set by the processor. If you set it, writes are permitted. If
@@ -78,7 +85,8 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 /* Fields in the high-order word */
 #define TLBHI_VPAGE   0xfffff000
-/*      TLBHI_PID     0x00000fc0 */
+#define TLBHI_PID     0x00000fc0
+#define TLBHI_PID_SHIFT 6
 
 /* Fields in the low-order word */
 #define TLBLO_PPAGE   0xfffff000
@@ -101,5 +109,11 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 #define NUM_TLB  64
 
+/*
+ * Number of address space IDs the TLB can tell apart.
+ */
+
+#define NUM_ASIDS 64
+
 
 #endif /* _MIPS_TLB_H_ */
@@ -104,5 +104,15 @@ __DEAD void mips_usermode(struct trapframe *tf);
 extern vaddr_t cpustacks[];
 extern vaddr_t cputhreads[];
 
+/*
+ * Page table the fast-path TLB refill walks on each cpu.
+ */
+extern vaddr_t cpupagetables[];
+
+/*
+ * Misses it has handled on each cpu.
+ */
+extern unsigned cpurefills[];
+
 
 #endif /* _MIPS_TRAPFRAME_H_ */
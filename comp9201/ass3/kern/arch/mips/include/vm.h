@@ -115,26 +115,94 @@ kvaddr_to_paddr(vaddr_t vaddr){
  * ram_stealmem can be used before ram_getsize is called to allocate
  * memory that cannot be freed later. This is intended for use early
  * in bootup before VM initialization is complete.
+ *
+ * ram_getusage reports how many frames are currently free and how
+ * many frames the allocator manages in total. frame_printstats prints
+ * the per-cpu free frame cache hit and miss counts and the zeroing
+ * counts. (UNSW allocator only.)
+ *
+ * alloc_zeroed_kpage allocates one frame of zeros, taking one cleared
+ * ahead of time by the zeroing thread that frame_zeroer_start starts
+ * if there is one. take_zeroed_kpage only takes an already cleared
+ * frame, returning 0 if there is none; it never reclaims, so it may
+ * be called with spinlocks held. (UNSW allocator only.)
+ *
+ * frame_incref adds a reference to an allocated single frame so it
+ * can be mapped copy-on-write in more than one address space;
+ * free_kpages drops a reference and frees the frame with the last
+ * one. frame_getref returns the current count. (UNSW allocator only.)
+ *
+ * frame_setcached marks a frame as held by the text page cache; such a
+ * frame is not freed when its last reference goes. frame_uncache
+ * releases that hold if at most MAXREF references remain, freeing the
+ * frame if there are none, and returns whether it did. (UNSW
+ * allocator only.)
+ *
+ * frame_touch marks a user frame referenced and records the page that
+ * maps it, if that is the only mapping, as the frame's owner; it
+ * returns whether the frame has an owner. frame_adopt does the same
+ * for a page that was mapped but not used, leaving the reference bit
+ * alone. Both are called with the page table lock of AS held.
+ *
+ * The pager runs the clock with frame_next_owned, which moves the
+ * hand on to the next frame with an owner, spending *BUDGET frames at
+ * most, and returns it with the owner's page and address space; the
+ * address space is pinned until frame_unpin, so it can't be destroyed
+ * before the pager has taken and dropped its page table lock.
+ * as_destroy calls frame_wait_unpinned to wait for that. With the
+ * lock held and the mapping checked, frame_claim gives the frame its
+ * second chance: it returns FRAME_STALE if the frame no longer
+ * belongs to that page, FRAME_AGED if it was referenced (clearing the
+ * bit), or FRAME_VICTIM, leaving the frame without an owner. (UNSW
+ * allocator only.)
  */
 
+#define FRAME_STALE  0
+#define FRAME_AGED   1
+#define FRAME_VICTIM 2
+
 void ram_bootstrap(void);
 paddr_t ram_stealmem(unsigned long npages);
 paddr_t ram_getsize(void);
 paddr_t ram_getfirstfree(void);
+void ram_getusage(unsigned *freeframes, unsigned *totalframes);
+void frame_printstats(void);
+vaddr_t alloc_zeroed_kpage(void);
+vaddr_t take_zeroed_kpage(void);
+void frame_zeroer_start(void);
+void frame_incref(paddr_t paddr);
+unsigned frame_getref(paddr_t paddr);
+void frame_setcached(paddr_t paddr);
+bool frame_uncache(paddr_t paddr, unsigned maxref);
+
+struct addrspace;
+bool frame_touch(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+bool frame_adopt(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+paddr_t frame_next_owned(struct addrspace **as, vaddr_t *vaddr,
+                         unsigned *budget);
+void frame_unpin(struct addrspace *as);
+void frame_wait_unpinned(struct addrspace *as);
+int frame_claim(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
 
 /*
  * TLB shootdown bits.
  *
+ * A shootdown names one page by the TLBHI value it would be loaded
+ * with (page and ASID), plus the ASID generation that value belongs
+ * to, so the target can tell whether its TLB could hold the entry
+ * without looking at the address space. TLBSHOOTDOWN_ALL asks for the
+ * whole TLB to be flushed.
+ *
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	uint32_t ts_tlbhi;		/* page | ASID, or TLBSHOOTDOWN_ALL */
+	uint32_t ts_asid_gen;		/* generation ts_tlbhi is from */
 };
 
+#define TLBSHOOTDOWN_ALL 0xffffffff
+
 #define TLBSHOOTDOWN_MAX 16
 
 
@@ -67,6 +67,18 @@
 vaddr_t cpustacks[MAXCPUS];
 vaddr_t cputhreads[MAXCPUS];
 
+/*
+ * Likewise, the UTLB refill handler in exception-mips1.S finds the
+ * page table of the address space loaded on this cpu here. The VM
+ * system keeps it up to date; 0 sends every miss to vm_fault().
+ */
+vaddr_t cpupagetables[MAXCPUS];
+
+/*
+ * TLB misses the fast-path refill handled on each cpu, for vmstat.
+ */
+unsigned cpurefills[MAXCPUS];
+
 /*
  * Do machine-dependent initialization of the cpu structure or things
  * associated with a new cpu. Note that we're not running on the new
@@ -36,6 +36,8 @@
 #include <proc.h>
 #include <current.h>
 #include <mips/tlb.h>
+#include <uio.h>
+#include <vnode.h>
 #include <addrspace.h>
 #include <vm.h>
 
@@ -156,6 +158,12 @@ vm_tlbshootdown(const struct tlbshootdown *ts)
 	panic("dumbvm tried to do tlb shootdown?!\n");
 }
 
+void
+vm_printstats(void)
+{
+	kprintf("dumbvm: no paging\n");
+}
+
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
@@ -400,6 +408,43 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+/*
+ * dumbvm has no demand paging, so the file image is read in right
+ * away, into the (already zeroed) memory as_prepare_load set up.
+ * Called by load_elf with AS the current address space.
+ */
+int
+as_define_backing(struct addrspace *as, vaddr_t vaddr,
+		  struct vnode *v, off_t offset, size_t filesize)
+{
+	struct iovec iov;
+	struct uio u;
+	int result;
+
+	iov.iov_ubase = (userptr_t)vaddr;
+	iov.iov_len = filesize;
+	u.uio_iov = &iov;
+	u.uio_iovcnt = 1;
+	u.uio_resid = filesize;
+	u.uio_offset = offset;
+	u.uio_segflg = UIO_USERSPACE;
+	u.uio_rw = UIO_READ;
+	u.uio_space = as;
+
+	result = VOP_READ(v, &u);
+	if (result) {
+		return result;
+	}
+
+	if (u.uio_resid != 0) {
+		/* short read; problem with executable? */
+		kprintf("ELF: short read on segment - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	return 0;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
@@ -45,7 +45,8 @@ static paddr_t lastpaddr;   /* one past end of last free physical page */
 void
 ram_bootstrap(void)
 {
-	size_t ramsize;
+	size_t ramsize, mapsize;
+	unsigned npages;
 
 	/* Get size of RAM. */
 	ramsize = mainbus_ramsize();
@@ -69,6 +70,12 @@ ram_bootstrap(void)
 	 */
 	firstpaddr = firstfree - MIPS_KSEG0;
 
+	/* Set aside kmalloc's map of the heap pages. */
+	npages = lastpaddr / PAGE_SIZE;
+	mapsize = ROUNDUP(kheap_mapsize(npages), PAGE_SIZE);
+	kheap_bootstrap((void *)PADDR_TO_KVADDR(firstpaddr), npages);
+	firstpaddr += mapsize;
+
 	kprintf("%uk physical memory available\n",
 		(lastpaddr-firstpaddr)/1024);
 }
@@ -32,6 +32,15 @@
 #include <vm.h>
 #include <mainbus.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <thread.h>
+#include <threadlist.h>
+#include <wchan.h>
+#include <reclaim.h>
+#include <addrspace.h>
+#include <platform/maxcpus.h>
 
 vaddr_t firstfree;   /* first free virtual address; set by start.S */
 
@@ -40,9 +49,51 @@ static paddr_t lastpaddr;   /* one past end of last free physical page */
 
 
 
+/*
+ * The frame table holds one entry per physical frame. Free frames are
+ * managed as a binary buddy system: a free block of 2^order frames
+ * starts at a frame number that is a multiple of 2^order, and only
+ * the first frame of the block ("the head") is marked free_head. The
+ * heads of free blocks of each order are kept on a doubly linked list
+ * threaded through the frame table by frame number.
+ *
+ * The head of an allocated block records its length in npages so
+ * free_kpages() does not need to be told the size. Single frames also
+ * carry a reference count so user pages can be shared copy-on-write;
+ * free_kpages() drops one reference and only frees the frame when the
+ * last one goes.
+ *
+ * A single frame mapped by exactly one user page also records which
+ * address space and virtual address map it, so the pager can find
+ * the page table entry of a victim. Frames without an owner (kernel
+ * memory, pages shared copy-on-write, pages in transit) are never
+ * chosen for eviction.
+ *
+ * The text page cache's hold on a frame is the cached bit, not a
+ * reference, so the count is of mappings alone: a cached text page
+ * mapped by one process has an owner and can be evicted like any
+ * other. A cached frame whose last mapping goes stays allocated, with
+ * no references, until the cache lets go of it with frame_uncache.
+ */
+
 typedef struct ft_entry {
-        unsigned allocated:1; /* the corresponding frame is allocated */
-        unsigned not_last:1; /* the frame is part of a multiframe allocation */
+        unsigned allocated:1; /* the frame heads an allocated block */
+        unsigned free_head:1; /* the frame heads a free buddy block */
+        unsigned referenced:1; /* touched since the clock hand last passed */
+        unsigned cached:1;    /* held by the text page cache */
+        unsigned order:5;     /* log2 of the free block size */
+        unsigned npages:20;   /* length of the allocated block */
+        union {
+                struct {              /* free_head frames */
+                        uint32_t next; /* free list links (frame numbers) */
+                        uint32_t prev;
+                } free;
+                struct {              /* allocated frames */
+                        uint32_t refcount;
+                        struct addrspace *owner; /* sole user mapping */
+                        vaddr_t vaddr;
+                } used;
+        } u;
 } ft_entry_t;
 
 
@@ -54,6 +105,16 @@ static uint32_t last_frame;
 #define TRUE 1
 #define FALSE 0
 
+/*
+ * 512M of RAM is 2^17 frames, so we need free lists for orders 0..17.
+ */
+#define NUM_ORDERS 18
+#define NO_FRAME 0xffffffff
+
+static uint32_t free_lists[NUM_ORDERS]; /* heads of the free lists */
+static uint32_t nfree_frames;          /* total frames on the free lists */
+static uint32_t clock_hand;            /* next frame the pager looks at */
+
 
 /* frame_table protected by spinlock (interrupt disabling on
  * uniprocessor) as this implementation does not block.
@@ -61,6 +122,58 @@ static uint32_t last_frame;
 
 static struct spinlock frame_table_spinlock = SPINLOCK_INITIALIZER;
 
+/*
+ * Per-cpu magazines of free single frames sit in front of the buddy
+ * system. Most single-frame allocations and frees only touch the
+ * local magazine; an empty magazine is refilled, and a full one
+ * drained, MAG_BATCH frames at a time under frame_table_spinlock.
+ *
+ * Frames in a magazine are neither allocated nor on a free list, so
+ * the rest of the allocator (and the clock) ignores them. Each
+ * magazine has its own spinlock, which is only ever contended when a
+ * multiframe allocation empties all magazines back into the buddy
+ * system. Lock order is magazine, then frame_table_spinlock.
+ */
+
+#define MAG_SIZE 32
+#define MAG_BATCH (MAG_SIZE / 2)
+
+struct frame_magazine {
+        struct spinlock lock;
+        unsigned count;                 /* frames in the magazine */
+        uint32_t frames[MAG_SIZE];
+        unsigned alloc_hits, alloc_misses;
+        unsigned free_hits, free_misses;
+};
+
+static struct frame_magazine magazines[MAXCPUS];
+
+/*
+ * Clean frames. A kernel thread zeroes free single frames while the
+ * cpu has nothing else to do and keeps them on a stack of clean
+ * frames, linked through u.free.next, so user pages that must start
+ * out zeroed don't pay for the bzero on the fault path. Like frames
+ * in a magazine, clean frames are neither allocated nor on a buddy
+ * free list. The stack is protected by frame_table_spinlock; the
+ * zeroing thread sleeps on zero_wchan once it holds ZERO_TARGET
+ * frames and is woken when the stack falls below ZERO_LOW.
+ */
+
+#define ZERO_TARGET 64
+#define ZERO_LOW (ZERO_TARGET / 4)
+
+static uint32_t clean_head = NO_FRAME; /* top of the clean stack */
+static unsigned nclean;                /* frames on the clean stack */
+static struct wchan *zero_wchan;
+
+static struct {
+        unsigned prezeroed;     /* frames zeroed by the thread */
+        unsigned clean_hits;    /* zeroed pages handed out clean */
+        unsigned sync_zeroed;   /* zeroed pages cleared on the spot */
+} zerostats;
+
+static void buddy_free_range(uint32_t i, uint32_t npages);
+
 /*
  * Called very early in system boot to figure out how much physical
  * RAM is available.
@@ -68,7 +181,7 @@ static struct spinlock frame_table_spinlock = SPINLOCK_INITIALIZER;
 void
 ram_bootstrap(void)
 {
-	size_t ramsize, frametable_size;
+	size_t ramsize, frametable_size, kheapmap_size;
         uint32_t npages, i;
 
 	/* Get size of RAM. */
@@ -114,6 +227,14 @@ ram_bootstrap(void)
         frame_table = (ft_entry_t *) PADDR_TO_KVADDR(firstpaddr);
         firstpaddr += frametable_size;
 
+        /* and likewise for kmalloc's map of the heap pages */
+        kheapmap_size = ROUNDUP(kheap_mapsize(npages), PAGE_SIZE);
+        if (firstpaddr + kheapmap_size >= lastpaddr) {
+                panic("vm: kmalloc page map took up all of physical memory");
+        }
+        kheap_bootstrap((void *) PADDR_TO_KVADDR(firstpaddr), npages);
+        firstpaddr += kheapmap_size;
+
         if (firstpaddr >= lastpaddr) {
                 /* This should never happen */
                 panic("vm: frame table took up all of physical memory");
@@ -129,20 +250,40 @@ ram_bootstrap(void)
         for (i = 0; i < (firstpaddr >> PAGE_BITS); i++) {
                 /* Mark as allocated as individual pages */
                 frame_table[i].allocated = TRUE;
-                frame_table[i].not_last = FALSE;
+                frame_table[i].free_head = FALSE;
+                frame_table[i].cached = FALSE;
+                frame_table[i].npages = 1;
+                frame_table[i].u.used.refcount = 1;
+                frame_table[i].u.used.owner = NULL;
         }                                            
         
         /* 
-         * The second range of frames are free
+         * The second range of frames are free. Hand them to the
+         * buddy system, which carves them into aligned blocks.
          */
         
         first_frame = firstpaddr >> PAGE_BITS;
-        
+        clock_hand = first_frame;
+
+        for (i = 0; i < NUM_ORDERS; i++) {
+                free_lists[i] = NO_FRAME;
+        }
+        nfree_frames = 0;
+
         for (i = first_frame; i < (lastpaddr >> PAGE_BITS); i++) {
                 frame_table[i].allocated = FALSE;
+                frame_table[i].free_head = FALSE;
+                frame_table[i].cached = FALSE;
         }
 
-        
+        spinlock_acquire(&frame_table_spinlock);
+        buddy_free_range(first_frame, last_frame - first_frame);
+        spinlock_release(&frame_table_spinlock);
+
+        for (i = 0; i < MAXCPUS; i++) {
+                spinlock_init(&magazines[i].lock);
+                magazines[i].count = 0;
+        }
 }
 
 /*
@@ -189,88 +330,433 @@ ram_getfirstfree(void)
 }
 
 /*
- * This is a relatively inefficient first-fit allocator. Single pages
- * always fit. Multiframe allocations can suffer from external
- * fragmentation. It is intended to be easy to understand and robust,
- * not efficient.
+ * Buddy allocator.
+ *
+ * A single frame comes straight off the order 0 free list when it is
+ * non-empty, and is otherwise split off the smallest larger block, so
+ * single-frame allocation is O(1) amortised. Freeing a single frame
+ * just pushes it back on the order 0 list; coalescing of those frames
+ * is deferred until a multiframe allocation cannot be satisfied.
+ *
+ * A request for npages frames takes a block of the next power of two
+ * up and hands the unused tail back as smaller blocks, so both
+ * multiframe allocation and free are O(log npages) plus the depth of
+ * the split or merge. When there is no block that big, a run of
+ * npages frames made of smaller free blocks that happen to be
+ * adjacent will do as well, so a request that is not a power of two
+ * (three frames, say) does not depend on finding an aligned block of
+ * the next size up.
  */
 
+/* Put the block of 2^order frames starting at i on its free list. */
+static void buddy_push(uint32_t i, unsigned order)
+{
+        KASSERT(spinlock_do_i_hold(&frame_table_spinlock));
+        KASSERT((i & ((1U << order) - 1)) == 0);
 
-static paddr_t alloc_one_frame(unsigned int npages)
+        frame_table[i].allocated = FALSE;
+        frame_table[i].free_head = TRUE;
+        frame_table[i].order = order;
+        frame_table[i].u.free.prev = NO_FRAME;
+        frame_table[i].u.free.next = free_lists[order];
+        if (free_lists[order] != NO_FRAME) {
+                frame_table[free_lists[order]].u.free.prev = i;
+        }
+        free_lists[order] = i;
+        nfree_frames += 1U << order;
+}
+
+/* Take the free block starting at i off its free list. */
+static void buddy_remove(uint32_t i)
 {
-        unsigned int i;
+        unsigned order;
+        uint32_t next, prev;
 
-        /* 
-         * Just scan from the start of the frame_table array for an
-         * unallocated block
-         */
-        
-        KASSERT(npages == 1);
+        KASSERT(spinlock_do_i_hold(&frame_table_spinlock));
+        KASSERT(frame_table[i].free_head == TRUE);
 
-        spinlock_acquire(&frame_table_spinlock);
-        for (i =  first_frame; i < last_frame; i++) {
-                if (frame_table[i].allocated == FALSE) {
-                        frame_table[i].allocated = TRUE;
-                        frame_table[i].not_last = FALSE;
+        order = frame_table[i].order;
+        next = frame_table[i].u.free.next;
+        prev = frame_table[i].u.free.prev;
+        if (prev != NO_FRAME) {
+                frame_table[prev].u.free.next = next;
+        }
+        else {
+                free_lists[order] = next;
+        }
+        if (next != NO_FRAME) {
+                frame_table[next].u.free.prev = prev;
+        }
+        frame_table[i].free_head = FALSE;
+        nfree_frames -= 1U << order;
+}
 
-                        spinlock_release(&frame_table_spinlock);
+/*
+ * Free the block of 2^order frames starting at i, merging it with its
+ * buddy for as long as the buddy is also wholly free.
+ */
+static void buddy_free_block(uint32_t i, unsigned order)
+{
+        uint32_t buddy;
 
-                        return (paddr_t) (i << PAGE_BITS);
+        while (order < NUM_ORDERS - 1) {
+                buddy = i ^ (1U << order);
+                if (buddy >= last_frame ||
+                    frame_table[buddy].free_head == FALSE ||
+                    frame_table[buddy].order != order) {
+                        break;
                 }
+                buddy_remove(buddy);
+                i &= buddy;
+                order++;
         }
-        
-        /* Did not find an unallocated frame :-( */
+        buddy_push(i, order);
+}
 
-        spinlock_release(&frame_table_spinlock);
-        return (paddr_t) 0;
+/*
+ * Free an arbitrary run of frames by splitting it into the largest
+ * aligned blocks that fit.
+ */
+static void buddy_free_range(uint32_t i, uint32_t npages)
+{
+        unsigned order;
+
+        while (npages > 0) {
+                order = 0;
+                while (order < NUM_ORDERS - 1 &&
+                       (i & (1U << order)) == 0 &&
+                       (2U << order) <= npages) {
+                        order++;
+                }
+                buddy_free_block(i, order);
+                i += 1U << order;
+                npages -= 1U << order;
+        }
 }
 
-static paddr_t alloc_multiple_frames(unsigned int npages)
+/*
+ * Merge single frames that were freed without coalescing. This is a
+ * linear pass over the frame table, but it is only needed when a
+ * multiframe request finds no block large enough.
+ */
+static void buddy_coalesce_deferred(void)
 {
-        unsigned int i,j;
+        uint32_t i;
 
+        for (i = first_frame; i < last_frame; i++) {
+                if (frame_table[i].free_head == TRUE &&
+                    frame_table[i].order == 0) {
+                        buddy_remove(i);
+                        buddy_free_block(i, 0);
+                }
+        }
+}
 
-        /* scan from 'i' for the number of needed free frames. If an
-         * allocated frame is encountered, restart the scan from after
-         * that point.
-         */
-        
+/*
+ * Take a block of at least 2^order frames off the free lists and
+ * split it down to exactly 2^order, or return NO_FRAME.
+ */
+static uint32_t buddy_take(unsigned order)
+{
+        unsigned k;
+        uint32_t i;
+
+        for (k = order; k < NUM_ORDERS; k++) {
+                if (free_lists[k] != NO_FRAME) {
+                        break;
+                }
+        }
+        if (k == NUM_ORDERS) {
+                return NO_FRAME;
+        }
+
+        i = free_lists[k];
+        buddy_remove(i);
+
+        /* return the upper halves until the block is the right size */
+        while (k > order) {
+                k--;
+                buddy_push(i + (1U << k), k);
+        }
+        return i;
+}
+
+/*
+ * Take a block of 2^order frames, the smallest that holds npages, and
+ * give its unused tail back. If there is no such block, look for a
+ * run of npages frames made of adjacent free blocks instead; that is
+ * a linear pass, like buddy_coalesce_deferred. Returns the first frame
+ * of exactly npages taken, or NO_FRAME.
+ */
+static uint32_t buddy_take_run(uint32_t npages, unsigned order)
+{
+        uint32_t i, start, run, size;
+
+        i = buddy_take(order);
+        if (i != NO_FRAME) {
+                buddy_free_range(i + npages, (1U << order) - npages);
+                return i;
+        }
+
+        start = first_frame;
+        run = 0;
+        for (i = first_frame; i < last_frame && run < npages; i += size) {
+                if (frame_table[i].free_head == FALSE) {
+                        size = 1;
+                        run = 0;
+                        start = i + 1;
+                        continue;
+                }
+                size = 1U << frame_table[i].order;
+                run += size;
+        }
+        if (run < npages) {
+                return NO_FRAME;
+        }
+
+        for (i = start; i < start + run; i += size) {
+                size = 1U << frame_table[i].order;
+                buddy_remove(i);
+        }
+        buddy_free_range(start + npages, run - npages);
+        return start;
+}
+
+/*
+ * Wake the zeroing thread if the clean stack is low. It may be asleep
+ * because the stack was full or because there was nothing free to
+ * clean, so this is done both when clean frames are taken and when
+ * frames are freed.
+ */
+static void zero_kick(void)
+{
+        KASSERT(spinlock_do_i_hold(&frame_table_spinlock));
+
+        if (nclean < ZERO_LOW && zero_wchan != NULL) {
+                wchan_wakeone(zero_wchan, &frame_table_spinlock);
+        }
+}
+
+/* Take a frame off the clean stack, or return NO_FRAME. */
+static uint32_t clean_pop(void)
+{
+        uint32_t i;
+
+        KASSERT(spinlock_do_i_hold(&frame_table_spinlock));
+
+        i = clean_head;
+        if (i == NO_FRAME) {
+                return NO_FRAME;
+        }
+        clean_head = frame_table[i].u.free.next;
+        nclean--;
+
+        zero_kick();
+        return i;
+}
+
+/*
+ * Tell the reclaim code how many frames are left. Frames sitting in
+ * magazines are not counted, which only makes it start a little
+ * early, and the count is read without the lock because it is only a
+ * hint.
+ */
+static void frame_check_free(void)
+{
+        reclaim_check(nfree_frames + nclean);
+}
+
+/*
+ * Lock and return this cpu's magazine, or NULL early in boot before
+ * there is a curcpu. The magazine lock keeps us on this cpu.
+ */
+static struct frame_magazine *mag_get(void)
+{
+        struct frame_magazine *mag;
+        int spl;
+
+        if (!CURCPU_EXISTS()) {
+                return NULL;
+        }
+
+        spl = splhigh();
+        mag = &magazines[curcpu->c_number];
+        spinlock_acquire(&mag->lock);
+        splx(spl);
+
+        return mag;
+}
+
+/* Move up to MAG_BATCH frames from the buddy system into MAG. */
+static void mag_refill(struct frame_magazine *mag)
+{
+        uint32_t i;
+
+        KASSERT(spinlock_do_i_hold(&mag->lock));
 
         spinlock_acquire(&frame_table_spinlock);
+        while (mag->count < MAG_BATCH) {
+                i = buddy_take(0);
+                if (i == NO_FRAME) {
+                        break;
+                }
+                mag->frames[mag->count++] = i;
+        }
+        spinlock_release(&frame_table_spinlock);
+}
+
+/* Hand the frames of MAG above LEAVE back to the buddy system. */
+static void mag_drain(struct frame_magazine *mag, unsigned leave)
+{
+        KASSERT(spinlock_do_i_hold(&mag->lock));
+
+        spinlock_acquire(&frame_table_spinlock);
+        while (mag->count > leave) {
+                buddy_push(mag->frames[--mag->count], 0);
+        }
+        zero_kick();
+        spinlock_release(&frame_table_spinlock);
+}
+
+/*
+ * Empty every magazine, so their frames can be coalesced. Called with
+ * no locks held.
+ */
+static void mag_drain_all(void)
+{
+        unsigned i;
+
+        for (i = 0; i < MAXCPUS; i++) {
+                spinlock_acquire(&magazines[i].lock);
+                mag_drain(&magazines[i], 0);
+                spinlock_release(&magazines[i].lock);
+        }
+}
+
+static paddr_t alloc_one_frame(unsigned int npages)
+{
+        struct frame_magazine *mag;
+        uint32_t i;
 
-        i = first_frame; j = 0;
+        KASSERT(npages == 1);
 
-        while (i < (last_frame - npages) && j < npages) {
-                if (frame_table[i+j].allocated == TRUE) {
-                        i = i + j + 1; /* continue scan after allocated frame */
-                        j = 0;         /* restart the count */
+        mag = mag_get();
+        if (mag != NULL) {
+                if (mag->count > 0) {
+                        mag->alloc_hits++;
                 }
                 else {
-                        j = j + 1; /* increment count of free frames */
+                        mag->alloc_misses++;
+                        mag_refill(mag);
                 }
+                if (mag->count > 0) {
+                        i = mag->frames[--mag->count];
+                        spinlock_release(&mag->lock);
+
+                        /* nobody else can see the frame yet */
+                        frame_table[i].npages = 1;
+                        frame_table[i].u.used.refcount = 1;
+                        frame_table[i].u.used.owner = NULL;
+                        frame_table[i].allocated = TRUE;
+
+                        return (paddr_t) (i << PAGE_BITS);
+                }
+                spinlock_release(&mag->lock);
+                /* try the buddy system once more; someone may have freed */
+        }
+
+        spinlock_acquire(&frame_table_spinlock);
+
+        i = buddy_take(0);
+        if (i == NO_FRAME) {
+                /* the last free frames may have been zeroed already */
+                i = clean_pop();
+        }
+        if (i == NO_FRAME) {
+                /* or be sitting in other cpus' magazines */
+                spinlock_release(&frame_table_spinlock);
+                mag_drain_all();
+                spinlock_acquire(&frame_table_spinlock);
+                i = buddy_take(0);
+        }
+        if (i == NO_FRAME) {
+                /* Did not find an unallocated frame :-( */
+                spinlock_release(&frame_table_spinlock);
+                return (paddr_t) 0;
         }
 
-        if  (j == npages) { /* we exited as we found the number of frames required. */
-                for (j = i; j < i + npages - 1; j++) {
-                        frame_table[j].allocated = TRUE; /* mark frame allocated */
-                        frame_table[j].not_last = TRUE;  /* as a contiguous block */
+        frame_table[i].allocated = TRUE;
+        frame_table[i].npages = 1;
+        frame_table[i].u.used.refcount = 1;
+        frame_table[i].u.used.owner = NULL;
+
+        spinlock_release(&frame_table_spinlock);
+
+        return (paddr_t) (i << PAGE_BITS);
+}
+
+static paddr_t alloc_multiple_frames(unsigned int npages)
+{
+        unsigned order;
+        uint32_t i;
+
+        order = 0;
+        while ((1U << order) < npages) {
+                order++;
+                if (order >= NUM_ORDERS) {
+                        return (paddr_t) 0;
                 }
-                frame_table[j].allocated = TRUE;
-                frame_table[j].not_last = FALSE;
+        }
+
+        spinlock_acquire(&frame_table_spinlock);
 
+        i = buddy_take(order);
+        if (i != NO_FRAME) {
+                /* give back what we don't need from the end of the block */
+                buddy_free_range(i + npages, (1U << order) - npages);
+        }
+        else {
+                buddy_coalesce_deferred();
+                i = buddy_take_run(npages, order);
+        }
+        if (i == NO_FRAME) {
+                /* the frames we need may be sitting in magazines */
                 spinlock_release(&frame_table_spinlock);
-                
-                return (paddr_t) (i << PAGE_BITS);
+                mag_drain_all();
+                spinlock_acquire(&frame_table_spinlock);
+                while ((i = clean_pop()) != NO_FRAME) {
+                        buddy_push(i, 0);
+                }
+                buddy_coalesce_deferred();
+                i = buddy_take_run(npages, order);
         }
-        
-        /* Did not find an unallocated contiguous range of frames :-( */
+        if (i == NO_FRAME) {
+                /* Did not find an unallocated contiguous range of frames :-( */
+                spinlock_release(&frame_table_spinlock);
+                return (paddr_t) 0;
+        }
+
+        frame_table[i].allocated = TRUE;
+        frame_table[i].npages = npages;
+        frame_table[i].u.used.refcount = 1;
+        frame_table[i].u.used.owner = NULL;
 
         spinlock_release(&frame_table_spinlock);
-        return (paddr_t) 0;
+
+        return (paddr_t) (i << PAGE_BITS);
 }
 
+/*
+ * A caller freeing the last reference to a frame is the only one who
+ * can see it, so it can go straight into the magazine without the
+ * global lock. Owned user frames are only freed with their owner's
+ * page table lock held, and the pager checks the frame under that
+ * lock before claiming it (see frame_claim), so it never takes a
+ * frame that is being freed.
+ */
 static void free_frames(vaddr_t vaddr)
 {
+        struct frame_magazine *mag;
         paddr_t paddr;
         uint32_t i;
 
@@ -279,37 +765,513 @@ static void free_frames(vaddr_t vaddr)
         paddr = KVADDR_TO_PADDR(vaddr);
 
         i = paddr >> PAGE_BITS;
+        KASSERT(i >= first_frame && i < last_frame);
+
+        if (frame_table[i].allocated == TRUE &&
+            frame_table[i].npages == 1 &&
+            frame_table[i].u.used.refcount == 1 &&
+            frame_table[i].cached == FALSE &&
+            (mag = mag_get()) != NULL) {
+                frame_table[i].u.used.refcount = 0;
+                frame_table[i].u.used.owner = NULL;
+                frame_table[i].allocated = FALSE;
+
+                if (mag->count < MAG_SIZE) {
+                        mag->free_hits++;
+                }
+                else {
+                        mag->free_misses++;
+                        mag_drain(mag, MAG_SIZE - MAG_BATCH);
+                }
+                mag->frames[mag->count++] = i;
+                spinlock_release(&mag->lock);
+                return;
+        }
 
         spinlock_acquire(&frame_table_spinlock);
 
         if (frame_table[i].allocated == FALSE) { /* check for double free error */
                 panic("Double free error!!");
         }
-        
-        while (frame_table[i].allocated == TRUE) { /* otherwise mark block free */
+
+        KASSERT(frame_table[i].u.used.refcount > 0);
+        if (--frame_table[i].u.used.refcount > 0) {
+                /* still mapped somewhere else */
+                spinlock_release(&frame_table_spinlock);
+                return;
+        }
+        if (frame_table[i].cached == TRUE) {
+                /* the page cache keeps it for the next process */
+                frame_table[i].u.used.owner = NULL;
+                spinlock_release(&frame_table_spinlock);
+                return;
+        }
+
+        frame_table[i].allocated = FALSE;
+        if (frame_table[i].npages == 1) {
+                /* cheap path: coalesce later if we ever need to */
+                buddy_push(i, 0);
+        }
+        else {
+                buddy_free_range(i, frame_table[i].npages);
+        }
+        zero_kick();
+
+        spinlock_release(&frame_table_spinlock);
+}
+
+/*
+ * Reference counting for shared (copy-on-write) single frames. The
+ * allocation holds the first reference; free_kpages() drops one.
+ */
+void
+frame_incref(paddr_t paddr)
+{
+        uint32_t i = paddr >> PAGE_BITS;
+
+        KASSERT(i >= first_frame && i < last_frame);
+
+        spinlock_acquire(&frame_table_spinlock);
+        KASSERT(frame_table[i].allocated == TRUE);
+        KASSERT(frame_table[i].npages == 1);
+        frame_table[i].u.used.refcount++;
+        /* shared frames have no single owner to evict them from */
+        frame_table[i].u.used.owner = NULL;
+        spinlock_release(&frame_table_spinlock);
+}
+
+/*
+ * Mark the single frame at PADDR, which the caller holds a reference
+ * to, as held by the text page cache.
+ */
+void
+frame_setcached(paddr_t paddr)
+{
+        uint32_t i = paddr >> PAGE_BITS;
+
+        KASSERT(i >= first_frame && i < last_frame);
+
+        spinlock_acquire(&frame_table_spinlock);
+        KASSERT(frame_table[i].allocated == TRUE);
+        KASSERT(frame_table[i].npages == 1);
+        KASSERT(frame_table[i].cached == FALSE);
+        frame_table[i].cached = TRUE;
+        spinlock_release(&frame_table_spinlock);
+}
+
+/*
+ * Release the text page cache's hold on the frame at PADDR if no more
+ * than MAXREF pages map it, freeing the frame if none do. Returns
+ * whether the hold was released. The page cache calls this with its
+ * lock held, so no new mapping can appear in the meantime.
+ */
+bool
+frame_uncache(paddr_t paddr, unsigned maxref)
+{
+        uint32_t i = paddr >> PAGE_BITS;
+
+        KASSERT(i >= first_frame && i < last_frame);
+
+        spinlock_acquire(&frame_table_spinlock);
+        KASSERT(frame_table[i].allocated == TRUE);
+        KASSERT(frame_table[i].cached == TRUE);
+        if (frame_table[i].u.used.refcount > maxref) {
+                spinlock_release(&frame_table_spinlock);
+                return false;
+        }
+
+        frame_table[i].cached = FALSE;
+        if (frame_table[i].u.used.refcount == 0) {
                 frame_table[i].allocated = FALSE;
-                if (frame_table[i].not_last == TRUE) {
-                        i++;
+                buddy_push(i, 0);
+                zero_kick();
+        }
+        spinlock_release(&frame_table_spinlock);
+        return true;
+}
+
+unsigned
+frame_getref(paddr_t paddr)
+{
+        uint32_t i = paddr >> PAGE_BITS;
+        unsigned refcount;
+
+        KASSERT(i >= first_frame && i < last_frame);
+
+        spinlock_acquire(&frame_table_spinlock);
+        KASSERT(frame_table[i].allocated == TRUE);
+        refcount = frame_table[i].u.used.refcount;
+        spinlock_release(&frame_table_spinlock);
+
+        return refcount;
+}
+
+/*
+ * Common code for frame_touch and frame_adopt: if the mapping of the
+ * frame at PADDR by AS/VADDR is the only one, make it the frame's
+ * owner so the frame can be evicted, and if REFERENCED set the
+ * reference bit. Returns whether the frame has an owner. The caller
+ * holds the page table lock of AS, and AS frees the frame before it
+ * is destroyed, so the owner recorded here stays valid while the
+ * frame table names it.
+ */
+static
+bool
+frame_setowner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr,
+               bool referenced)
+{
+        uint32_t i = paddr >> PAGE_BITS;
+        bool owned;
+
+        KASSERT(i >= first_frame && i < last_frame);
+
+        spinlock_acquire(&frame_table_spinlock);
+        KASSERT(frame_table[i].allocated == TRUE);
+        if (referenced) {
+                frame_table[i].referenced = TRUE;
+        }
+        owned = frame_table[i].u.used.refcount == 1;
+        if (owned) {
+                frame_table[i].u.used.owner = as;
+                frame_table[i].u.used.vaddr = vaddr;
+        }
+        spinlock_release(&frame_table_spinlock);
+
+        return owned;
+}
+
+/*
+ * Note that the user page VADDR in AS has just been loaded into the
+ * TLB from the frame at PADDR.
+ */
+bool
+frame_touch(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+        return frame_setowner(paddr, as, vaddr, true);
+}
+
+/*
+ * Note that the user page VADDR in AS has been mapped to the frame at
+ * PADDR without being used.
+ */
+bool
+frame_adopt(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+        return frame_setowner(paddr, as, vaddr, false);
+}
+
+/*
+ * Advance the clock hand to the next frame that has an owner, taking
+ * one step off *BUDGET for each frame looked at, and hand back the
+ * owner's address space and virtual address. Returns 0 once the
+ * budget runs out.
+ *
+ * The pager can't take the owner's page table lock while it holds the
+ * frame table lock, so instead the owner is pinned: as_destroy waits
+ * in frame_wait_unpinned until the pager drops it with frame_unpin.
+ * The owner is still alive when it is pinned, as its frames name it.
+ * The frame itself may change hands in the meantime, so the pager
+ * must check the mapping again under the page table lock.
+ */
+paddr_t
+frame_next_owned(struct addrspace **as, vaddr_t *vaddr, unsigned *budget)
+{
+        uint32_t i;
+
+        spinlock_acquire(&frame_table_spinlock);
+
+        while (*budget > 0) {
+                (*budget)--;
+                i = clock_hand;
+                if (++clock_hand == last_frame) {
+                        clock_hand = first_frame;
+                }
+
+                if (frame_table[i].allocated == FALSE ||
+                    frame_table[i].u.used.owner == NULL) {
+                        continue;
+                }
+
+                *as = frame_table[i].u.used.owner;
+                *vaddr = frame_table[i].u.used.vaddr;
+                (*as)->as_pins++;
+                spinlock_release(&frame_table_spinlock);
+                return (paddr_t) (i << PAGE_BITS);
+        }
+
+        spinlock_release(&frame_table_spinlock);
+        return 0;
+}
+
+/*
+ * Drop the pin frame_next_owned put on AS.
+ */
+void
+frame_unpin(struct addrspace *as)
+{
+        spinlock_acquire(&frame_table_spinlock);
+        KASSERT(as->as_pins > 0);
+        as->as_pins--;
+        spinlock_release(&frame_table_spinlock);
+}
+
+/*
+ * Wait until no pager has AS pinned. Called by as_destroy once none
+ * of AS's frames are left, so no new pins can appear. Pagers only
+ * hold a pin while they look at or write out one page, so we just
+ * yield until they are done.
+ */
+void
+frame_wait_unpinned(struct addrspace *as)
+{
+        unsigned pins;
+
+        for (;;) {
+                spinlock_acquire(&frame_table_spinlock);
+                pins = as->as_pins;
+                spinlock_release(&frame_table_spinlock);
+                if (pins == 0) {
+                        break;
+                }
+                thread_yield();
+        }
+}
+
+/*
+ * Second-chance test for the frame at PADDR, which frame_next_owned
+ * found and the pager has since found still mapped by AS at VADDR,
+ * with AS's page table lock held. If the frame is no longer allocated
+ * or owned by that page, it has changed hands: FRAME_STALE. If it has
+ * been touched since the hand last passed, its reference bit is
+ * cleared: FRAME_AGED. Otherwise it loses its owner, so it is not
+ * picked again while the pager writes it out: FRAME_VICTIM.
+ */
+int
+frame_claim(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+        uint32_t i = paddr >> PAGE_BITS;
+        int result;
+
+        KASSERT(i >= first_frame && i < last_frame);
+
+        spinlock_acquire(&frame_table_spinlock);
+        if (frame_table[i].allocated == FALSE ||
+            frame_table[i].u.used.owner != as ||
+            frame_table[i].u.used.vaddr != vaddr) {
+                result = FRAME_STALE;
+        }
+        else if (frame_table[i].referenced == TRUE) {
+                frame_table[i].referenced = FALSE;
+                result = FRAME_AGED;
+        }
+        else {
+                frame_table[i].u.used.owner = NULL;
+                result = FRAME_VICTIM;
+        }
+        spinlock_release(&frame_table_spinlock);
+
+        return result;
+}
+
+/*
+ * Take a frame the zeroing thread has already cleared, if there is
+ * one. Never allocates, zeroes or reclaims anything else, so it may
+ * be called with spinlocks held. Returns its kernel address, or 0.
+ */
+vaddr_t
+take_zeroed_kpage(void)
+{
+        uint32_t i;
+
+        spinlock_acquire(&frame_table_spinlock);
+        i = clean_pop();
+        if (i == NO_FRAME) {
+                spinlock_release(&frame_table_spinlock);
+                return 0;
+        }
+        frame_table[i].allocated = TRUE;
+        frame_table[i].npages = 1;
+        frame_table[i].u.used.refcount = 1;
+        frame_table[i].u.used.owner = NULL;
+        zerostats.clean_hits++;
+        spinlock_release(&frame_table_spinlock);
+
+        return PADDR_TO_KVADDR((paddr_t) (i << PAGE_BITS));
+}
+
+/*
+ * Allocate a single frame whose contents are all zero, preferring
+ * one the zeroing thread has already cleared. Returns its kernel
+ * address, or 0 if memory is full.
+ */
+vaddr_t
+alloc_zeroed_kpage(void)
+{
+        vaddr_t vaddr;
+
+        vaddr = take_zeroed_kpage();
+        if (vaddr != 0) {
+                frame_check_free();
+                return vaddr;
+        }
+
+        vaddr = alloc_kpages(1);
+        if (vaddr == 0) {
+                return 0;
+        }
+        bzero((void *) vaddr, PAGE_SIZE);
+
+        spinlock_acquire(&frame_table_spinlock);
+        zerostats.sync_zeroed++;
+        spinlock_release(&frame_table_spinlock);
+
+        return vaddr;
+}
+
+/*
+ * The zeroing thread. It only works when nothing else on its cpu is
+ * runnable, giving way after every frame, so it behaves as if it ran
+ * at idle priority. A frame being zeroed is off every list, so
+ * nobody else can touch it.
+ */
+static
+void
+frame_zeroer(void *data1, unsigned long data2)
+{
+        uint32_t i;
+
+        (void) data1;
+        (void) data2;
+
+        for (;;) {
+                /* let anything else that wants the cpu go first */
+                while (curcpu->c_runqueue.tl_count > 0) {
+                        thread_yield();
+                }
+
+                spinlock_acquire(&frame_table_spinlock);
+                i = NO_FRAME;
+                if (nclean < ZERO_TARGET) {
+                        i = buddy_take(0);
                 }
+                if (i == NO_FRAME) {
+                        /* full, or no free frames to clean */
+                        wchan_sleep(zero_wchan, &frame_table_spinlock);
+                        spinlock_release(&frame_table_spinlock);
+                        continue;
+                }
+                spinlock_release(&frame_table_spinlock);
+
+                bzero((void *) PADDR_TO_KVADDR((paddr_t) (i << PAGE_BITS)),
+                      PAGE_SIZE);
+
+                spinlock_acquire(&frame_table_spinlock);
+                frame_table[i].u.free.next = clean_head;
+                clean_head = i;
+                nclean++;
+                zerostats.prezeroed++;
+                spinlock_release(&frame_table_spinlock);
+        }
+}
+
+/*
+ * Start the zeroing thread. Called by the VM system once threads
+ * can be created.
+ */
+void
+frame_zeroer_start(void)
+{
+        int result;
+
+        zero_wchan = wchan_create("frame_zeroer");
+        if (zero_wchan == NULL) {
+                panic("frame_zeroer_start: out of memory\n");
+        }
+
+        result = thread_fork("frame_zeroer", NULL, frame_zeroer, NULL, 0);
+        if (result) {
+                panic("frame_zeroer_start: thread_fork failed: %s\n",
+                      strerror(result));
+        }
+}
+
+/*
+ * Report how many frames are free and how many the allocator manages
+ * in total. The numbers are a snapshot and may be stale immediately.
+ */
+void
+ram_getusage(unsigned *freeframes, unsigned *totalframes)
+{
+        unsigned i, cached = 0;
+
+        for (i = 0; i < MAXCPUS; i++) {
+                cached += magazines[i].count;
         }
+
+        spinlock_acquire(&frame_table_spinlock);
+        *freeframes = nfree_frames + nclean + cached;
+        *totalframes = last_frame - first_frame;
         spinlock_release(&frame_table_spinlock);
 }
+
+/*
+ * Print the magazine hit and miss counts of each cpu that has used
+ * its magazine. Like ram_getusage() this is only a snapshot.
+ */
+void
+frame_printstats(void)
+{
+        struct frame_magazine *mag;
+        unsigned i, clean, prezeroed, clean_hits, sync_zeroed;
+
+        spinlock_acquire(&frame_table_spinlock);
+        clean = nclean;
+        prezeroed = zerostats.prezeroed;
+        clean_hits = zerostats.clean_hits;
+        sync_zeroed = zerostats.sync_zeroed;
+        spinlock_release(&frame_table_spinlock);
+
+        kprintf("frames: %u clean, %u pre-zeroed; zeroed pages: %u taken "
+                "clean, %u zeroed synchronously\n", clean, prezeroed,
+                clean_hits, sync_zeroed);
+
+        for (i = 0; i < MAXCPUS; i++) {
+                mag = &magazines[i];
+                if (mag->alloc_hits + mag->alloc_misses +
+                    mag->free_hits + mag->free_misses == 0) {
+                        continue;
+                }
+                kprintf("frames: cpu%u: %u cached, alloc %u hits %u misses, "
+                        "free %u hits %u misses\n", i, mag->count,
+                        mag->alloc_hits, mag->alloc_misses,
+                        mag->free_hits, mag->free_misses);
+        }
+}
         
+static paddr_t alloc_frames(unsigned npages)
+{
+        if (npages > 1 ) {
+                return alloc_multiple_frames(npages);
+        }
+        return alloc_one_frame(npages);
+}
+
 /* Allocate/free some kernel-space virtual pages */
 vaddr_t
 alloc_kpages(unsigned npages)
 {
         paddr_t paddr;
-        if (npages > 1 ) {
-                paddr = alloc_multiple_frames(npages);
-        }
-        else {
-                paddr = alloc_one_frame(npages);
+
+        paddr = alloc_frames(npages);
+        if (paddr == 0 && reclaim_pages(npages) > 0) {
+                /* Out of frames, but the shrinkers found some */
+                paddr = alloc_frames(npages);
         }
         
 	if (paddr == 0) {
 		return 0;
 	}
+        frame_check_free();
 	return PADDR_TO_KVADDR(paddr);
 }
 
@@ -318,4 +1280,3 @@ free_kpages(vaddr_t addr)
 {
         free_frames(addr);
 }
-
@@ -30,16 +30,55 @@
 #ifndef _ADDRSPACE_H_
 #define _ADDRSPACE_H_
 
-// First level 2^11 and second level 2^9
-#define FIRST_LEVEL 2048
-#define SECOND_LEVEL 512
-#define NUM_STACK_PAGES 16
+// Second-level tables hold 2^10 entries, so each is exactly one page
+// and comes from the page table pool in vm.c. User addresses are below
+// 2 GiB, so the first level only needs 2^9 entries (2 KiB).
+#define FIRST_LEVEL 512
+#define SECOND_LEVEL 1024
+
+// The user stack starts out STACK_INIT_PAGES long and vm_fault() grows
+// it downwards on demand, up to the process's stack limit (default
+// STACK_LIMIT_DEFAULT bytes, settable with setrlimit() up to
+// STACK_LIMIT_MAX). Nothing else is placed within STACK_GUARD_PAGES
+// below that limit, so an overflow faults instead of running into the
+// heap or a mapping.
+#define STACK_INIT_PAGES 2
+#define STACK_GUARD_PAGES 16
+#define STACK_LIMIT_DEFAULT (1024 * 1024)
+#define STACK_LIMIT_MAX (64 * 1024 * 1024)
+
+// Page table indices of a user virtual address: the top 10 bits pick
+// the first-level slot, the next 10 bits the second-level slot.
+// PT_VADDR goes back from the indices to the page's address.
+#define PT_L1_INDEX(va) ((va) >> 22)
+#define PT_L2_INDEX(va) (((va) >> 12) & (SECOND_LEVEL - 1))
+#define PT_VADDR(i1, i2) (((vaddr_t)(i1) << 22) | ((vaddr_t)(i2) << 12))
+
+// Page table entries hold the TLBLO word for a resident page. The low
+// byte is ignored by the hardware, so we keep software state there:
+// a page on swap has PTE_SWAPPED set and its slot number where the
+// frame number would be, and a page being moved to or from swap has
+// PTE_BUSY set until the transfer is done. PTE_ACCESSED is the page's
+// reference bit: vm_fault() sets it when it loads the TLB, if the
+// frame has an owner (is not shared), and the pager clears it
+// (dropping the TLB entry) when it ages the page. The assembly TLB
+// refill in exception-mips1.S only loads entries with it set, so the
+// pager sees every page that is in use, and a shared frame is seen
+// again by vm_fault() once the sharing ends.
+#define PTE_SWAPPED 0x1
+#define PTE_BUSY 0x2
+#define PTE_ACCESSED 0x4
+#define PTE_SOFTBITS 0xff
+#define PTE_SWAP_SLOT(pte) ((pte) >> 12)
+#define PTE_MKSWAP(slot) (((paddr_t)(slot) << 12) | PTE_SWAPPED)
 
 /*
  * Address space structure and operations.
  */
 
 #include <vm.h>
+#include <kern/vmstat.h>
+#include <spinlock.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
@@ -52,7 +91,16 @@ struct region
         int writeable;       // permission of writeable
         int executable;      // permission of executable
         int old_writeable;   // permission of previous writeable
-        struct region *next; // link to the next list slot
+
+        // Backing store for demand-loaded segments and mmap()ed files
+        // (vnode is NULL for anonymous regions). The file image covers
+        // file_size bytes starting at file_vaddr; the rest of the region
+        // is zero-filled.
+        struct vnode *vnode; // file the region comes from
+        vaddr_t file_vaddr;  // unaligned start of the segment
+        off_t file_offset;   // offset of the segment in the file
+        size_t file_size;    // length of the segment in the file
+        int mapped;          // mmap()ed: dirty pages go back to the file
 };
 
 /*
@@ -75,7 +123,60 @@ struct addrspace
 #else
         /* Put stuff here for your VM system */
         paddr_t **pagetable;
-        struct region *region_list;
+        unsigned as_ptpages; // second-level tables allocated
+
+        // The page table lock: every entry in pagetable is read and
+        // changed with it held, and faults waiting on a busy entry
+        // sleep on as_ptwchan. The pager takes the lock of whichever
+        // address space owns its victim.
+        struct spinlock as_ptlock;
+        struct wchan *as_ptwchan;
+
+        // Pagers that have found this address space through the frame
+        // table and may still take as_ptlock; as_destroy waits for
+        // them. Protected by the frame table lock (see
+        // frame_next_owned).
+        unsigned as_pins;
+
+        // Regions sorted by base address, so lookups are a binary
+        // search. The array is only changed with as_ptlock held, as
+        // the pager looks up regions of other address spaces.
+        struct region **regions;
+        unsigned nregions;           // regions in use
+        unsigned maxregions;         // size of the array
+        struct region *last_region;  // last region as_find_region hit
+
+        // The heap region, and the break: the (unaligned) end of the
+        // heap as set by sbrk(). The region covers the break rounded
+        // up to a page.
+        struct region *heap;
+        vaddr_t heap_end;
+
+        // The stack region, and the lowest address it may grow down to
+        struct region *stack;
+        vaddr_t stack_floor;
+
+        // TLB entries of this address space are tagged with as_asid,
+        // which is only good while as_asid_gen is the current ASID
+        // generation (see vm_tlb_activate)
+        unsigned as_asid;
+        uint32_t as_asid_gen;
+
+        // Cpus, one bit each, that may have entries for as_asid, and
+        // those of them that must drop them before running AS again.
+        // Protected by the ASID lock (see vm_tlb_send_shootdown).
+        uint32_t as_tlbcpus;
+        uint32_t as_tlbstale;
+
+        // Fault-around: pages mapped and TLB entries loaded ahead of
+        // use, i.e. faults saved if they are then touched
+        unsigned as_fa_mapped;
+        unsigned as_fa_preloaded;
+
+        // This address space's share of the vmstat() counters: the
+        // fault, fill, copy and paging fields. Protected by
+        // as_ptlock.
+        struct vmstat as_vmstat;
 #endif
 };
 
@@ -104,17 +205,94 @@ struct addrspace
  *                the way this works if implementing user-level threads.
  *
  *    as_define_region - set up a region of memory within the address
- *                space.
+ *                space. Fails with EINVAL if it overlaps an existing
+ *                region.
  *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
  *    as_complete_load - this is called when loading from an executable
- *                is complete.
+ *                is complete. Sets up the (empty) heap region above
+ *                the last segment.
  *
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *                The stack may later grow to curproc's p_stacklimit.
+ *
+ *    as_grow_stack - extend the stack down to cover VADDR, if that is
+ *                within its limit. Returns EFAULT otherwise.
+ *
+ *    as_define_backing - attach a file image to the region containing
+ *                VADDR, so its pages are read in by vm_fault() on
+ *                first touch instead of at load time.
+ *
+ *    as_find_region - return the region containing a user address, or
+ *                NULL if the address is not part of any region. Tries
+ *                the last region found first, then binary searches.
+ *
+ *    as_sbrk   - move the break by AMOUNT bytes, handing back the old
+ *                break. Fails with EINVAL below the start of the heap
+ *                and ENOMEM if the heap would run into the next
+ *                region.
+ *
+ *    as_mmap   - map SIZE bytes of V starting at OFFSET, of which
+ *                FILESIZE exist in the file, at an address of our
+ *                choosing below the stack. Nothing is read until the
+ *                pages are touched.
+ *
+ *    as_munmap - write back and remove the mapping starting at VADDR.
+ *                Fails with EINVAL if there is none.
+ *
+ *    as_msync  - write the dirty pages of the mapping starting at
+ *                VADDR back to its file.
+ *
+ *    as_lookup_pte - return a pointer to the page table entry for a
+ *                user address. If there is no second-level table for
+ *                it and *NEWTABLE (if NEWTABLE is not NULL) is a table
+ *                from pt_alloc_table, that is put in and *NEWTABLE
+ *                set to NULL; otherwise returns NULL. Called with
+ *                the page table lock of AS held. Lives in vm.c.
+ *
+ *    as_ptusage - bytes of memory AS uses for its page table.
+ *
+ *    pt_alloc_table - get a zeroed page for a second-level table, from
+ *                the pool of free ones if possible. NULL if out of
+ *                memory. Must be called without spinlocks held, as it
+ *                may have to reclaim memory. Lives in vm.c.
+ *
+ *    pt_free_table - give back a second-level table, which must be
+ *                all zeroes again. Lives in vm.c.
+ *
+ *    pt_wait   - sleep until a busy page table entry of AS may have
+ *                changed. Drops and retakes AS's page table lock,
+ *                which must be held. Lives in vm.c.
+ *
+ *    pt_wakeup - wake everyone in pt_wait on AS after clearing
+ *                PTE_BUSY. Lives in vm.c.
+ *
+ *    vm_swapcopy - give a forked child its own resident copy of a
+ *                page that is on swap. Lives in vm.c.
+ *
+ *    vm_tlb_activate - make AS the address space the TLB matches
+ *                against on this cpu, giving it an ASID if needed.
+ *                Lives in vm.c.
+ *
+ *    vm_tlb_flush_as - drop the TLB entries for AS, on this cpu
+ *                and, by TLB shootdown, on the others. Lives in vm.c.
+ *
+ *    vm_tlb_destroy_as - drop this cpu's TLB entries for AS and stop
+ *                the TLB refill handler using AS's page table. Other
+ *                cpus' entries are left; the ASID is not reused in
+ *                this generation. For as_destroy. Lives in vm.c.
+ *
+ *    vm_unmap_range - free the pages of AS between START and END
+ *                (page-aligned) and drop their TLB entries. Lives in
+ *                vm.c.
+ *
+ *    vm_msync_region - write the dirty pages of a mapped region back
+ *                to its file and write-protect them, so later stores
+ *                dirty them again. Lives in vm.c.
  *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
@@ -134,6 +312,28 @@ int as_define_region(struct addrspace *as,
 int as_prepare_load(struct addrspace *as);
 int as_complete_load(struct addrspace *as);
 int as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int as_grow_stack(struct addrspace *as, vaddr_t vaddr);
+int as_define_backing(struct addrspace *as, vaddr_t vaddr,
+                      struct vnode *v, off_t offset, size_t filesize);
+struct region *as_find_region(struct addrspace *as, vaddr_t vaddr);
+int as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak);
+int as_mmap(struct addrspace *as, size_t size, int writeable,
+            struct vnode *v, off_t offset, size_t filesize, vaddr_t *ret);
+int as_munmap(struct addrspace *as, vaddr_t vaddr);
+int as_msync(struct addrspace *as, vaddr_t vaddr);
+paddr_t *as_lookup_pte(struct addrspace *as, vaddr_t vaddr, paddr_t **newtable);
+size_t as_ptusage(struct addrspace *as);
+
+void pt_wait(struct addrspace *as);
+void pt_wakeup(struct addrspace *as);
+int vm_swapcopy(paddr_t pte, paddr_t *ret);
+paddr_t *pt_alloc_table(void);
+void pt_free_table(paddr_t *table);
+void vm_tlb_activate(struct addrspace *as);
+void vm_tlb_flush_as(struct addrspace *as);
+void vm_tlb_destroy_as(struct addrspace *as);
+void vm_unmap_range(struct addrspace *as, vaddr_t start, vaddr_t end);
+int vm_msync_region(struct addrspace *as, struct region *region);
 
 /*
  * Functions in loadelf.c
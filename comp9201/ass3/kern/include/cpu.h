@@ -61,6 +61,8 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	uint32_t c_asid_generation;	/* ASID generation of our TLB */
+	unsigned c_asid;		/* ASID currently loaded */
 
 	/*
 	 * Accessed by other cpus.
@@ -82,10 +84,16 @@ struct cpu {
 	 * The contents of struct tlbshootdown are also machine-
 	 * dependent and might reasonably be either an address space
 	 * and vaddr pair, or a paddr, or something else.
+	 *
+	 * c_shootdown_seq counts requests ever queued and
+	 * c_shootdown_done how many of them have been carried out,
+	 * so ipi_tlbshootdown_wait can tell when its own are done.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	unsigned c_numshootdown;
+	volatile unsigned c_shootdown_seq;
+	volatile unsigned c_shootdown_done;
 	struct spinlock c_ipi_lock;
 
 	/*
@@ -155,6 +163,10 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * Requests queue up on the target until it takes the interrupt; past
+ * TLBSHOOTDOWN_MAX they are merged into a flush of the whole TLB.
+ * ipi_tlbshootdown_wait waits until every shootdown queued so far has
+ * been done; call it without holding spinlocks.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -169,6 +181,7 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_wait(void);
 
 void interprocessor_interrupt(void);
 
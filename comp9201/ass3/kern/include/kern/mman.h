@@ -0,0 +1,14 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Protection flags for the (UNSW) mmap(), shared between the kernel
+ * and <unistd.h>. Mappings are always readable; there is no separate
+ * execute permission.
+ */
+
+#define PROT_READ     1      /* Pages may be read */
+#define PROT_WRITE    2      /* Pages may be written */
+
+
+#endif /* _KERN_MMAN_H_ */
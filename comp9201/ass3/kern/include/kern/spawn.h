@@ -0,0 +1,26 @@
+#ifndef _KERN_SPAWN_H_
+#define _KERN_SPAWN_H_
+
+/*
+ * File actions for spawn(), shared between the kernel and
+ * <unistd.h>. They are applied in order to the new process's copy of
+ * the caller's file table before the program starts:
+ *
+ *    SPAWN_CLOSE   close sa_fd
+ *    SPAWN_DUP2    dup2(sa_fd, sa_newfd)
+ */
+
+struct spawn_action {
+	int sa_op;		/* SPAWN_CLOSE or SPAWN_DUP2 */
+	int sa_fd;		/* file to close, or to copy */
+	int sa_newfd;		/* where to copy it, for SPAWN_DUP2 */
+};
+
+#define SPAWN_CLOSE     1
+#define SPAWN_DUP2      2
+
+/* Most file actions one spawn() will take */
+#define SPAWN_MAXACTIONS 16
+
+
+#endif /* _KERN_SPAWN_H_ */
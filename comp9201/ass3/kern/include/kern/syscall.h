@@ -54,11 +54,17 @@
 #define SYS_waitpid      4
 #define SYS_getpid       5
 #define SYS_getppid      6
+// spawn is not in the standard list above; UNSW number
+#define SYS_spawn        122
 //                              (virtual memory)
 #define SYS_sbrk         7
 #define SYS_mmap         8
 #define SYS_munmap       9
 #define SYS_mprotect     10
+// msync is not in the standard list above; UNSW number
+#define SYS_msync        121
+// vmstat is not in the standard list above; UNSW number
+#define SYS_vmstat       123
 //#define SYS_madvise    11
 //#define SYS_mincore    12
 //#define SYS_mlock      13
@@ -88,8 +94,8 @@
 //#define SYS_wait4      34
 //#define SYS_getrusage  35
 //                              (resource limits)
-//#define SYS_getrlimit  36
-//#define SYS_setrlimit  37
+#define SYS_getrlimit    36
+#define SYS_setrlimit    37
 //                              (process priority control)
 //#define SYS_getpriority 38
 //#define SYS_setpriority 39
@@ -0,0 +1,35 @@
+#ifndef _KERN_VMSTAT_H_
+#define _KERN_VMSTAT_H_
+
+/*
+ * VM counters returned by the (UNSW) vmstat() system call, shared
+ * between the kernel and <unistd.h>. Counts are totals since boot, or
+ * since the process was created (or last exec'd); sample twice and
+ * subtract to get rates.
+ *
+ * For a single process the TLB fields only count misses that reached
+ * vm_fault(), as the assembly refill handler does not know whose page
+ * it loads, and the frame fields describe the whole system.
+ */
+
+struct vmstat {
+	unsigned vs_tlbmisses;		/* TLB misses, however handled */
+	unsigned vs_tlbfast;		/* ...of them refilled without vm_fault */
+	unsigned vs_readfaults;		/* VM_FAULT_READ in vm_fault */
+	unsigned vs_writefaults;	/* VM_FAULT_WRITE in vm_fault */
+	unsigned vs_readonlyfaults;	/* VM_FAULT_READONLY in vm_fault */
+	unsigned vs_zerofills;		/* pages given a frame of zeros */
+	unsigned vs_pagecopies;		/* copy-on-write pages copied */
+	unsigned vs_pageins;		/* pages read back from swap */
+	unsigned vs_pageouts;		/* pages written to swap */
+	unsigned vs_discards;		/* clean file pages dropped instead */
+	unsigned vs_framesfree;		/* physical pages free now */
+	unsigned vs_framesused;		/* physical pages in use now */
+	unsigned vs_ptpages;		/* second-level page tables in use now */
+};
+
+/* vmstat() pid for the counters of the whole system */
+#define VMSTAT_SYSTEM   0
+
+
+#endif /* _KERN_VMSTAT_H_ */
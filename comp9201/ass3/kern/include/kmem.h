@@ -0,0 +1,50 @@
+#ifndef _KMEM_H_
+#define _KMEM_H_
+
+/*
+ * Object caches for fixed-size kernel structures that are allocated
+ * and freed all the time (threads and their stacks, procs, open
+ * files, pid records).
+ *
+ * A cache hands out objects in their constructed state, and takes
+ * them back the same way: the constructor runs once when the cache
+ * grows, not on every allocation, so sub-objects such as locks and
+ * cvs are kept across reuse. The destructor only runs when the cache
+ * gives the memory back, from kmem_reclaim() or kmem_cache_destroy().
+ *
+ * Small objects are carved out of one-page slabs; objects too big
+ * for that get whole pages of their own, and a few free ones are
+ * kept constructed.
+ *
+ *    kmem_cache_create  - make a cache of SIZE-byte objects. CTOR (if
+ *                         not NULL) constructs an object and returns
+ *                         0 or an error; DTOR (if not NULL) undoes it
+ *                         and must not sleep. NAME is not copied.
+ *                         Returns NULL if out of memory.
+ *
+ *    kmem_cache_destroy - free the cache. All its objects must have
+ *                         been returned.
+ *
+ *    kmem_cache_alloc   - get a constructed object, or NULL if out of
+ *                         memory.
+ *
+ *    kmem_cache_free    - return an object, in its constructed state.
+ *
+ *    kmem_reclaim       - free up to NPAGES pages of unused objects; a
+ *                         shrinker for the reclaim code.
+ *
+ *    kmem_printstats    - print the statistics of every cache.
+ */
+
+struct kmem_cache;
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+                                     int (*ctor)(void *obj),
+                                     void (*dtor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *kc);
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+unsigned kmem_reclaim(unsigned npages);
+void kmem_printstats(void);
+
+#endif /* _KMEM_H_ */
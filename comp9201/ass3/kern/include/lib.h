@@ -125,13 +125,32 @@ uint32_t random(void);
  *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ *
+ * kheap_profile prints the NUM allocation sites holding the most
+ * heap, or with GROWTH the ones that grew most in this generation, if
+ * HEAPPROFILE is enabled in kmalloc.c. kheap_profile_alloc and
+ * kheap_profile_free let allocators other than kmalloc charge memory
+ * to the allocation site LABEL.
+ *
+ * kheap_reclaim frees up to NPAGES pages of heap bookkeeping that is
+ * no longer in use; it is a shrinker for the reclaim code.
+ *
+ * kheap_bootstrap hands kmalloc the per-page map it needs for NPAGES
+ * pages of RAM; ram_bootstrap sets aside kheap_mapsize(NPAGES) bytes
+ * for it before anything calls kmalloc.
  */
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
+unsigned kheap_reclaim(unsigned npages);
+size_t kheap_mapsize(unsigned npages);
+void kheap_bootstrap(void *map, unsigned npages);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
+void kheap_profile(unsigned num, bool growth);
+void kheap_profile_alloc(void *ptr, size_t size, vaddr_t label);
+void kheap_profile_free(void *ptr);
 
 /*
  * C string functions.
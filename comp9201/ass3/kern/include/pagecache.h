@@ -0,0 +1,54 @@
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+/*
+ * Page cache for the text of executables.
+ *
+ * Read-only segments of an executable are the same in every process
+ * running it, so their pages are read in once and the frames shared
+ * between all the address spaces that map them. A page is named by
+ * the vnode, the file offset of its segment and its virtual address.
+ * The cache holds a vnode reference for each page in it, and keeps
+ * the frame allocated (see frame_setcached) without counting as one
+ * of its references, so a page only one process maps can be evicted.
+ *
+ *    pagecache_lookup  - find a cached page. Returns its frame with a
+ *                        reference added for the caller, or 0.
+ *
+ *    pagecache_insert  - offer the freshly read frame PADDR, whose
+ *                        reference the caller holds. Returns the frame
+ *                        to map: PADDR, now also held by the cache, or
+ *                        the frame someone else cached first, in which
+ *                        case the caller's reference has moved to that
+ *                        frame and PADDR has been freed. Pages that
+ *                        can't be cached are returned as is.
+ *
+ *    pagecache_evict   - for the pager: take the page at PADDR, whose
+ *                        one mapping is being evicted, out of the
+ *                        cache, so that dropping that mapping frees the
+ *                        frame. Fails if the page has gained another
+ *                        mapping since the pager picked it.
+ *
+ *    pagecache_release - drop the pages of V that no address space maps
+ *                        any more. Called when an address space
+ *                        running V goes away.
+ *
+ *    pagecache_getstats - report pages cached, lookups that hit, pages
+ *                        added, and pages evicted.
+ *
+ * pagecache_lookup and pagecache_evict may be called with the page
+ * table lock held; the others must be called without spinlocks.
+ */
+
+struct vnode;
+
+paddr_t pagecache_lookup(struct vnode *v, off_t offset, vaddr_t vaddr);
+paddr_t pagecache_insert(struct vnode *v, off_t offset, vaddr_t vaddr,
+                         paddr_t paddr);
+bool pagecache_evict(struct vnode *v, off_t offset, vaddr_t vaddr,
+                     paddr_t paddr);
+void pagecache_release(struct vnode *v);
+void pagecache_getstats(unsigned *npages, unsigned *hits, unsigned *fills,
+                        unsigned *evictions);
+
+#endif /* _PAGECACHE_H_ */
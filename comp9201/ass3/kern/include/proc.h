@@ -60,6 +60,7 @@ struct proc {
 
 	/* VM */
 	struct addrspace *p_addrspace;	/* virtual address space */
+	size_t p_stacklimit;		/* RLIMIT_STACK, in bytes */
 
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
@@ -68,6 +69,13 @@ struct proc {
 	/* add more material here as needed */
 };
 
+#ifndef PROCINLINE
+#define PROCINLINE INLINE
+#endif
+
+DECLARRAY(proc, PROCINLINE);
+DEFARRAY(proc, PROCINLINE);
+
 /* This is the process structure for the kernel and for kernel-only threads. */
 extern struct proc *kproc;
 
@@ -107,5 +115,12 @@ struct addrspace *proc_getas(void);
 /* Change the address space of the current process, and return the old one. */
 struct addrspace *proc_setas(struct addrspace *);
 
+/* Print the user processes and their page table sizes. */
+void proc_printall(void);
+
+/* Get the VM counters of the process with pid PID. */
+struct vmstat;
+int proc_getvmstat(pid_t pid, struct vmstat *vs);
+
 
 #endif /* _PROC_H_ */
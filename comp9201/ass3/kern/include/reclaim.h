@@ -0,0 +1,62 @@
+#ifndef _RECLAIM_H_
+#define _RECLAIM_H_
+
+/*
+ * Memory reclaim.
+ *
+ * Subsystems that hold memory they could give back (pooled page
+ * tables, empty kernel heap bookkeeping pages, user pages that can go
+ * to swap) register a shrinker at boot. When free frames fall below
+ * the high watermark the frame allocator wakes a reclaim thread, which
+ * runs the shrinkers until the high watermark is reached again. Below
+ * the low watermark the allocating thread runs the shrinkers that
+ * don't sleep itself, and before failing an allocation it runs all
+ * the ones it may.
+ *
+ * A shrinker frees up to NPAGES pages and returns how many it freed.
+ * Shrinkers are run cheapest first, in the order they were
+ * registered. One that may sleep sets sh_mayblock, and is then only
+ * run by threads that hold no spinlocks, are not in an interrupt
+ * handler, and are not already inside a shrinker; the others must
+ * only take spinlocks that come after any the allocating thread may
+ * hold.
+ *
+ *    reclaim_bootstrap - set the watermarks from the size of memory
+ *                        and start the reclaim thread.
+ *
+ *    reclaim_register  - add a shrinker. Only called at boot;
+ *                        shrinkers are never removed.
+ *
+ *    reclaim_check     - called by the frame allocator with the number
+ *                        of free frames after an allocation.
+ *
+ *    reclaim_pages     - run the shrinkers the current thread may run
+ *                        until NPAGES pages are freed. Returns the
+ *                        number freed.
+ *
+ *    reclaim_printstats - print the watermarks and what each shrinker
+ *                        has freed.
+ */
+
+struct shrinker
+{
+    const char *sh_name;
+    unsigned (*sh_shrink)(unsigned npages);
+    bool sh_mayblock;
+
+    // Protected by the reclaim spinlock
+    unsigned sh_calls;
+    unsigned sh_freed;
+    struct shrinker *sh_next;
+};
+
+#define SHRINKER_INITIALIZER(name, shrink, mayblock) \
+    { name, shrink, mayblock, 0, 0, NULL }
+
+void reclaim_bootstrap(void);
+void reclaim_register(struct shrinker *sh);
+void reclaim_check(unsigned freeframes);
+unsigned reclaim_pages(unsigned npages);
+void reclaim_printstats(void);
+
+#endif /* _RECLAIM_H_ */
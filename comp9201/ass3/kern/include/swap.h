@@ -0,0 +1,35 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space for the VM system.
+ *
+ * The swap device is attached with vfs_swapon() at boot and divided
+ * into page-sized slots, whose use is tracked in a bitmap.
+ *
+ *    swap_bootstrap - attach the swap device. If there is none the
+ *                     system runs without swap and swap_alloc fails.
+ *
+ *    swap_alloc     - reserve a free slot. Returns ENOSPC if swap is
+ *                     full or missing.
+ *
+ *    swap_free      - release a slot.
+ *
+ *    swap_in        - read slot SLOT into the frame at PADDR.
+ *
+ *    swap_out       - write the frame at PADDR to slot SLOT.
+ *
+ *    swap_getusage  - report slots in use and the total number.
+ *
+ * swap_in and swap_out sleep on disk I/O; call them without holding
+ * any spinlocks.
+ */
+
+void swap_bootstrap(void);
+int swap_alloc(unsigned *slot);
+void swap_free(unsigned slot);
+int swap_in(unsigned slot, paddr_t paddr);
+int swap_out(unsigned slot, paddr_t paddr);
+void swap_getusage(unsigned *used, unsigned *total);
+
+#endif /* _SWAP_H_ */
@@ -106,6 +106,8 @@ struct thread {
 	 * Public fields
 	 */
 
+	bool t_reclaiming;		/* Running a shrinker (see reclaim.c) */
+
 	/* add more here as needed */
 };
 
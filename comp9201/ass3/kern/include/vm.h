@@ -49,6 +49,26 @@ void vm_bootstrap(void);
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
+/* Print paging statistics (page-ins, page-outs, swap usage) */
+void vm_printstats(void);
+
+/*
+ * Collect the vmstat() counters of address space AS, or of the whole
+ * system if AS is NULL, and print the per-cpu counters.
+ */
+struct addrspace;
+struct vmstat;
+void vm_getstats(struct addrspace *as, struct vmstat *vs);
+void vm_printcounters(void);
+
+/*
+ * Fault-around window in pages (0 or 1 disables it). A TLB miss also
+ * maps the untouched pages of the surrounding window-aligned block and
+ * preloads the block's translations into unused TLB slots.
+ */
+extern unsigned vm_faultaround;
+#define VM_FAULTAROUND_MAX 16
+
 /* Allocate/free kernel heap pages (called by kmalloc/kfree) */
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
@@ -41,12 +41,15 @@
 #include <thread.h>
 #include <proc.h>
 #include <vfs.h>
+#include <vm.h>
+#include <kmem.h>
 #include <sfs.h>
 #include <pid.h>
 #include <syscall.h>
 #include <test.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-dumbvm.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -467,10 +470,73 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	kmem_printstats();
 
 	return 0;
 }
 
+#if !OPT_DUMBVM
+static
+int
+cmd_vmcounters(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printcounters();
+
+	return 0;
+}
+#endif
+
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_ps(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	proc_printall();
+
+	return 0;
+}
+
+#if !OPT_DUMBVM
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	if (nargs == 2) {
+		unsigned pages = atoi(args[1]);
+		if (pages > VM_FAULTAROUND_MAX) {
+			kprintf("vmfa: window is at most %u pages\n",
+				VM_FAULTAROUND_MAX);
+			return EINVAL;
+		}
+		vm_faultaround = pages;
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: vmfa [pages]\n");
+		return EINVAL;
+	}
+
+	kprintf("Fault-around window: %u pages\n", vm_faultaround);
+	return 0;
+}
+#endif
+
 static
 int
 cmd_kheapgeneration(int nargs, char **args)
@@ -500,6 +566,32 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_kheapprofile(int nargs, char **args)
+{
+	bool growth = false;
+	unsigned num = 20;
+	int i = 1;
+
+	if (i < nargs && !strcmp(args[i], "-g")) {
+		growth = true;
+		i++;
+	}
+	if (i < nargs) {
+		num = atoi(args[i]);
+		i++;
+	}
+	if (i < nargs || num == 0) {
+		kprintf("Usage: khprof [-g] [count]\n");
+		return 0;
+	}
+
+	kheap_profile(num, growth);
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -566,6 +658,10 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[km5] Frame allocator benchmark     ",
+	"[km6] Object cache test             ",
+	"[km7] Multithreaded kmalloc bench   ",
+	"[km8] kfree benchmark               ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -604,8 +700,17 @@ static const char *mainmenu[] = {
 	"[?o] Operations menu                ",
 	"[?t] Tests menu                     ",
 	"[kh] Kernel heap stats              ",
+#if !OPT_DUMBVM
+	"[vmstat] Per-cpu VM fault counters  ",
+#endif
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[khprof] Kernel heap by call site   ",
+	"[vm] VM paging stats                ",
+	"[ps] Processes and page table sizes ",
+#if !OPT_DUMBVM
+	"[vmfa] Set fault-around window      ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -655,8 +760,17 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+#if !OPT_DUMBVM
+	{ "vmstat",     cmd_vmcounters },
+#endif
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "khprof",     cmd_kheapprofile },
+	{ "vm",         cmd_vmstats },
+	{ "ps",         cmd_ps },
+#if !OPT_DUMBVM
+	{ "vmfa",       cmd_faultaround },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -667,6 +781,10 @@ static struct {
 	{ "km2",	kmallocstress },
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
+	{ "km5",	kmalloctest5 },
+	{ "km6",	kmalloctest6 },
+	{ "km7",	kmallocbench },
+	{ "km8",	kfreebench },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -42,10 +42,14 @@
  * process that will have more than one thread is the kernel process.
  */
 
+#define PROCINLINE
+
 #include <types.h>
 #include <kern/errno.h>
+#include <lib.h>
 #include <spl.h>
 #include <synch.h>
+#include <kmem.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
@@ -58,6 +62,44 @@
  */
 struct proc *kproc;
 
+/*
+ * All user processes, for proc_printall.
+ */
+static struct procarray allprocs;
+static struct lock *allprocs_lock;
+
+/*
+ * Proc structures, with their locks.
+ */
+static struct kmem_cache *proc_cache;
+
+/*
+ * Constructor and destructor for proc_cache.
+ */
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	proc->p_threadslock = lock_create("p_threads");
+	if (proc->p_threadslock == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&proc->p_lock);
+	return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	spinlock_cleanup(&proc->p_lock);
+	lock_destroy(proc->p_threadslock);
+}
+
 /*
  * Create a proc structure.
  */
@@ -67,29 +109,23 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(proc_cache, proc);
 		return NULL;
 	}
 
-	proc->p_threadslock = lock_create("p_threads");
-	if (proc->p_threadslock == NULL) {
-		kfree(proc->p_name);
-		kfree(proc);
-		return NULL;
-	}
 	threadarray_init(&proc->p_threads);
 
-	spinlock_init(&proc->p_lock);
 	proc->p_pid = INVALID_PID;
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
+	proc->p_stacklimit = STACK_LIMIT_DEFAULT;
 
 	/* VFS fields */
 	proc->p_cwd = NULL;
@@ -98,6 +134,41 @@ proc_create(const char *name)
 	return proc;
 }
 
+/*
+ * Add a new user process to allprocs.
+ */
+static
+int
+proc_listadd(struct proc *proc)
+{
+	int result;
+
+	lock_acquire(allprocs_lock);
+	result = procarray_add(&allprocs, proc, NULL);
+	lock_release(allprocs_lock);
+	return result;
+}
+
+/*
+ * Remove a process from allprocs, if it is there.
+ */
+static
+void
+proc_listremove(struct proc *proc)
+{
+	unsigned i, num;
+
+	lock_acquire(allprocs_lock);
+	num = procarray_num(&allprocs);
+	for (i=0; i<num; i++) {
+		if (procarray_get(&allprocs, i) == proc) {
+			procarray_remove(&allprocs, i);
+			break;
+		}
+	}
+	lock_release(allprocs_lock);
+}
+
 /*
  * Destroy a proc structure.
  *
@@ -118,6 +189,9 @@ proc_destroy(struct proc *proc)
 	KASSERT(proc != NULL);
 	KASSERT(proc != kproc);
 
+	/* Take it off the list first, so nobody looks at it any more. */
+	proc_listremove(proc);
+
 	/*
 	 * We don't take p_lock in here because we must have the only
 	 * reference to this structure. (Otherwise it would be
@@ -183,12 +257,10 @@ proc_destroy(struct proc *proc)
 	}
 
 	KASSERT(proc->p_pid == INVALID_PID);
-	spinlock_cleanup(&proc->p_lock);
 	threadarray_cleanup(&proc->p_threads);
-	lock_destroy(proc->p_threadslock);
 
 	kfree(proc->p_name);
-	kfree(proc);
+	kmem_cache_free(proc_cache, proc);
 }
 
 /*
@@ -197,11 +269,23 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+	proc_cache = kmem_cache_create("proc", sizeof(struct proc),
+				       proc_ctor, proc_dtor);
+	if (proc_cache == NULL) {
+		panic("kmem_cache_create for procs failed\n");
+	}
+
 	kproc = proc_create("[kernel]");
 	if (kproc == NULL) {
 		panic("proc_create for kproc failed\n");
 	}
 	kproc->p_pid = KERNEL_PID;
+
+	procarray_init(&allprocs);
+	allprocs_lock = lock_create("allprocs");
+	if (allprocs_lock == NULL) {
+		panic("lock_create for allprocs failed\n");
+	}
 }
 
 /*
@@ -229,6 +313,11 @@ proc_create_runprogram(const char *name, struct proc **ret)
 		proc_destroy(newproc);
 		return result;
 	}
+	result = proc_listadd(newproc);
+	if (result) {
+		proc_unfork(newproc);
+		return result;
+	}
 
 	/* VM fields */
 
@@ -280,6 +369,11 @@ proc_fork(struct proc **ret)
 		proc_destroy(newproc);
 		return result;
 	}
+	result = proc_listadd(newproc);
+	if (result) {
+		proc_unfork(newproc);
+		return result;
+	}
 
 #if 0 /* not yet */
 	/*
@@ -292,6 +386,7 @@ proc_fork(struct proc **ret)
 #endif
 
 	/* VM fields */
+	newproc->p_stacklimit = curproc->p_stacklimit;
 	as = proc_getas();
 	if (as != NULL) {
 		result = as_copy(as, &newproc->p_addrspace);
@@ -484,3 +579,77 @@ proc_setas(struct addrspace *newas)
 	spinlock_release(&proc->p_lock);
 	return oldas;
 }
+
+/*
+ * Print the user processes with the memory their page tables use,
+ * for the "ps" menu command. An address space is only destroyed after
+ * it has been swapped out of p_addrspace, so holding p_lock keeps the
+ * one we look at alive.
+ */
+void
+proc_printall(void)
+{
+	struct proc *proc;
+	size_t ptbytes;
+	unsigned i, num;
+
+	kprintf("  PID  PT KiB  NAME\n");
+
+	lock_acquire(allprocs_lock);
+	num = procarray_num(&allprocs);
+	for (i=0; i<num; i++) {
+		proc = procarray_get(&allprocs, i);
+
+		ptbytes = 0;
+#if !OPT_DUMBVM
+		spinlock_acquire(&proc->p_lock);
+		if (proc->p_addrspace != NULL) {
+			ptbytes = as_ptusage(proc->p_addrspace);
+		}
+		spinlock_release(&proc->p_lock);
+#endif
+
+		kprintf("%5d %7u  %s\n", (int)proc->p_pid,
+			(unsigned)(ptbytes / 1024), proc->p_name);
+	}
+	lock_release(allprocs_lock);
+}
+
+/*
+ * Get the vmstat() counters of process PID, for sys_vmstat. Like
+ * proc_printall, holding p_lock keeps its address space alive.
+ */
+int
+proc_getvmstat(pid_t pid, struct vmstat *vs)
+{
+	struct proc *proc;
+	unsigned i, num;
+	int result;
+
+	result = ESRCH;
+
+	lock_acquire(allprocs_lock);
+	num = procarray_num(&allprocs);
+	for (i=0; i<num; i++) {
+		proc = procarray_get(&allprocs, i);
+		if (proc->p_pid != pid) {
+			continue;
+		}
+
+#if OPT_DUMBVM
+		(void)vs;
+		result = ENOSYS;
+#else
+		spinlock_acquire(&proc->p_lock);
+		if (proc->p_addrspace != NULL) {
+			vm_getstats(proc->p_addrspace, vs);
+			result = 0;
+		}
+		spinlock_release(&proc->p_lock);
+#endif
+		break;
+	}
+	lock_release(allprocs_lock);
+
+	return result;
+}
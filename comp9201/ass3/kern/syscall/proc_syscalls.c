@@ -33,6 +33,8 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <kern/wait.h>
 #include <lib.h>
 #include <machine/trapframe.h>
@@ -42,9 +44,10 @@
 #include <current.h>
 #include <copyinout.h>
 #include <pid.h>
+#include <addrspace.h>
 #include <syscall.h>
 
-/* note that sys_execv is in runprogram.c */
+/* note that sys_execv and sys_spawn are in runprogram.c */
 
 
 /*
@@ -157,3 +160,52 @@ sys_waitpid(pid_t pid, userptr_t retstatus, int flags, pid_t *retval)
 	}
 	return result;
 }
+
+/*
+ * sys_getrlimit, sys_setrlimit
+ * Only RLIMIT_STACK is supported. The soft limit is p_stacklimit;
+ * the hard limit is STACK_LIMIT_MAX for everyone and can't be
+ * changed. A new soft limit applies from the next execv or spawn
+ * (as_define_stack fixes how far the stack may grow), and like the
+ * old one is inherited by fork and spawn.
+ */
+int
+sys_getrlimit(int resource, userptr_t rlp)
+{
+	struct rlimit rl;
+
+	if (resource != RLIMIT_STACK) {
+		return EINVAL;
+	}
+
+	rl.rlim_cur = curproc->p_stacklimit;
+	rl.rlim_max = STACK_LIMIT_MAX;
+	return copyout(&rl, rlp, sizeof(rl));
+}
+
+int
+sys_setrlimit(int resource, const_userptr_t rlp)
+{
+	struct rlimit rl;
+	int result;
+
+	if (resource != RLIMIT_STACK) {
+		return EINVAL;
+	}
+
+	result = copyin(rlp, &rl, sizeof(rl));
+	if (result) {
+		return result;
+	}
+
+	if (rl.rlim_cur > rl.rlim_max) {
+		return EINVAL;
+	}
+	if (rl.rlim_max > STACK_LIMIT_MAX) {
+		/* can't raise the hard limit */
+		return EPERM;
+	}
+
+	curproc->p_stacklimit = rl.rlim_cur;
+	return 0;
+}
@@ -36,11 +36,15 @@
 #include <kern/errno.h>
 #include <kern/fcntl.h>
 #include <kern/unistd.h>
+#include <kern/wait.h>
+#include <kern/spawn.h>
 #include <limits.h>
 #include <lib.h>
 #include <proc.h>
 #include <current.h>
+#include <thread.h>
 #include <synch.h>
+#include <pid.h>
 #include <copyinout.h>
 #include <addrspace.h>
 #include <vm.h>
@@ -611,3 +615,220 @@ sys_execv(userptr_t prog, userptr_t uargv)
 	panic("enter_new_process returned\n");
 	return EINVAL;
 }
+
+/*
+ * spawn.
+ *
+ * Start a program in a new child process, as fork followed by execv
+ * in the child would, but without copying the caller's address space
+ * only to throw it away. The child gets a copy of the caller's file
+ * table with the file actions applied, and a fresh address space.
+ *
+ * The executable is loaded by the new process's own thread, since
+ * loadexec works on the current process. The caller waits for it,
+ * so that errors from loading (no such file, bad executable, etc.)
+ * come back from spawn like they would from execv.
+ */
+
+struct spawninfo {
+	char *path;			/* program to run */
+	struct argbuf kargv;		/* its arguments */
+	struct semaphore *loaded;	/* V'd when the child is done loading */
+	int result;			/* and how that went */
+};
+
+/*
+ * Apply spawn file actions to the new process's file table FT.
+ */
+static
+int
+spawn_fileactions(struct filetable *ft, const struct spawn_action *actions,
+		  int nactions)
+{
+	struct openfile *file, *oldfile;
+	int i, result;
+
+	for (i=0; i<nactions; i++) {
+		switch (actions[i].sa_op) {
+		    case SPAWN_CLOSE:
+			if (!filetable_okfd(ft, actions[i].sa_fd)) {
+				return EBADF;
+			}
+			filetable_placeat(ft, NULL, actions[i].sa_fd, &file);
+			if (file == NULL) {
+				return EBADF;
+			}
+			openfile_decref(file);
+			break;
+
+		    case SPAWN_DUP2:
+			if (!filetable_okfd(ft, actions[i].sa_newfd)) {
+				return EBADF;
+			}
+			if (actions[i].sa_fd == actions[i].sa_newfd) {
+				break;
+			}
+			result = filetable_get(ft, actions[i].sa_fd, &file);
+			if (result) {
+				return result;
+			}
+			openfile_incref(file);
+			filetable_put(ft, actions[i].sa_fd, file);
+			filetable_placeat(ft, file, actions[i].sa_newfd,
+					  &oldfile);
+			if (oldfile != NULL) {
+				openfile_decref(oldfile);
+			}
+			break;
+
+		    default:
+			return EINVAL;
+		}
+	}
+	return 0;
+}
+
+/*
+ * The first thread of a spawned process: load the program, report
+ * back to the parent, and go to user mode.
+ */
+static
+void
+spawn_newthread(void *vsi, unsigned long junk)
+{
+	struct spawninfo *si = vsi;
+	vaddr_t entrypoint, stackptr;
+	userptr_t uargv;
+	int argc;
+	int result;
+
+	(void)junk;
+
+	/* Load the executable. Note: must not fail after this succeeds. */
+	result = loadexec(si->path, &entrypoint, &stackptr);
+	if (result == 0) {
+		result = argbuf_copyout(&si->kargv, &stackptr, &argc, &uargv);
+		if (result) {
+			/* if copyout fails, *we* messed up, so panic */
+			panic("spawn: copyout_args failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	/* SI belongs to the parent; don't touch it after this */
+	si->result = result;
+	V(si->loaded);
+
+	if (result) {
+		/* The parent collects our exit status */
+		proc_exit(_MKWAIT_EXIT(255));
+	}
+
+	/* Warp to user mode. */
+	enter_new_process(argc, uargv, NULL /*uenv*/, stackptr, entrypoint);
+
+	/* enter_new_process does not return. */
+	panic("enter_new_process returned\n");
+}
+
+int
+sys_spawn(userptr_t prog, userptr_t uargv, userptr_t uactions, int nactions,
+	  pid_t *retval)
+{
+	struct spawninfo si;
+	struct spawn_action actions[SPAWN_MAXACTIONS];
+	struct proc *newproc;
+	pid_t pid;
+	int status;
+	int result;
+
+	if (nactions < 0 || nactions > SPAWN_MAXACTIONS) {
+		return EINVAL;
+	}
+	if (nactions > 0) {
+		result = copyin(uactions, actions,
+				nactions * sizeof(actions[0]));
+		if (result) {
+			return result;
+		}
+	}
+
+	si.path = kmalloc(PATH_MAX);
+	if (si.path == NULL) {
+		return ENOMEM;
+	}
+
+	/* Get the filename. */
+	result = copyinstr(prog, si.path, PATH_MAX, NULL);
+	if (result) {
+		kfree(si.path);
+		return result;
+	}
+
+	/* get the argv strings. */
+	argbuf_init(&si.kargv);
+	result = argbuf_fromuser(&si.kargv, uargv);
+	if (result) {
+		argbuf_cleanup(&si.kargv);
+		kfree(si.path);
+		return result;
+	}
+
+	si.loaded = sem_create("spawn", 0);
+	if (si.loaded == NULL) {
+		argbuf_cleanup(&si.kargv);
+		kfree(si.path);
+		return ENOMEM;
+	}
+
+	/* Make the process, with our file table and no address space */
+	result = proc_create_runprogram(si.path, &newproc);
+	if (result) {
+		goto fail;
+	}
+	newproc->p_stacklimit = curproc->p_stacklimit;
+
+	if (curproc->p_filetable != NULL) {
+		result = filetable_copy(curproc->p_filetable,
+					&newproc->p_filetable);
+		if (result) {
+			proc_unfork(newproc);
+			goto fail;
+		}
+		result = spawn_fileactions(newproc->p_filetable,
+					   actions, nactions);
+		if (result) {
+			proc_unfork(newproc);
+			goto fail;
+		}
+	}
+	pid = newproc->p_pid;
+
+	result = thread_fork(curthread->t_name, newproc,
+			     spawn_newthread, &si, 0);
+	if (result) {
+		proc_unfork(newproc);
+		goto fail;
+	}
+
+	/* Wait for the program to be loaded */
+	P(si.loaded);
+	result = si.result;
+	if (result) {
+		/* The child has exited; clean it up */
+		pid_wait(pid, &status, 0, NULL);
+		goto fail;
+	}
+
+	sem_destroy(si.loaded);
+	argbuf_cleanup(&si.kargv);
+	kfree(si.path);
+	*retval = pid;
+	return 0;
+
+fail:
+	sem_destroy(si.loaded);
+	argbuf_cleanup(&si.kargv);
+	kfree(si.path);
+	return result;
+}
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
+#include <kern/vmstat.h>
+#include <proc.h>
+#include <current.h>
+#include <copyinout.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <vnode.h>
+#include <openfile.h>
+#include <filetable.h>
+#include <syscall.h>
+
+/*
+ * Memory management system calls.
+ */
+
+/*
+ * sbrk: move the end of the heap by AMOUNT bytes and return the old
+ * end. New heap pages are not allocated until they are touched.
+ */
+int
+sys_sbrk(intptr_t amount, int *retval)
+{
+	struct addrspace *as;
+	vaddr_t oldbreak;
+	int result;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+
+	result = as_sbrk(as, amount, &oldbreak);
+	if (result) {
+		return result;
+	}
+
+	*retval = (int)oldbreak;
+	return 0;
+}
+
+/*
+ * mmap: map LENGTH bytes of the file open on FD, starting at OFFSET,
+ * at an address the kernel picks. Pages are read from the file when
+ * first touched, and written pages go back to it on msync, munmap or
+ * exit. Writable mappings need the file open for both reading and
+ * writing.
+ */
+int
+sys_mmap(size_t length, int prot, int fd, off_t offset, int *retval)
+{
+	struct addrspace *as;
+	struct openfile *file;
+	struct stat st;
+	size_t filesize;
+	vaddr_t vaddr;
+	int result;
+
+	if (length == 0 || offset < 0 || offset % PAGE_SIZE != 0 ||
+	    (prot & ~(PROT_READ | PROT_WRITE)) != 0) {
+		return EINVAL;
+	}
+
+	as = proc_getas();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+
+	result = filetable_get(curproc->p_filetable, fd, &file);
+	if (result) {
+		return result;
+	}
+
+	if (file->of_accmode == O_WRONLY ||
+	    ((prot & PROT_WRITE) && file->of_accmode != O_RDWR)) {
+		result = EACCES;
+		goto out;
+	}
+
+	result = VOP_MMAP(file->of_vnode);
+	if (result) {
+		goto out;
+	}
+
+	/* Only the part of the mapping the file covers is written back */
+	result = VOP_STAT(file->of_vnode, &st);
+	if (result) {
+		goto out;
+	}
+	filesize = 0;
+	if (st.st_size > offset) {
+		filesize = st.st_size - offset < (off_t)length ?
+			st.st_size - offset : length;
+	}
+
+	result = as_mmap(as, length, (prot & PROT_WRITE) != 0,
+			 file->of_vnode, offset, filesize, &vaddr);
+	if (result) {
+		goto out;
+	}
+
+	*retval = (int)vaddr;
+
+ out:
+	filetable_put(curproc->p_filetable, fd, file);
+	return result;
+}
+
+/*
+ * munmap: write back and remove the mapping that starts at ADDR.
+ */
+int
+sys_munmap(userptr_t addr)
+{
+	struct addrspace *as;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+
+	return as_munmap(as, (vaddr_t)addr);
+}
+
+/*
+ * msync: write the dirty pages of the mapping that starts at ADDR
+ * back to its file.
+ */
+int
+sys_msync(userptr_t addr)
+{
+	struct addrspace *as;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+
+	return as_msync(as, (vaddr_t)addr);
+}
+
+/*
+ * vmstat: copy out the VM counters of process PID, or of the whole
+ * system for VMSTAT_SYSTEM.
+ */
+int
+sys_vmstat(pid_t pid, userptr_t buf)
+{
+	struct vmstat vs;
+	int result;
+
+	if (pid == VMSTAT_SYSTEM) {
+		vm_getstats(NULL, &vs);
+	}
+	else {
+		result = proc_getvmstat(pid, &vs);
+		if (result) {
+			return result;
+		}
+	}
+
+	return copyout(&vs, buf, sizeof(vs));
+}
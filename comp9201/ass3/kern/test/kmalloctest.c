@@ -35,6 +35,8 @@
 #include <lib.h>
 #include <thread.h>
 #include <synch.h>
+#include <clock.h>
+#include <kmem.h>
 #include <vm.h> /* for PAGE_SIZE */
 #include <test.h>
 
@@ -42,7 +44,7 @@
 #include "opt-unsw.h"
 
 ////////////////////////////////////////////////////////////
-// km1/km2
+// km1/km2/km7/km8
 
 /*
  * Test kmalloc; allocate ITEMSIZE bytes NTRIES times, freeing
@@ -146,6 +148,188 @@ kmallocstress(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * kmalloc throughput. Each thread keeps a ring of small blocks of
+ * assorted sizes and replaces the oldest one KMB_ITERS times; the
+ * whole run is timed with one thread and then with NTHREADS, so the
+ * second rate shows how well kmalloc scales across cpus.
+ */
+
+#define KMB_ITERS 20000
+#define KMB_RING  16
+
+static
+void
+kmallocbenchthread(void *sm, unsigned long num)
+{
+	static const size_t benchsizes[] = { 16, 24, 40, 64, 100, 200, 500, 1000 };
+	struct semaphore *sem = sm;
+	void *ring[KMB_RING];
+	size_t sz;
+	unsigned i, slot;
+
+	for (i=0; i<KMB_RING; i++) {
+		ring[i] = NULL;
+	}
+	for (i=0; i<KMB_ITERS; i++) {
+		slot = i % KMB_RING;
+		kfree(ring[slot]);
+		sz = benchsizes[(i + num) % ARRAYCOUNT(benchsizes)];
+		ring[slot] = kmalloc(sz);
+		if (ring[slot] == NULL) {
+			panic("kmallocbench: thread %lu: kmalloc failed\n",
+			      num);
+		}
+		*(char *)ring[slot] = (char)i;
+	}
+	for (i=0; i<KMB_RING; i++) {
+		kfree(ring[i]);
+	}
+	V(sem);
+}
+
+static
+void
+kmallocbenchrun(struct semaphore *sem, unsigned nthreads)
+{
+	struct timespec before, after, duration;
+	uint64_t nsecs, rate;
+	unsigned i;
+	int result;
+
+	gettime(&before);
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("kmallocbench", NULL,
+				     kmallocbenchthread, sem, i);
+		if (result) {
+			panic("kmallocbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(sem);
+	}
+	gettime(&after);
+	timespec_sub(&after, &before, &duration);
+
+	nsecs = (uint64_t)duration.tv_sec * 1000000000ULL
+		+ duration.tv_nsec;
+	rate = nsecs ? (uint64_t)nthreads * KMB_ITERS * 1000000000ULL / nsecs
+		: 0;
+	kprintf("kmallocbench: %u thread%s: %llu kmalloc+kfree/sec\n",
+		nthreads, nthreads == 1 ? "" : "s", (unsigned long long)rate);
+}
+
+int
+kmallocbench(int nargs, char **args)
+{
+	struct semaphore *sem;
+
+	(void)nargs;
+	(void)args;
+
+	sem = sem_create("kmallocbench", 0);
+	if (sem == NULL) {
+		panic("kmallocbench: sem_create failed\n");
+	}
+
+	kprintf("Starting kmalloc benchmark...\n");
+	kmallocbenchrun(sem, 1);
+	kmallocbenchrun(sem, NTHREADS);
+	sem_destroy(sem);
+	kprintf("kmalloc benchmark done\n");
+
+	return 0;
+}
+
+/*
+ * Report how long kfree takes as the heap grows. The heap is filled
+ * with more and more pages of 2K blocks, and at each size a batch of
+ * blocks spread evenly over all of it is freed and timed, then
+ * allocated again. The per-cpu magazines only hold a few blocks this
+ * big, so most of the batch goes back to the pages it came from,
+ * which is the lookup being measured.
+ */
+
+#define KFB_FILLSIZE 2000
+#define KFB_BATCH 64
+#define KFB_ROUNDS 8
+#define KFB_MAXPAGES 1024
+
+int
+kfreebench(int nargs, char **args)
+{
+#define NUM_KFB_LEVELS 4
+	static const unsigned levels[NUM_KFB_LEVELS] = { 64, 128, 512,
+							  KFB_MAXPAGES };
+	struct timespec before, after, duration;
+	uint64_t nsecs;
+	void **blocks;
+	unsigned i, j, k, stride, nblocks;
+
+	(void)nargs;
+	(void)args;
+
+	/* Two blocks to a page. */
+	blocks = kmalloc(KFB_MAXPAGES * 2 * sizeof(void *));
+	if (blocks == NULL) {
+		panic("kfreebench: kmalloc failed\n");
+	}
+
+	kprintf("Starting kfree benchmark...\n");
+	nblocks = 0;
+	for (i=0; i<NUM_KFB_LEVELS; i++) {
+		while (nblocks < levels[i] * 2) {
+			blocks[nblocks] = kmalloc(KFB_FILLSIZE);
+			if (blocks[nblocks] == NULL) {
+				break;
+			}
+			nblocks++;
+		}
+		if (nblocks < levels[i] * 2) {
+			kprintf("kfreebench: heap only grew to %u pages\n",
+				nblocks / 2);
+			break;
+		}
+
+		/*
+		 * At most every other block, so the batch seldom
+		 * empties a page and the page allocator stays out of it.
+		 */
+		stride = nblocks / KFB_BATCH;
+		nsecs = 0;
+		for (k=0; k<KFB_ROUNDS; k++) {
+			gettime(&before);
+			for (j=0; j<KFB_BATCH; j++) {
+				kfree(blocks[j * stride]);
+			}
+			gettime(&after);
+			timespec_sub(&after, &before, &duration);
+			nsecs += (uint64_t)duration.tv_sec * 1000000000ULL
+				+ duration.tv_nsec;
+
+			for (j=0; j<KFB_BATCH; j++) {
+				blocks[j * stride] =
+					kmalloc(KFB_FILLSIZE);
+				if (blocks[j * stride] == NULL) {
+					panic("kfreebench: kmalloc failed\n");
+				}
+			}
+		}
+		kprintf("kfreebench: %4u heap pages: kfree %llu ns\n",
+			levels[i],
+			(unsigned long long)(nsecs / (KFB_ROUNDS * KFB_BATCH)));
+	}
+
+	for (j=0; j<nblocks; j++) {
+		kfree(blocks[j]);
+	}
+	kfree(blocks);
+	kprintf("kfree benchmark done\n");
+
+	return 0;
+}
+
 ////////////////////////////////////////////////////////////
 // km3
 
@@ -338,6 +522,60 @@ kmalloctest4thread(void *sm, unsigned long num)
 	V(sem);
 }
 
+/*
+ * Check that the size classes above 2K pack their blocks into their
+ * chunks. 48K worth of blocks of each class should take 12 pages,
+ * plus perhaps one for a new pageref page, where rounding each block
+ * up to whole pages would take up to 16. The requests are a little
+ * under the class size so that heap debugging overhead doesn't push
+ * them up a class.
+ */
+
+#define KM4_PACKBYTES (48 * 1024)
+#define KM4_PACKSLACK 64
+
+static
+void
+kmalloctest4pack(void)
+{
+#if OPT_UNSW
+#define NUM_KM4_CLASSES 6
+	static const unsigned classes[NUM_KM4_CLASSES] = {
+		3072, 4096, 6144, 8192, 12288, 16384
+	};
+	void *ptrs[KM4_PACKBYTES / 3072];
+	unsigned before, after, total, used, wasted;
+	unsigned i, j, n;
+
+	for (i=0; i<NUM_KM4_CLASSES; i++) {
+		n = KM4_PACKBYTES / classes[i];
+		ram_getusage(&before, &total);
+		for (j=0; j<n; j++) {
+			ptrs[j] = kmalloc(classes[i] - KM4_PACKSLACK);
+			if (ptrs[j] == NULL) {
+				panic("kmalloctest4: allocating %u-byte "
+				      "blocks failed\n", classes[i]);
+			}
+		}
+		ram_getusage(&after, &total);
+
+		used = before > after ? before - after : 0;
+		wasted = used * PAGE_SIZE > KM4_PACKBYTES ?
+			used * PAGE_SIZE - KM4_PACKBYTES : 0;
+		kprintf("kmalloctest4: %2u %5u-byte blocks in %2u pages, "
+			"%u bytes wasted\n", n, classes[i], used, wasted);
+		if (wasted > PAGE_SIZE) {
+			panic("kmalloctest4: %u-byte blocks waste %u bytes\n",
+			      classes[i], wasted);
+		}
+
+		for (j=0; j<n; j++) {
+			kfree(ptrs[j]);
+		}
+	}
+#endif
+}
+
 int
 kmalloctest4(int nargs, char **args)
 {
@@ -376,6 +614,287 @@ kmalloctest4(int nargs, char **args)
 	}
 
 	sem_destroy(sem);
+	kmalloctest4pack();
 	kprintf("Multipage kmalloc test done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// km5
+
+/*
+ * Frame allocator benchmark. Fill physical memory with single-page
+ * allocations up to each occupancy level in turn, then time a burst
+ * of alloc_kpages(1)/free_kpages() pairs at that level and report the
+ * rate. The filler pages are chained through their first word so the
+ * test needs no memory of its own.
+ */
+
+#define KM5_ITERS 20000
+
+int
+kmalloctest5(int nargs, char **args)
+{
+#if OPT_UNSW
+#define NUM_KM5_LEVELS 3
+	static const unsigned levels[NUM_KM5_LEVELS] = { 10, 50, 95 };
+	struct timespec before, after, duration;
+	unsigned freeframes, totalframes, target;
+	uint64_t nsecs, rate;
+	vaddr_t held, page;
+	unsigned i, j, nheld;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting frame allocator benchmark...\n");
+
+	held = 0;
+	nheld = 0;
+	for (i=0; i<NUM_KM5_LEVELS; i++) {
+		ram_getusage(&freeframes, &totalframes);
+		target = (totalframes * levels[i]) / 100;
+
+		/* Fill up to the target occupancy. */
+		while (totalframes - freeframes < target) {
+			page = alloc_kpages(1);
+			if (page == 0) {
+				break;
+			}
+			*(vaddr_t *)page = held;
+			held = page;
+			nheld++;
+			ram_getusage(&freeframes, &totalframes);
+		}
+		if (totalframes - freeframes < target) {
+			kprintf("km5: could only reach %u of %u frames\n",
+				totalframes - freeframes, totalframes);
+			break;
+		}
+
+		gettime(&before);
+		for (j=0; j<KM5_ITERS; j++) {
+			page = alloc_kpages(1);
+			if (page == 0) {
+				panic("km5: alloc_kpages failed at %u%%\n",
+				      levels[i]);
+			}
+			free_kpages(page);
+		}
+		gettime(&after);
+		timespec_sub(&after, &before, &duration);
+
+		nsecs = (uint64_t)duration.tv_sec * 1000000000ULL
+			+ duration.tv_nsec;
+		rate = nsecs ? (uint64_t)KM5_ITERS * 1000000000ULL / nsecs : 0;
+		kprintf("km5: %2u%% occupancy (%u/%u frames): "
+			"%llu allocations/sec\n", levels[i],
+			totalframes - freeframes, totalframes,
+			(unsigned long long)rate);
+	}
+
+	/* Give everything back. */
+	while (held != 0) {
+		page = held;
+		held = *(vaddr_t *)page;
+		free_kpages(page);
+	}
+	kprintf("km5: released %u filler pages\n", nheld);
+
+	kprintf("Frame allocator benchmark done\n");
+	return 0;
+#else
+	(void)nargs;
+	(void)args;
+
+	kprintf("km5: needs the UNSW frame allocator (options unsw)\n");
+	return 0;
+#endif
+}
+
+////////////////////////////////////////////////////////////
+// km6
+
+/*
+ * Object cache test. Objects carry a lock made by the constructor;
+ * check that they come back constructed, that reuse constructs
+ * nothing (unless reclaim destroyed them meanwhile), and that every
+ * object constructed is destroyed with the cache. Then time reusing
+ * an object against making one with kmalloc and lock_create.
+ */
+
+#define KM6_NOBJS   500
+#define KM6_MAGIC   0xc0ffee
+#define KM6_ITERS   20000
+
+struct km6obj {
+	unsigned magic;
+	struct lock *lock;
+	char pad[40];
+};
+
+static unsigned km6_constructed, km6_destroyed, km6_bigdestroyed;
+
+static
+int
+km6_ctor(void *obj)
+{
+	struct km6obj *o = obj;
+
+	o->lock = lock_create("km6");
+	if (o->lock == NULL) {
+		return ENOMEM;
+	}
+	o->magic = KM6_MAGIC;
+	km6_constructed++;
+	return 0;
+}
+
+static
+void
+km6_dtor(void *obj)
+{
+	struct km6obj *o = obj;
+
+	KASSERT(o->magic == KM6_MAGIC);
+	lock_destroy(o->lock);
+	o->magic = 0;
+	km6_destroyed++;
+}
+
+static
+void
+km6_bigdtor(void *obj)
+{
+	(void)obj;
+	km6_bigdestroyed++;
+}
+
+static
+uint64_t
+km6_rate(struct timespec *before, struct timespec *after)
+{
+	struct timespec duration;
+	uint64_t nsecs;
+
+	timespec_sub(after, before, &duration);
+	nsecs = (uint64_t)duration.tv_sec * 1000000000ULL + duration.tv_nsec;
+	return nsecs ? (uint64_t)KM6_ITERS * 1000000000ULL / nsecs : 0;
+}
+
+int
+kmalloctest6(int nargs, char **args)
+{
+	struct kmem_cache *kc, *bigkc;
+	struct km6obj **objs;
+	struct km6obj *o;
+	struct timespec before, after;
+	void *big[3], *p;
+	unsigned i, j, built = 0;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting object cache test...\n");
+
+	km6_constructed = km6_destroyed = 0;
+	kc = kmem_cache_create("km6", sizeof(struct km6obj),
+			       km6_ctor, km6_dtor);
+	objs = kmalloc(KM6_NOBJS * sizeof(*objs));
+	if (kc == NULL || objs == NULL) {
+		panic("km6: out of memory\n");
+	}
+
+	for (j=0; j<2; j++) {
+		for (i=0; i<KM6_NOBJS; i++) {
+			objs[i] = kmem_cache_alloc(kc);
+			if (objs[i] == NULL) {
+				panic("km6: kmem_cache_alloc failed\n");
+			}
+			KASSERT(objs[i]->magic == KM6_MAGIC);
+			lock_acquire(objs[i]->lock);
+			objs[i]->pad[0] = (char)i;
+		}
+		for (i=0; i<KM6_NOBJS; i++) {
+			KASSERT(objs[i]->pad[0] == (char)i);
+			lock_release(objs[i]->lock);
+			kmem_cache_free(kc, objs[i]);
+		}
+		if (j == 0) {
+			built = km6_constructed;
+			KASSERT(built >= KM6_NOBJS);
+		}
+	}
+	/*
+	 * Reclaim (which any page allocation can run) may have
+	 * destroyed the free objects in between; only those may have
+	 * needed constructing again.
+	 */
+	if (km6_constructed - built > km6_destroyed) {
+		panic("km6: reuse constructed %u more objects\n",
+		      km6_constructed - built - km6_destroyed);
+	}
+	kprintf("km6: %u objects constructed for %u allocations\n",
+		built, 2 * KM6_NOBJS);
+
+	gettime(&before);
+	for (i=0; i<KM6_ITERS; i++) {
+		o = kmem_cache_alloc(kc);
+		KASSERT(o != NULL);
+		kmem_cache_free(kc, o);
+	}
+	gettime(&after);
+	kprintf("km6: object cache: %llu allocations/sec\n",
+		(unsigned long long)km6_rate(&before, &after));
+
+	gettime(&before);
+	for (i=0; i<KM6_ITERS; i++) {
+		o = kmalloc(sizeof(*o));
+		KASSERT(o != NULL);
+		o->lock = lock_create("km6");
+		KASSERT(o->lock != NULL);
+		lock_destroy(o->lock);
+		kfree(o);
+	}
+	gettime(&after);
+	kprintf("km6: kmalloc and lock_create: %llu allocations/sec\n",
+		(unsigned long long)km6_rate(&before, &after));
+
+	kmem_cache_destroy(kc);
+	kfree(objs);
+	if (km6_destroyed != km6_constructed) {
+		panic("km6: %u objects constructed but %u destroyed\n",
+		      km6_constructed, km6_destroyed);
+	}
+
+	/* Objects bigger than a page get pages of their own. */
+	km6_bigdestroyed = 0;
+	bigkc = kmem_cache_create("km6 big", PAGE_SIZE + 1, NULL,
+				  km6_bigdtor);
+	if (bigkc == NULL) {
+		panic("km6: out of memory\n");
+	}
+	for (i=0; i<3; i++) {
+		big[i] = kmem_cache_alloc(bigkc);
+		if (big[i] == NULL) {
+			panic("km6: kmem_cache_alloc of a big object failed\n");
+		}
+		memset(big[i], i, PAGE_SIZE + 1);
+	}
+	for (i=0; i<3; i++) {
+		kmem_cache_free(bigkc, big[i]);
+	}
+	/* The last one freed comes back, unless reclaim took it. */
+	p = kmem_cache_alloc(bigkc);
+	if (p == NULL) {
+		panic("km6: kmem_cache_alloc of a big object failed\n");
+	}
+	if (p != big[2] && km6_bigdestroyed == 0) {
+		panic("km6: freed big object was not reused\n");
+	}
+	kmem_cache_free(bigkc, p);
+	kmem_cache_destroy(bigkc);
+
+	kprintf("Object cache test done\n");
+	return 0;
+}
@@ -32,11 +32,15 @@
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <wchan.h>
 #include <current.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <proc.h>
+#include <vnode.h>
+#include <pagecache.h>
+#include <swap.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -64,7 +68,8 @@ as_create(void)
 	 * Initialize as needed.
 	 */
 
-	// Initial the first-level page table
+	// Initial the first-level page table; second-level tables are
+	// only allocated when something is mapped in their range
 	as->pagetable = kmalloc(sizeof(paddr_t *) * FIRST_LEVEL);
 
 	// Check if the kmalloc fail
@@ -79,16 +84,155 @@ as_create(void)
 	{
 		as->pagetable[i] = NULL;
 	}
+	as->as_ptpages = 0;
 
-	// Set the region link list
-	as->region_list = NULL;
+	spinlock_init(&as->as_ptlock);
+	as->as_ptwchan = wchan_create("pt");
+	if (as->as_ptwchan == NULL)
+	{
+		spinlock_cleanup(&as->as_ptlock);
+		kfree(as->pagetable);
+		kfree(as);
+		return NULL;
+	}
+	as->as_pins = 0;
+
+	// Start with no regions; the array is allocated on first use
+	as->regions = NULL;
+	as->nregions = 0;
+	as->maxregions = 0;
+	as->last_region = NULL;
+
+	// No heap or stack until the executable is loaded
+	as->heap = NULL;
+	as->heap_end = 0;
+	as->stack = NULL;
+	as->stack_floor = 0;
+
+	// No ASID until the address space is first activated
+	as->as_asid = 0;
+	as->as_asid_gen = 0;
+	as->as_tlbcpus = 0;
+	as->as_tlbstale = 0;
+
+	as->as_fa_mapped = 0;
+	as->as_fa_preloaded = 0;
+	bzero(&as->as_vmstat, sizeof(as->as_vmstat));
 
 	return as;
 }
 
+/*
+ * Copy the region array of OLD into NEW, which has no regions yet.
+ */
+static int regions_copy(struct addrspace *old, struct addrspace *new)
+{
+	struct region *copy;
+
+	if (old->nregions == 0)
+	{
+		return 0;
+	}
+
+	new->regions = kmalloc(sizeof(struct region *) * old->maxregions);
+	if (new->regions == NULL)
+	{
+		return ENOMEM;
+	}
+	new->maxregions = old->maxregions;
+
+	for (unsigned i = 0; i < old->nregions; i++)
+	{
+		copy = kmalloc(sizeof(struct region));
+		if (copy == NULL)
+		{
+			return ENOMEM;
+		}
+		*copy = *old->regions[i];
+		if (copy->vnode != NULL)
+		{
+			VOP_INCREF(copy->vnode);
+		}
+		new->regions[new->nregions++] = copy;
+		if (old->regions[i] == old->heap)
+		{
+			new->heap = copy;
+		}
+		if (old->regions[i] == old->stack)
+		{
+			new->stack = copy;
+		}
+	}
+	new->heap_end = old->heap_end;
+	new->stack_floor = old->stack_floor;
+
+	return 0;
+}
+
+/*
+ * The lowest address REGION may ever reach. The stack keeps room to
+ * grow to its limit plus a guard gap; other regions don't move.
+ */
+static vaddr_t region_floor(struct addrspace *as, struct region *region)
+{
+	if (region == as->stack)
+	{
+		return as->stack_floor - STACK_GUARD_PAGES * PAGE_SIZE;
+	}
+	return region->vaddress;
+}
+
+/*
+ * Index of the first region that starts above VADDR, so the only
+ * region that can contain VADDR is the one before it.
+ */
+static unsigned region_upper_bound(struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned lo = 0;
+	unsigned hi = as->nregions;
+
+	while (lo < hi)
+	{
+		unsigned mid = lo + (hi - lo) / 2;
+		if (as->regions[mid]->vaddress <= vaddr)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Fork copies the page table, not the pages. Every mapped frame gets
+ * another reference and is made read-only in both the parent and the
+ * child; the first write from either side takes a VM_FAULT_READONLY
+ * and vm_fault() copies the page then. So fork costs time in
+ * proportion to the size of the page table, not the resident size.
+ * Pages on swap are the exception: the child gets its own copy read
+ * back into memory, as swap slots are not shared.
+ */
 int as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *newas;
+	int result;
+
+	// Mapped pages are about to lose their dirty bits to
+	// copy-on-write, so get them to the file first
+	for (unsigned i = 0; i < old->nregions; i++)
+	{
+		if (old->regions[i]->mapped)
+		{
+			result = vm_msync_region(old, old->regions[i]);
+			if (result)
+			{
+				return result;
+			}
+		}
+	}
 
 	newas = as_create();
 	if (newas == NULL)
@@ -96,104 +240,90 @@ int as_copy(struct addrspace *old, struct addrspace **ret)
 		return ENOMEM;
 	}
 
-	/*
-	 * Write this.
-	 */
+	// Copy the region first
+	result = regions_copy(old, newas);
+	if (result)
+	{
+		as_destroy(newas);
+		return result;
+	}
 
 	for (int i = 0; i < FIRST_LEVEL; i++)
 	{
 		// Check if the first level is none
 		if (old->pagetable[i] == NULL)
 		{
-			newas->pagetable[i] = NULL;
+			continue;
 		}
-		else
+
+		// If first level table are not none, we need to share the second level table entries
+		paddr_t *table = pt_alloc_table();
+		if (table == NULL)
 		{
-			// Copy the page table first
-			// If first level table are not none, we need to save the second level table information
-			newas->pagetable[i] = kmalloc(sizeof(paddr_t *) * SECOND_LEVEL);
-			for (int j = 0; j < SECOND_LEVEL; j++)
-			{
-				// Check if the second level is none
-				if (old->pagetable[i][j] != 0)
-				{
-					// If not none
-					// Allocate the frame
-					vaddr_t frame = alloc_kpages(1);
-					if (frame == 0)
-					{
-						as_destroy(newas);
-						return ENOMEM;
-					}
-
-					// Copy pte from old as to frame
-					vaddr_t oldas_frame = PADDR_TO_KVADDR(old->pagetable[i][j] & PAGE_FRAME);
-					memmove((void *)frame, (const void *)oldas_frame, PAGE_SIZE);
-
-					int dirty = old->pagetable[i][j] & TLBLO_DIRTY;
-
-					// Add to the new as frame
-					paddr_t newas_frame = KVADDR_TO_PADDR(frame) | TLBLO_VALID | dirty;
-					newas->pagetable[i][j] = newas_frame;
-				}
-				else
-				{
-					newas->pagetable[i][j] = 0;
-				}
-			}
+			as_destroy(newas);
+			return ENOMEM;
 		}
 
-		//	Then copy the region
-		if (old->region_list != NULL)
+		// The child's pages get owners as they are copied, so the
+		// pager can find it from here on. Both locks are held, the
+		// parent's first; the pager only ever holds one.
+		spinlock_acquire(&old->as_ptlock);
+		spinlock_acquire(&newas->as_ptlock);
+		newas->pagetable[i] = table;
+		newas->as_ptpages++;
+		for (int j = 0; j < SECOND_LEVEL; j++)
 		{
-			// Create the new region linked list
-			newas->region_list = kmalloc(sizeof(struct region));
-			if (newas->region_list == NULL)
+			// Let the pager finish with the page first
+			while (old->pagetable[i][j] & PTE_BUSY)
 			{
-				as_destroy(newas);
-				return ENOMEM;
+				spinlock_release(&newas->as_ptlock);
+				pt_wait(old);
+				spinlock_acquire(&newas->as_ptlock);
 			}
-			// Copy the old region information to new region list
-			newas->region_list->vaddress = old->region_list->vaddress;
-			newas->region_list->size = old->region_list->size;
-			newas->region_list->readable = old->region_list->readable;
-			newas->region_list->writeable = old->region_list->writeable;
-			newas->region_list->executable = old->region_list->executable;
-			newas->region_list->old_writeable = old->region_list->old_writeable;
-
-			// We also need to copy the link list inforamtion
-			// Set a loop to copy until go through all oldd link list
-			while (old->region_list->next != NULL)
+			paddr_t pte = old->pagetable[i][j];
+
+			// Check if the second level is none
+			if (pte == 0)
+			{
+				continue;
+			}
+
+			if (pte & PTE_SWAPPED)
 			{
-				newas->region_list->next = kmalloc(sizeof(struct region));
-				// Check if allocate success
-				if (newas->region_list->next == NULL)
+				// Only we can fault the parent's pages back in, so the
+				// entry stays put while the locks are dropped
+				spinlock_release(&newas->as_ptlock);
+				spinlock_release(&old->as_ptlock);
+				result = vm_swapcopy(pte, &pte);
+				if (result)
 				{
 					as_destroy(newas);
-					return ENOMEM;
+					return result;
 				}
-
-				// Copy information
-				newas->region_list->next->vaddress = old->region_list->next->vaddress;
-				newas->region_list->next->size = old->region_list->next->size;
-				newas->region_list->next->readable = old->region_list->next->readable;
-				newas->region_list->next->writeable = old->region_list->next->writeable;
-				newas->region_list->next->executable = old->region_list->next->executable;
-				newas->region_list->next->old_writeable = old->region_list->next->old_writeable;
-
-				// Move to the next link list
-				newas->region_list = newas->region_list->next;
-				old->region_list->next = old->region_list->next->next;
+				spinlock_acquire(&old->as_ptlock);
+				spinlock_acquire(&newas->as_ptlock);
+				newas->pagetable[i][j] = pte;
+				frame_touch(pte & PAGE_FRAME, newas,
+							PT_VADDR(i, j));
+				continue;
 			}
 
-			newas->region_list->next = NULL;
-		}
-		else
-		{
-			newas->region_list = NULL;
+			// Write-protect the parent's copy and share the frame.
+			// Shared frames have no owner, so both copies go back
+			// through vm_fault(), which can give the frame an owner
+			// again once the sharing ends.
+			pte &= ~(paddr_t)(TLBLO_DIRTY | PTE_ACCESSED);
+			old->pagetable[i][j] = pte;
+			frame_incref(pte & PAGE_FRAME);
+			newas->pagetable[i][j] = pte;
 		}
+		spinlock_release(&newas->as_ptlock);
+		spinlock_release(&old->as_ptlock);
 	}
 
+	// The parent may still have writable translations cached
+	vm_tlb_flush_as(old);
+
 	*ret = newas;
 	return 0;
 }
@@ -204,38 +334,89 @@ void as_destroy(struct addrspace *as)
 	 * Clean up as needed.
 	 */
 
-	// Free all region link list
-	struct region *cur, *nex;
-	cur = as->region_list;
-
-	while (cur != NULL)
+	// Anything written to mapped files goes back to them. There is
+	// nobody to report a failure to.
+	for (unsigned i = 0; i < as->nregions; i++)
 	{
-		nex = cur->next;
-		kfree(cur);
-		cur = nex;
+		if (as->regions[i]->mapped)
+		{
+			vm_msync_region(as, as->regions[i]);
+		}
 	}
 
-	// Free the whole pagetable structure
+	// Its ASID is not handed out again until the next generation, but
+	// there is no point leaving the entries to take up TLB slots
+	vm_tlb_destroy_as(as);
+
+	// Free the whole pagetable structure. This goes first: the pager
+	// looks at the regions of any page it finds in the frame table.
 	for (int i = 0; i < FIRST_LEVEL; i++)
 	{
-		if (as->pagetable[i] != NULL)
+		paddr_t *table = as->pagetable[i];
+		if (table != NULL)
 		{
+			spinlock_acquire(&as->as_ptlock);
 			for (int j = 0; j < SECOND_LEVEL; j++)
 			{
-				if (as->pagetable[i][j] != 0)
+				// The pager may be writing the page out
+				while (table[j] & PTE_BUSY)
 				{
-					free_kpages(PADDR_TO_KVADDR(as->pagetable[i][j] & PAGE_FRAME));
+					pt_wait(as);
 				}
+
+				paddr_t pte = as->pagetable[i][j];
+				if (pte & PTE_SWAPPED)
+				{
+					swap_free(PTE_SWAP_SLOT(pte));
+				}
+				else if (pte != 0)
+				{
+					// Drops our reference; shared frames stay with the other owners
+					free_kpages(PADDR_TO_KVADDR(pte & PAGE_FRAME));
+				}
+				as->pagetable[i][j] = 0;
 			}
-			kfree(as->pagetable[i]);
+			// A pager that got here through the frame table before
+			// we freed the frames finds nothing mapped
+			as->pagetable[i] = NULL;
+			spinlock_release(&as->as_ptlock);
+			pt_free_table(table);
 		}
 	}
 
+	// No frame names us as its owner any more; wait out any pager
+	// that looked us up before that
+	frame_wait_unpinned(as);
+
 	kfree(as->pagetable);
 
+	// Free all the regions
+	for (unsigned i = 0; i < as->nregions; i++)
+	{
+		struct region *region = as->regions[i];
+		if (region->vnode != NULL)
+		{
+			// Text pages nobody else is running any more
+			if (!region->writeable && !region->mapped)
+			{
+				pagecache_release(region->vnode);
+			}
+			VOP_DECREF(region->vnode);
+		}
+		kfree(region);
+	}
+	kfree(as->regions);
+
+	wchan_destroy(as->as_ptwchan);
+	spinlock_cleanup(&as->as_ptlock);
 	kfree(as);
 }
 
+size_t as_ptusage(struct addrspace *as)
+{
+	return sizeof(paddr_t *) * FIRST_LEVEL + (size_t)as->as_ptpages * PAGE_SIZE;
+}
+
 void as_activate(void)
 {
 	struct addrspace *as;
@@ -254,17 +435,8 @@ void as_activate(void)
 	 * Write this.
 	 */
 
-	// Saving the current interrupt status and disabling interrupts
-	int spl = splhigh();
-
-	// Invalidate all TLB entries
-	for (int i = 0; i < NUM_TLB; i++)
-	{
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
-
-	// Restores the previous interrupt level
-	splx(spl);
+	// Entries are tagged by ASID, so there is nothing to flush
+	vm_tlb_activate(as);
 }
 
 void as_deactivate(void)
@@ -278,6 +450,10 @@ void as_deactivate(void)
 	as_activate();
 }
 
+static int region_create(struct addrspace *as, vaddr_t vaddr, size_t memsize,
+						 int readable, int writeable, int executable,
+						 struct region **ret);
+
 /*
  * Set up a segment at virtual address VADDR of size MEMSIZE. The
  * segment in memory extends from VADDR up to (but not including)
@@ -295,6 +471,17 @@ int as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 	 * Write this.
 	 */
 
+	return region_create(as, vaddr, memsize, readable, writeable, executable, NULL);
+}
+
+/*
+ * The guts of as_define_region(), also handing back the new region
+ * in *RET if RET is not NULL.
+ */
+static int region_create(struct addrspace *as, vaddr_t vaddr, size_t memsize,
+						 int readable, int writeable, int executable,
+						 struct region **ret)
+{
 	// Check if the input has problem
 	if (as == NULL)
 	{
@@ -325,17 +512,62 @@ int as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 	new_region->writeable = writeable;
 	new_region->executable = executable;
 	new_region->old_writeable = writeable;
+	new_region->vnode = NULL;
+	new_region->file_vaddr = 0;
+	new_region->file_offset = 0;
+	new_region->file_size = 0;
+	new_region->mapped = 0;
+
+	// Find where the region goes and make sure it fits between its
+	// neighbours
+	unsigned pos = region_upper_bound(as, vaddr);
+	if ((pos > 0 && as->regions[pos - 1]->vaddress + as->regions[pos - 1]->size > vaddr) ||
+		(pos < as->nregions && as->regions[pos]->vaddress < vaddr + memsize))
+	{
+		kfree(new_region);
+		return EINVAL;
+	}
+
+	// Grow the array by doubling
+	struct region **oldarray = NULL;
+	struct region **array = as->regions;
+	unsigned max = as->maxregions;
+	if (as->nregions == max)
+	{
+		max = max == 0 ? 4 : max * 2;
+		array = kmalloc(sizeof(struct region *) * max);
+		if (array == NULL)
+		{
+			kfree(new_region);
+			return ENOMEM;
+		}
+		for (unsigned i = 0; i < as->nregions; i++)
+		{
+			array[i] = as->regions[i];
+		}
+		oldarray = as->regions;
+	}
 
-	// Put new region in link list
-	struct region *cur = as->region_list;
-	while (cur != NULL && cur->next != NULL)
+	spinlock_acquire(&as->as_ptlock);
+	for (unsigned i = as->nregions; i > pos; i--)
 	{
-		cur = cur->next;
+		array[i] = array[i - 1];
 	}
+	array[pos] = new_region;
+	as->regions = array;
+	as->maxregions = max;
+	as->nregions++;
+	spinlock_release(&as->as_ptlock);
 
-	cur = new_region;
-	cur->next = new_region;
+	if (oldarray != NULL)
+	{
+		kfree(oldarray);
+	}
 
+	if (ret != NULL)
+	{
+		*ret = new_region;
+	}
 	return 0;
 }
 
@@ -352,15 +584,9 @@ int as_prepare_load(struct addrspace *as)
 	}
 
 	// Set all regions to be writable
-	struct region *cur = as->region_list;
-
-	while (cur != NULL)
+	for (unsigned i = 0; i < as->nregions; i++)
 	{
-		if ((cur->writeable) == 0)
-		{
-			cur->writeable = 1;
-		}
-		cur = cur->next;
+		as->regions[i]->writeable = 1;
 	}
 
 	return 0;
@@ -379,19 +605,87 @@ int as_complete_load(struct addrspace *as)
 	}
 
 	// Restore the previous writeable
-	struct region *cur = as->region_list;
+	vaddr_t top = 0;
+	for (unsigned i = 0; i < as->nregions; i++)
+	{
+		as->regions[i]->writeable = as->regions[i]->old_writeable;
+		if (as->regions[i]->vaddress + as->regions[i]->size > top)
+		{
+			top = as->regions[i]->vaddress + as->regions[i]->size;
+		}
+	}
 
-	while (cur != NULL)
+	// The heap starts out empty just above the last segment and is
+	// grown by sbrk()
+	int result = region_create(as, top, 0, 1, 1, 0, &as->heap);
+	if (result)
 	{
-		cur->writeable = cur->old_writeable;
-		cur = cur->next;
+		return result;
 	}
+	as->heap_end = top;
 
 	as_activate();
 
 	return 0;
 }
 
+/*
+ * Record that the region containing VADDR is backed by FILESIZE bytes
+ * of V starting at OFFSET. Nothing is read now; vm_fault() pulls each
+ * page in from the file the first time it is touched. The region
+ * holds a reference to the vnode until the address space goes away.
+ */
+int as_define_backing(struct addrspace *as, vaddr_t vaddr,
+					  struct vnode *v, off_t offset, size_t filesize)
+{
+	struct region *region = as_find_region(as, vaddr & PAGE_FRAME);
+	if (region == NULL || region->vnode != NULL)
+	{
+		return EFAULT;
+	}
+
+	// The file image must fit inside the region
+	if (vaddr + filesize > region->vaddress + region->size)
+	{
+		return ENOEXEC;
+	}
+
+	VOP_INCREF(v);
+	region->vnode = v;
+	region->file_vaddr = vaddr;
+	region->file_offset = offset;
+	region->file_size = filesize;
+
+	return 0;
+}
+
+struct region *as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *cur;
+
+	// Faults tend to come in runs within one region
+	cur = as->last_region;
+	if (cur != NULL && vaddr >= cur->vaddress && vaddr < cur->vaddress + cur->size)
+	{
+		return cur;
+	}
+
+	unsigned pos = region_upper_bound(as, vaddr);
+	if (pos == 0)
+	{
+		return NULL;
+	}
+
+	cur = as->regions[pos - 1];
+	if (vaddr >= cur->vaddress + cur->size)
+	{
+		return NULL;
+	}
+
+	as->last_region = cur;
+	return cur;
+}
+
 int as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
 	/*
@@ -401,15 +695,261 @@ int as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	/* User-level stack pointer */
 	*stackptr = USERSTACK;
 
-	// Set stack region with system size and permissions
-	size_t memsize = NUM_STACK_PAGES * PAGE_SIZE;
+	// Start small; vm_fault() grows the stack as it is used
+	size_t memsize = STACK_INIT_PAGES * PAGE_SIZE;
 	vaddr_t addr = *stackptr - memsize;
 
-	int res = as_define_region(as, addr, memsize, 1, 1, 0);
+	int res = region_create(as, addr, memsize, 1, 1, 0, &as->stack);
 	if (res)
 	{
 		return res;
 	}
 
+	size_t limit = curproc->p_stacklimit;
+	if (limit < memsize)
+	{
+		limit = memsize;
+	}
+	as->stack_floor = USERSTACK - ROUNDUP(limit, PAGE_SIZE);
+
+	return 0;
+}
+
+int as_grow_stack(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *stack = as->stack;
+
+	vaddr &= PAGE_FRAME;
+	if (stack == NULL || vaddr >= stack->vaddress || vaddr < as->stack_floor)
+	{
+		return EFAULT;
+	}
+
+	spinlock_acquire(&as->as_ptlock);
+
+	// Keep the guard gap even if something was put below the stack
+	// before its limit was known
+	unsigned pos = region_upper_bound(as, stack->vaddress) - 1;
+	if (pos > 0)
+	{
+		struct region *below = as->regions[pos - 1];
+		if (below->vaddress + below->size + STACK_GUARD_PAGES * PAGE_SIZE > vaddr)
+		{
+			spinlock_release(&as->as_ptlock);
+			return EFAULT;
+		}
+	}
+
+	stack->size += stack->vaddress - vaddr;
+	stack->vaddress = vaddr;
+
+	spinlock_release(&as->as_ptlock);
+	return 0;
+}
+
+/*
+ * Move the break of AS by AMOUNT bytes and hand back the old one.
+ * Growing only changes the size of the heap region; vm_fault() fills
+ * in the pages when they are touched. Shrinking throws away the pages
+ * that drop off the end.
+ */
+int as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	struct region *heap = as->heap;
+
+	if (heap == NULL)
+	{
+		return ENOMEM;
+	}
+
+	spinlock_acquire(&as->as_ptlock);
+
+	vaddr_t old = as->heap_end;
+	vaddr_t new = old + amount;
+	if (amount < 0 && (new > old || new < heap->vaddress))
+	{
+		spinlock_release(&as->as_ptlock);
+		return EINVAL;
+	}
+	if (amount > 0 && new < old)
+	{
+		spinlock_release(&as->as_ptlock);
+		return ENOMEM;
+	}
+
+	// The heap may grow up to the next region (normally the stack,
+	// whose room to grow is kept free)
+	unsigned pos = region_upper_bound(as, heap->vaddress);
+	vaddr_t limit = pos < as->nregions ? region_floor(as, as->regions[pos]) : USERSPACETOP;
+	if (new > limit)
+	{
+		spinlock_release(&as->as_ptlock);
+		return ENOMEM;
+	}
+
+	size_t oldsize = heap->size;
+	size_t newsize = ROUNDUP(new - heap->vaddress, PAGE_SIZE);
+	if (newsize > oldsize)
+	{
+		heap->size = newsize;
+	}
+	as->heap_end = new;
+
+	spinlock_release(&as->as_ptlock);
+
+	if (newsize < oldsize)
+	{
+		// Unmap while the region still covers the pages, so the pager
+		// never finds a page outside its region
+		vm_unmap_range(as, heap->vaddress + newsize, heap->vaddress + oldsize);
+
+		spinlock_acquire(&as->as_ptlock);
+		heap->size = newsize;
+		spinlock_release(&as->as_ptlock);
+	}
+
+	*oldbreak = old;
+	return 0;
+}
+
+/*
+ * Take REGION out of the region array of AS. Its pages must already
+ * be gone.
+ */
+static void region_remove(struct addrspace *as, struct region *region)
+{
+	spinlock_acquire(&as->as_ptlock);
+
+	unsigned pos = region_upper_bound(as, region->vaddress) - 1;
+	KASSERT(as->regions[pos] == region);
+
+	for (unsigned i = pos; i + 1 < as->nregions; i++)
+	{
+		as->regions[i] = as->regions[i + 1];
+	}
+	as->nregions--;
+
+	if (as->last_region == region)
+	{
+		as->last_region = NULL;
+	}
+
+	spinlock_release(&as->as_ptlock);
+}
+
+/*
+ * Find SIZE bytes of unused address space for a mapping. Mappings are
+ * placed top-down from the stack, taking the highest gap that fits,
+ * but never below the heap so that it keeps its room to grow.
+ */
+static int mmap_find_space(struct addrspace *as, size_t size, vaddr_t *ret)
+{
+	vaddr_t top = USERSPACETOP;
+
+	for (unsigned i = as->nregions; i > 0; i--)
+	{
+		struct region *cur = as->regions[i - 1];
+		vaddr_t end = cur->vaddress + cur->size;
+
+		if (top >= end && top - end >= size)
+		{
+			*ret = top - size;
+			return 0;
+		}
+		if (cur == as->heap)
+		{
+			break;
+		}
+		top = region_floor(as, cur);
+	}
+
+	return ENOMEM;
+}
+
+int as_mmap(struct addrspace *as, size_t size, int writeable,
+			struct vnode *v, off_t offset, size_t filesize, vaddr_t *ret)
+{
+	struct region *region;
+	vaddr_t vaddr;
+	int result;
+
+	size = ROUNDUP(size, PAGE_SIZE);
+	if (size == 0)
+	{
+		return EINVAL;
+	}
+
+	result = mmap_find_space(as, size, &vaddr);
+	if (result)
+	{
+		return result;
+	}
+
+	result = region_create(as, vaddr, size, 1, writeable, 0, &region);
+	if (result)
+	{
+		return result;
+	}
+
+	VOP_INCREF(v);
+	region->vnode = v;
+	region->file_vaddr = vaddr;
+	region->file_offset = offset;
+	region->file_size = filesize;
+	region->mapped = 1;
+
+	*ret = vaddr;
 	return 0;
 }
+
+/*
+ * The mapping that starts at VADDR, or NULL.
+ */
+static struct region *mmap_lookup(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *region = as_find_region(as, vaddr);
+
+	if (region == NULL || !region->mapped || region->vaddress != vaddr)
+	{
+		return NULL;
+	}
+	return region;
+}
+
+int as_munmap(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *region = mmap_lookup(as, vaddr);
+	int result;
+
+	if (region == NULL)
+	{
+		return EINVAL;
+	}
+
+	// If the file can't take the data, keep the mapping so it isn't lost
+	result = vm_msync_region(as, region);
+	if (result)
+	{
+		return result;
+	}
+
+	vm_unmap_range(as, region->vaddress, region->vaddress + region->size);
+	region_remove(as, region);
+
+	VOP_DECREF(region->vnode);
+	kfree(region);
+
+	return 0;
+}
+
+int as_msync(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *region = mmap_lookup(as, vaddr);
+
+	if (region == NULL)
+	{
+		return EINVAL;
+	}
+
+	return vm_msync_region(as, region);
+}
@@ -30,7 +30,11 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <platform/maxcpus.h>
 
 /*
  * Kernel malloc.
@@ -78,6 +82,19 @@ fill_deadbeef(void *vptr, size_t len)
 //    cannot recursively use the subpage allocator. (We could probably
 //    make that work, but it would be painful.)
 //
+//    Blocks bigger than half a page are carved the same way out of
+//    chunks of a few pages, as many as it takes for the blocks to fill
+//    them exactly (four 3K blocks or two 6K blocks to three pages),
+//    so they don't waste the rest of a page each. For these, "page"
+//    below means the whole chunk. The frame allocator can hand out a
+//    three-page run without finding a four-page block for it. One free
+//    chunk of each multipage size is kept back, so a block that is
+//    allocated and freed over and over doesn't cost a search for
+//    contiguous frames each time; the kernel heap shrinker gives those
+//    back. If a multipage chunk can't be had, kmalloc falls back to
+//    just enough whole pages, as it does for allocations bigger than
+//    the largest block.
+//
 
 ////////////////////////////////////////
 
@@ -102,6 +119,15 @@ fill_deadbeef(void *vptr, size_t len)
  * LABELS records the allocation site and a generation number for each
  * allocation and is useful for tracking down memory leaks.
  *
+ * HEAPPROFILE enables LABELS and also keeps totals for each allocation
+ * site: the heap bytes it has live now, at its peak, and at the last
+ * kheap_nextgeneration, and how many allocations it has made.
+ * kheap_profile prints the sites that hold the most. This needs no
+ * extra space in the blocks, but sizes are the heap block sizes, so
+ * they include rounding up. Whole-page kmallocs and kmem_cache objects
+ * have nowhere to keep a label, so they are charged through a fixed
+ * table on the side; if that fills up, the excess isn't counted.
+ *
  * On top of these one can enable the following:
  *
  * CHECKBEEF checks that free blocks still contain 0xdeadbeef when
@@ -111,25 +137,50 @@ fill_deadbeef(void *vptr, size_t len)
  * CHECKGUARDS checks that allocated blocks' guard bands are intact
  * when checking kernel heap pages with SLOW and SLOWER. This is also
  * quite slow in its own right.
+ *
+ * MAGAZINES puts per-cpu caches of free blocks in front of the
+ * subpage allocator (see below). Blocks in a magazine look allocated
+ * to the heap checks, the guard bands, and the leak dumps, so any of
+ * the debugging modes turns it off.
  */
 
 #undef  SLOW
 #undef SLOWER
 #undef GUARDS
 #undef LABELS
+#undef HEAPPROFILE
 
 #undef CHECKBEEF
 #undef CHECKGUARDS
 
+#define MAGAZINES
+
+/* HEAPPROFILE implies LABELS */
+#ifdef HEAPPROFILE
+#ifndef LABELS
+#define LABELS
+#endif
+#endif
+
+#if defined(SLOW) || defined(SLOWER) || defined(GUARDS) || defined(LABELS) || \
+    defined(CHECKBEEF) || defined(CHECKGUARDS)
+#undef MAGAZINES
+#endif
+
 ////////////////////////////////////////
 
 #if PAGE_SIZE == 4096
 
-#define NSIZES 8
-static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+#define NSIZES 14
+static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048,
+				      3072, 4096, 6144, 8192, 12288, 16384 };
+/* Pages per chunk of each size */
+static const unsigned chunkpages[NSIZES] = { 1, 1, 1, 1, 1, 1, 1, 1,
+					     3, 1, 3, 2, 3, 4 };
 
 #define SMALLEST_SUBPAGE_SIZE 16
-#define LARGEST_SUBPAGE_SIZE 2048
+#define LARGEST_BLOCK_SIZE 16384
+#define MAX_CHUNKPAGES 4
 
 #elif PAGE_SIZE == 8192
 #error "No support for 8k pages (yet?)"
@@ -145,7 +196,6 @@ struct freelist {
 
 struct pageref {
 	struct pageref *next_samesize;
-	struct pageref *next_all;
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
@@ -157,13 +207,16 @@ struct pageref {
 #define PR_BLOCKTYPE(pr) ((pr)->pageaddr_and_blocktype & ~PAGE_FRAME)
 #define MKPAB(pa, blk)   (((pa)&PAGE_FRAME) | ((blk) & ~PAGE_FRAME))
 
+/* Bytes in, and blocks on, a page (chunk) of each block type */
+#define CHUNK_SIZE(blktype)    (chunkpages[blktype] * PAGE_SIZE)
+#define CHUNK_NBLOCKS(blktype) (CHUNK_SIZE(blktype) / sizes[blktype])
+
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the whole subpage allocator. The per-cpu
+ * magazines in front of it (if MAGAZINES) keep most kmallocs and
+ * kfrees from taking it.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -174,11 +227,12 @@ static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
  * We can only allocate whole pages of pageref structure at a time.
  * This is a struct type for such a page.
  *
- * Each pageref page contains 256 pagerefs, which can manage up to
- * 256 * 4K = 1M of kernel heap.
+ * Each pageref page contains 320 pagerefs (as many as fit, rounded
+ * down to a whole word of the in-use bitmap), which can manage up to
+ * 320 * 4K = 1.25M of kernel heap.
  */
 
-#define NPAGEREFS_PER_PAGE (PAGE_SIZE / sizeof(struct pageref))
+#define NPAGEREFS_PER_PAGE ((PAGE_SIZE / sizeof(struct pageref)) & ~31U)
 
 struct pagerefpage {
 	struct pageref refs[NPAGEREFS_PER_PAGE];
@@ -242,7 +296,10 @@ allocpagerefpage(struct kheap_root *root)
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(va);
 		spinlock_acquire(&kmalloc_spinlock);
-		/* Once allocated it isn't ever freed. */
+		/*
+		 * kheap_reclaim only frees pages with no pagerefs in
+		 * use, and our caller has claimed one.
+		 */
 		KASSERT(root->page != NULL);
 		return;
 	}
@@ -336,14 +393,200 @@ freepageref(struct pageref *p)
 	KASSERT(0);
 }
 
+/*
+ * Return the number of pageref P: its index in its pageref page plus
+ * NPAGEREFS_PER_PAGE times the index of that page.
+ */
+static
+unsigned
+pagerefnum(struct pageref *p)
+{
+	unsigned whichroot;
+	size_t j;
+	struct pagerefpage *page;
+
+	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
+		page = kheaproots[whichroot].page;
+		if (page == NULL) {
+			continue;
+		}
+		j = p-page->refs;
+		/* note: j is unsigned, don't test < 0 */
+		if (j < NPAGEREFS_PER_PAGE) {
+			return whichroot * NPAGEREFS_PER_PAGE + j;
+		}
+	}
+	/* pageref wasn't on any of the pages */
+	panic("kmalloc: pageref %p is not on a pageref page\n", p);
+	return 0;
+}
+
+/*
+ * Return the pageref numbered NUM, which must be in use.
+ */
+static
+struct pageref *
+pagerefbynum(unsigned num)
+{
+	struct kheap_root *root;
+
+	KASSERT(num < TOTAL_PAGEREFS);
+	root = &kheaproots[num / NPAGEREFS_PER_PAGE];
+	KASSERT(root->page != NULL);
+	return &root->page->refs[num % NPAGEREFS_PER_PAGE];
+}
+
+#ifdef MAGAZINES
+static unsigned kmag_drain_all(void);
+static void kmag_printstats(void);
+#endif
+static unsigned kheap_dropspares(void);
+
+/*
+ * Give back up to NPAGES pageref pages that have no pagerefs in use.
+ * A heap that grew and then shrank again keeps these otherwise. The
+ * magazines are emptied first, which can free heap pages too.
+ */
+unsigned
+kheap_reclaim(unsigned npages)
+{
+	unsigned whichroot, freed;
+	struct kheap_root *root;
+	struct pagerefpage *page;
+
+	freed = 0;
+#ifdef MAGAZINES
+	freed += kmag_drain_all();
+#endif
+	freed += kheap_dropspares();
+	for (whichroot=0; whichroot < NUM_PAGEREFPAGES && freed < npages;
+	     whichroot++) {
+		root = &kheaproots[whichroot];
+
+		spinlock_acquire(&kmalloc_spinlock);
+		page = NULL;
+		if (root->page != NULL && root->numinuse == 0) {
+			page = root->page;
+			root->page = NULL;
+		}
+		spinlock_release(&kmalloc_spinlock);
+
+		if (page != NULL) {
+			free_kpages((vaddr_t)page);
+			freed++;
+		}
+	}
+
+	return freed;
+}
+
 ////////////////////////////////////////
 
 /*
- * Each pageref is on two linked lists: one list of pages of blocks of
- * that same size, and one of all blocks.
+ * Each pageref is on the list of pages of blocks of that same size.
+ * kfree goes from a pointer to its page's pageref through the page
+ * map below instead.
  */
 static struct pageref *sizebases[NSIZES];
-static struct pageref *allbase;
+
+/* The free chunk kept back for each multipage block type, if any */
+static struct pageref *sparechunks[NSIZES];
+
+/*
+ * For each physical page in the heap, the block type plus one, the
+ * page's index in its chunk, and the number of the chunk's pageref
+ * (see pagerefnum); 0 for every other page. It is set and cleared
+ * under kmalloc_spinlock, but cannot change while a block on the
+ * page is allocated, so kfree can read it without the lock. It
+ * covers every page of RAM and is carved out of physical memory by
+ * ram_bootstrap, next to the frame table; see kheap_bootstrap.
+ */
+#define PT_TYPEBITS 4
+#define PT_INDEXBITS 4
+#define PT_PRSHIFT (PT_TYPEBITS + PT_INDEXBITS)
+#define PT_MAKE(blktype, index, prnum) \
+	(((blktype) + 1) | ((index) << PT_TYPEBITS) | ((prnum) << PT_PRSHIFT))
+#define PT_BLOCKTYPE(pt)	((int)((pt) & ((1 << PT_TYPEBITS) - 1)) - 1)
+#define PT_INDEX(pt)		(((pt) >> PT_TYPEBITS) & ((1 << PT_INDEXBITS) - 1))
+#define PT_PAGEREF(pt)		((pt) >> PT_PRSHIFT)
+
+static uint32_t *pagetypes;
+static unsigned kheap_npages;
+
+/*
+ * Return how many bytes of memory the page map needs for NPAGES
+ * pages of RAM.
+ */
+size_t
+kheap_mapsize(unsigned npages)
+{
+	return npages * sizeof(pagetypes[0]);
+}
+
+/*
+ * Install the page map at MAP, which ram_bootstrap has set aside
+ * (kheap_mapsize(NPAGES) bytes of it) for NPAGES pages of RAM. Called
+ * before the first kmalloc.
+ */
+void
+kheap_bootstrap(void *map, unsigned npages)
+{
+	KASSERT(pagetypes == NULL);
+
+	bzero(map, kheap_mapsize(npages));
+	pagetypes = map;
+	kheap_npages = npages;
+}
+
+/*
+ * Point the page map entries of PR's chunk at PR if INHEAP, or clear
+ * them if not.
+ */
+static
+void
+setpagetypes(struct pageref *pr, bool inheap)
+{
+	paddr_t pagenum;
+	unsigned i, npages, prnum;
+	int blktype;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	blktype = PR_BLOCKTYPE(pr);
+	npages = chunkpages[blktype];
+	prnum = pagerefnum(pr);
+	pagenum = KVADDR_TO_PADDR(PR_PAGEADDR(pr)) / PAGE_SIZE;
+	KASSERT(pagenum + npages <= kheap_npages);
+	for (i=0; i<npages; i++) {
+		pagetypes[pagenum + i] =
+			inheap ? PT_MAKE(blktype, i, prnum) : 0;
+	}
+}
+
+/*
+ * Return the block type of the heap page (chunk) holding ADDR and
+ * store its address in *PRPAGE, or return -1 if ADDR is not on one.
+ */
+static
+int
+subpage_lookup(vaddr_t addr, vaddr_t *prpage)
+{
+	paddr_t pagenum;
+	uint32_t pt;
+
+#ifdef __mips__
+	if (addr < MIPS_KSEG0 || addr >= MIPS_KSEG1) {
+		return -1;
+	}
+#endif
+	pagenum = KVADDR_TO_PADDR(addr) / PAGE_SIZE;
+	if (pagenum >= kheap_npages) {
+		return -1;
+	}
+	pt = pagetypes[pagenum];
+	*prpage = (addr & PAGE_FRAME) - PT_INDEX(pt) * PAGE_SIZE;
+	return PT_BLOCKTYPE(pt);
+}
 
 ////////////////////////////////////////
 
@@ -531,7 +774,7 @@ checksubpage(struct pageref *pr)
 	KASSERT(prpage < MIPS_KSEG1);
 #endif
 
-	KASSERT(pr->freelist_offset < PAGE_SIZE);
+	KASSERT(pr->freelist_offset < CHUNK_SIZE(blktype));
 	KASSERT(pr->freelist_offset % blocksize == 0);
 
 	fla = prpage + pr->freelist_offset;
@@ -539,7 +782,7 @@ checksubpage(struct pageref *pr)
 
 	for (; fl != NULL; fl = fl->next) {
 		fla = (vaddr_t)fl;
-		KASSERT(fla >= prpage && fla < prpage + PAGE_SIZE);
+		KASSERT(fla >= prpage && fla < prpage + CHUNK_SIZE(blktype));
 		KASSERT((fla-prpage) % blocksize == 0);
 #ifdef CHECKBEEF
 		checkdeadbeef(fl, blocksize);
@@ -556,7 +799,7 @@ checksubpage(struct pageref *pr)
 	KASSERT(nfree==pr->nfree);
 
 #ifdef CHECKGUARDS
-	numblocks = PAGE_SIZE / blocksize;
+	numblocks = CHUNK_NBLOCKS(blktype);
 	for (i=0; i<numblocks; i++) {
 		mask = 1U << (i % 32);
 		if ((isfree[i / 32] & mask) == 0) {
@@ -580,6 +823,7 @@ void
 checksubpages(void)
 {
 	struct pageref *pr;
+	paddr_t pagenum;
 	int i;
 	unsigned sc=0, ac=0;
 
@@ -588,15 +832,16 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
+			pagenum = KVADDR_TO_PADDR(PR_PAGEADDR(pr)) / PAGE_SIZE;
+			KASSERT(pagetypes[pagenum] ==
+				PT_MAKE(i, 0, pagerefnum(pr)));
 			KASSERT(sc < TOTAL_PAGEREFS);
 			sc++;
 		}
 	}
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		checksubpage(pr);
-		KASSERT(ac < TOTAL_PAGEREFS);
-		ac++;
+	for (i=0; i<NUM_PAGEREFPAGES; i++) {
+		ac += kheaproots[i].numinuse;
 	}
 
 	KASSERT(sc==ac);
@@ -640,7 +885,7 @@ void
 dump_subpage(struct pageref *pr, unsigned generation)
 {
 	unsigned blocksize = sizes[PR_BLOCKTYPE(pr)];
-	unsigned numblocks = PAGE_SIZE / blocksize;
+	unsigned numblocks = CHUNK_NBLOCKS(PR_BLOCKTYPE(pr));
 	unsigned numfreewords = DIVROUNDUP(numblocks, 32);
 	uint32_t isfree[numfreewords], mask;
 	vaddr_t prpage;
@@ -691,6 +936,265 @@ dump_subpages(unsigned generation)
 	}
 }
 
+#ifdef HEAPPROFILE
+
+/*
+ * Allocation sites. These can't come from kmalloc, so there is a
+ * fixed number of them; once they run out, new sites are all counted
+ * together under site 0.
+ */
+
+#define NHEAPSITES 512
+#define HEAPSITE_HASHSIZE 128
+#define HEAPSITE_HASH(label) (((label) / 4) % HEAPSITE_HASHSIZE)
+
+struct heapsite {
+	vaddr_t hs_label;		/* return address of the kmalloc */
+	unsigned hs_bytes;		/* heap bytes live */
+	unsigned hs_peak;		/* most hs_bytes has been */
+	unsigned hs_snapbytes;		/* hs_bytes at kheap_nextgeneration */
+	unsigned hs_allocs;		/* kmallocs, ever */
+	unsigned hs_snapallocs;		/* hs_allocs at kheap_nextgeneration */
+	struct heapsite *hs_next;	/* in the hash chain */
+};
+
+static struct heapsite heapsites[NHEAPSITES];
+static unsigned numheapsites;
+static struct heapsite *heapsitehash[HEAPSITE_HASHSIZE];
+static struct heapsite heapsite_other;
+
+/*
+ * Find the site for LABEL, adding it if there is room.
+ */
+static
+struct heapsite *
+heapsite_get(vaddr_t label)
+{
+	struct heapsite *hs;
+	unsigned h;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	h = HEAPSITE_HASH(label);
+	for (hs = heapsitehash[h]; hs != NULL; hs = hs->hs_next) {
+		if (hs->hs_label == label) {
+			return hs;
+		}
+	}
+	if (numheapsites == NHEAPSITES) {
+		return &heapsite_other;
+	}
+	hs = &heapsites[numheapsites++];
+	hs->hs_label = label;
+	hs->hs_next = heapsitehash[h];
+	heapsitehash[h] = hs;
+	return hs;
+}
+
+/*
+ * Count a block of SIZE bytes allocated (or, if not ALLOC, freed) at
+ * LABEL. Returns the site.
+ */
+static
+struct heapsite *
+heapsite_count(vaddr_t label, size_t size, bool alloc)
+{
+	struct heapsite *hs;
+
+	hs = heapsite_get(label);
+	if (alloc) {
+		hs->hs_bytes += size;
+		hs->hs_allocs++;
+		if (hs->hs_bytes > hs->hs_peak) {
+			hs->hs_peak = hs->hs_bytes;
+		}
+	}
+	else {
+		KASSERT(hs->hs_bytes >= size);
+		hs->hs_bytes -= size;
+	}
+	return hs;
+}
+
+/*
+ * Memory from outside the subpage heap (whole pages, kmem_cache
+ * objects), with the site each piece is charged to.
+ */
+
+#define NHEAPOBJS 2048
+#define HEAPOBJ_HASHSIZE 256
+#define HEAPOBJ_HASH(addr) (((addr) / 16) % HEAPOBJ_HASHSIZE)
+
+struct heapobj {
+	vaddr_t ho_addr;
+	unsigned ho_bytes;
+	struct heapsite *ho_site;
+	struct heapobj *ho_next;	/* in the hash chain or free list */
+};
+
+static struct heapobj heapobjs[NHEAPOBJS];
+static unsigned numheapobjs;		/* ever used from heapobjs[] */
+static struct heapobj *heapobj_freelist;
+static struct heapobj *heapobjhash[HEAPOBJ_HASHSIZE];
+static unsigned heapobj_missed;		/* not counted for lack of room */
+
+/*
+ * Charge BYTES at PTR to LABEL.
+ */
+static
+void
+heapobj_add(vaddr_t ptr, size_t bytes, vaddr_t label)
+{
+	struct heapobj *ho;
+	unsigned h;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	if (heapobj_freelist != NULL) {
+		ho = heapobj_freelist;
+		heapobj_freelist = ho->ho_next;
+	}
+	else if (numheapobjs < NHEAPOBJS) {
+		ho = &heapobjs[numheapobjs++];
+	}
+	else {
+		heapobj_missed++;
+		return;
+	}
+
+	ho->ho_addr = ptr;
+	ho->ho_bytes = bytes;
+	ho->ho_site = heapsite_count(label, bytes, true);
+
+	h = HEAPOBJ_HASH(ptr);
+	ho->ho_next = heapobjhash[h];
+	heapobjhash[h] = ho;
+}
+
+/*
+ * Uncharge PTR, if it was charged.
+ */
+static
+void
+heapobj_remove(vaddr_t ptr)
+{
+	struct heapobj **hop, *ho;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	for (hop = &heapobjhash[HEAPOBJ_HASH(ptr)]; *hop != NULL;
+	     hop = &(*hop)->ho_next) {
+		ho = *hop;
+		if (ho->ho_addr == ptr) {
+			*hop = ho->ho_next;
+			KASSERT(ho->ho_site->hs_bytes >= ho->ho_bytes);
+			ho->ho_site->hs_bytes -= ho->ho_bytes;
+			ho->ho_next = heapobj_freelist;
+			heapobj_freelist = ho;
+			return;
+		}
+	}
+}
+
+/*
+ * Remember every site's totals, for kheap_profile to compare against.
+ */
+static
+void
+heapsite_snapshot(void)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	for (i=0; i<numheapsites; i++) {
+		heapsites[i].hs_snapbytes = heapsites[i].hs_bytes;
+		heapsites[i].hs_snapallocs = heapsites[i].hs_allocs;
+	}
+	heapsite_other.hs_snapbytes = heapsite_other.hs_bytes;
+	heapsite_other.hs_snapallocs = heapsite_other.hs_allocs;
+}
+
+/*
+ * The value kheap_profile sorts by: live bytes, or if GROWTH, bytes
+ * gained since the last snapshot (as a signed number).
+ */
+static
+int32_t
+heapsite_key(struct heapsite *hs, bool growth)
+{
+	if (growth) {
+		return (int32_t)(hs->hs_bytes - hs->hs_snapbytes);
+	}
+	return hs->hs_bytes;
+}
+
+/*
+ * Print the NUM sites with the most bytes (or the most growth) in
+ * order. Picks each one by a pass over the table, since NUM is small
+ * and we have nowhere to sort into.
+ */
+static
+void
+heapsite_print(unsigned num, bool growth)
+{
+	struct heapsite *hs, *best, *prev;
+	unsigned i, j, totalbytes;
+	int32_t key, bestkey, prevkey;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	totalbytes = heapsite_other.hs_bytes;
+	for (i=0; i<numheapsites; i++) {
+		totalbytes += heapsites[i].hs_bytes;
+	}
+	kprintf("Heap profile (generation %u): %u bytes live at %u sites\n",
+		mallocgeneration, totalbytes, numheapsites);
+	if (heapobj_missed > 0) {
+		kprintf("(%u page and object cache allocations not counted)\n",
+			heapobj_missed);
+	}
+	kprintf("%-10s %9s %9s %9s %9s %9s\n", "site", "bytes", "peak",
+		"+/-gen", "allocs", "+gen");
+
+	/*
+	 * Each pass takes the best site ranked after the previous
+	 * one: lower key, or the same key at a later place in the
+	 * table.
+	 */
+	prev = NULL;
+	prevkey = 0;
+	for (i=0; i<num; i++) {
+		best = NULL;
+		bestkey = 0;
+		for (j=0; j<=numheapsites; j++) {
+			hs = j < numheapsites ? &heapsites[j] : &heapsite_other;
+			key = heapsite_key(hs, growth);
+			if (prev != NULL &&
+			    (key > prevkey || (key == prevkey && hs <= prev))) {
+				continue;
+			}
+			if (best == NULL || key > bestkey) {
+				best = hs;
+				bestkey = key;
+			}
+		}
+		if (best == NULL || (best->hs_bytes == 0 && !growth) ||
+		    (growth && bestkey <= 0)) {
+			break;
+		}
+		kprintf("%-10p %9u %9u %+9d %9u %9u\n",
+			(void *)best->hs_label, best->hs_bytes, best->hs_peak,
+			(int)(best->hs_bytes - best->hs_snapbytes),
+			best->hs_allocs,
+			best->hs_allocs - best->hs_snapallocs);
+		prev = best;
+		prevkey = bestkey;
+	}
+}
+
+#endif /* HEAPPROFILE */
+
 #else
 
 #define LABEL_OVERHEAD 0
@@ -703,6 +1207,9 @@ kheap_nextgeneration(void)
 #ifdef LABELS
 	spinlock_acquire(&kmalloc_spinlock);
 	mallocgeneration++;
+#ifdef HEAPPROFILE
+	heapsite_snapshot();
+#endif
 	spinlock_release(&kmalloc_spinlock);
 #endif
 }
@@ -737,6 +1244,56 @@ kheap_dumpall(void)
 #endif
 }
 
+/*
+ * Print the NUM allocation sites holding the most heap, or if GROWTH
+ * the ones that have grown most since the last kheap_nextgeneration.
+ */
+void
+kheap_profile(unsigned num, bool growth)
+{
+#ifdef HEAPPROFILE
+	/* print the whole thing with interrupts off */
+	spinlock_acquire(&kmalloc_spinlock);
+	heapsite_print(num, growth);
+	spinlock_release(&kmalloc_spinlock);
+#else
+	(void)num;
+	(void)growth;
+	kprintf("Enable HEAPPROFILE in kmalloc.c to use this functionality.\n");
+#endif
+}
+
+/*
+ * Charge SIZE bytes at PTR, which didn't come from the subpage heap,
+ * to the allocation site LABEL; and take the charge back when PTR is
+ * freed. For kmem_cache and whole-page kmallocs.
+ */
+void
+kheap_profile_alloc(void *ptr, size_t size, vaddr_t label)
+{
+#ifdef HEAPPROFILE
+	spinlock_acquire(&kmalloc_spinlock);
+	heapobj_add((vaddr_t)ptr, size, label);
+	spinlock_release(&kmalloc_spinlock);
+#else
+	(void)ptr;
+	(void)size;
+	(void)label;
+#endif
+}
+
+void
+kheap_profile_free(void *ptr)
+{
+#ifdef HEAPPROFILE
+	spinlock_acquire(&kmalloc_spinlock);
+	heapobj_remove((vaddr_t)ptr);
+	spinlock_release(&kmalloc_spinlock);
+#else
+	(void)ptr;
+#endif
+}
+
 ////////////////////////////////////////
 
 /*
@@ -765,7 +1322,7 @@ subpage_stats(struct pageref *pr)
 	KASSERT(blktype >= 0 && blktype < NSIZES);
 
 	/* compute how many bits we need in freemap and assert we fit */
-	n = PAGE_SIZE / sizes[blktype];
+	n = CHUNK_NBLOCKS(blktype);
 	KASSERT(n <= 32 * ARRAYCOUNT(freemap));
 
 	if (pr->freelist_offset != INVALID_OFFSET) {
@@ -795,29 +1352,70 @@ subpage_stats(struct pageref *pr)
 }
 
 /*
- * Print the whole heap.
+ * Print how full the pages of each block size are. Blocks sitting in
+ * magazines count as in use.
  */
+static
 void
-kheap_printstats(void)
+sizeclass_stats(void)
 {
 	struct pageref *pr;
+	unsigned npages, nblocks, nfree;
+	int i;
 
-	/* print the whole thing with interrupts off */
-	spinlock_acquire(&kmalloc_spinlock);
-
-	kprintf("Subpage allocator status:\n");
-
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		subpage_stats(pr);
-	}
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-	spinlock_release(&kmalloc_spinlock);
-}
+	kprintf("Size classes:\n");
+	for (i=0; i<NSIZES; i++) {
+		npages = nblocks = nfree = 0;
+		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
+			npages += chunkpages[i];
+			nblocks += CHUNK_NBLOCKS(i);
+			nfree += pr->nfree;
+		}
+		if (nblocks == 0) {
+			continue;
+		}
+		kprintf("   size %-5lu %4u pages, %5u/%-5u blocks in use "
+			"(%3u%%)%s\n", (unsigned long) sizes[i], npages,
+			nblocks - nfree, nblocks,
+			100 * (nblocks - nfree) / nblocks,
+			sparechunks[i] != NULL ? ", 1 spare chunk" : "");
+	}
+}
+
+/*
+ * Print the whole heap.
+ */
+void
+kheap_printstats(void)
+{
+	struct pageref *pr;
+	int i;
+
+	/* print the whole thing with interrupts off */
+	spinlock_acquire(&kmalloc_spinlock);
+
+	kprintf("Subpage allocator status:\n");
+
+	for (i=0; i<NSIZES; i++) {
+		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
+			subpage_stats(pr);
+		}
+	}
+	sizeclass_stats();
+
+	spinlock_release(&kmalloc_spinlock);
+
+#ifdef MAGAZINES
+	kmag_printstats();
+#endif
+}
 
 ////////////////////////////////////////
 
 /*
- * Remove a pageref from both lists that it's on.
+ * Remove a pageref from the list that it's on.
  */
 static
 void
@@ -834,14 +1432,6 @@ remove_lists(struct pageref *pr, int blktype)
 			break;
 		}
 	}
-
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_all;
-			break;
-		}
-	}
 }
 
 /*
@@ -867,49 +1457,20 @@ int blocktype(size_t clientsz)
 }
 
 /*
- * Allocate a block of size SZ, where SZ is not large enough to
- * warrant a whole-page allocation.
+ * Take a free block of type BLKTYPE from the first page of that size
+ * that has one. Returns NULL if none does.
  */
 static
 void *
-subpage_kmalloc(size_t sz
-#ifdef LABELS
-		, vaddr_t label
-#endif
-	)
+subpage_takeblock(unsigned blktype)
 {
-	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
-	struct freelist *volatile fl;	// free list entry
+	struct freelist *fl;	// free list entry
 	void *retptr;		// our result
 
-	volatile int i;
-
-#ifdef GUARDS
-	size_t clientsz;
-#endif
-
-#ifdef GUARDS
-	clientsz = sz;
-	sz += GUARD_OVERHEAD;
-#endif
-#ifdef LABELS
-#ifdef GUARDS
-	/* Include the label in what GUARDS considers the client data. */
-	clientsz += LABEL_PTROFFSET;
-#endif
-	sz += LABEL_PTROFFSET;
-#endif
-	blktype = blocktype(sz);
-#ifdef GUARDS
-	sz = sizes[blktype];
-#endif
-
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
 
@@ -918,10 +1479,7 @@ subpage_kmalloc(size_t sz
 		checksubpage(pr);
 
 		if (pr->nfree > 0) {
-
-		doalloc: /* comes here after getting a whole fresh page */
-
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
+			KASSERT(pr->freelist_offset < CHUNK_SIZE(blktype));
 			prpage = PR_PAGEADDR(pr);
 			fla = prpage + pr->freelist_offset;
 			fl = (struct freelist *)fla;
@@ -933,47 +1491,61 @@ subpage_kmalloc(size_t sz
 			if (fl != NULL) {
 				KASSERT(pr->nfree > 0);
 				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
+				KASSERT(fla - prpage < CHUNK_SIZE(blktype));
 				pr->freelist_offset = fla - prpage;
 			}
 			else {
 				KASSERT(pr->nfree == 0);
 				pr->freelist_offset = INVALID_OFFSET;
 			}
-#ifdef GUARDS
-			retptr = establishguardband(retptr, clientsz, sz);
-#endif
-#ifdef LABELS
-			retptr = establishlabel(retptr, label);
-#endif
-
-			checksubpages();
-
-			spinlock_release(&kmalloc_spinlock);
+			if (pr == sparechunks[blktype]) {
+				sparechunks[blktype] = NULL;
+			}
 			return retptr;
 		}
 	}
+	return NULL;
+}
 
-	/*
-	 * No page of the right size available.
-	 * Make a new one.
-	 *
-	 * We release the spinlock while calling alloc_kpages. This
-	 * avoids deadlock if alloc_kpages needs to come back here.
-	 * Note that this means things can change behind our back...
-	 */
+/*
+ * Add a fresh page (chunk) of blocks of type BLKTYPE to the heap. Called with
+ * kmalloc_spinlock held; returns with it held, but releases it while
+ * calling alloc_kpages. This avoids deadlock if alloc_kpages needs to
+ * come back here. Note that this means things can change behind our
+ * back...
+ *
+ * Returns false if out of memory.
+ */
+static
+bool
+subpage_newpage(unsigned blktype)
+{
+	struct pageref *pr;	// pageref for the new page
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *volatile fl;	// free list entry
+
+	volatile int i;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	spinlock_release(&kmalloc_spinlock);
-	prpage = alloc_kpages(1);
+	prpage = alloc_kpages(chunkpages[blktype]);
 	if (prpage==0) {
-		/* Out of memory. */
-		kprintf("kmalloc: Subpage allocator couldn't get a page\n");
-		return NULL;
+		/*
+		 * Out of memory. (Or out of contiguous memory; kmalloc
+		 * then tries whole pages, so don't complain yet.)
+		 */
+		if (chunkpages[blktype] == 1) {
+			kprintf("kmalloc: Subpage allocator couldn't get a page\n");
+		}
+		spinlock_acquire(&kmalloc_spinlock);
+		return false;
 	}
 	KASSERT(prpage % PAGE_SIZE == 0);
 #ifdef CHECKBEEF
 	/* deadbeef the whole page, as it probably starts zeroed */
-	fill_deadbeef((void *)prpage, PAGE_SIZE);
+	fill_deadbeef((void *)prpage, CHUNK_SIZE(blktype));
 #endif
 	spinlock_acquire(&kmalloc_spinlock);
 
@@ -983,11 +1555,12 @@ subpage_kmalloc(size_t sz
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
 		kprintf("kmalloc: Subpage allocator couldn't get pageref\n");
-		return NULL;
+		spinlock_acquire(&kmalloc_spinlock);
+		return false;
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
-	pr->nfree = PAGE_SIZE / sizes[blktype];
+	pr->nfree = CHUNK_NBLOCKS(blktype);
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -1010,11 +1583,221 @@ subpage_kmalloc(size_t sz
 	pr->next_samesize = sizebases[blktype];
 	sizebases[blktype] = pr;
 
-	pr->next_all = allbase;
-	allbase = pr;
+	setpagetypes(pr, true);
+
+	return true;
+}
+
+/*
+ * Allocate a block of size SZ, where SZ is not large enough to
+ * warrant a whole-page allocation.
+ */
+static
+void *
+subpage_kmalloc(size_t sz
+#ifdef LABELS
+		, vaddr_t label
+#endif
+	)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	void *retptr;		// our result
+
+#ifdef GUARDS
+	size_t clientsz;
+#endif
+
+#ifdef GUARDS
+	clientsz = sz;
+	sz += GUARD_OVERHEAD;
+#endif
+#ifdef LABELS
+#ifdef GUARDS
+	/* Include the label in what GUARDS considers the client data. */
+	clientsz += LABEL_PTROFFSET;
+#endif
+	sz += LABEL_PTROFFSET;
+#endif
+	blktype = blocktype(sz);
+#ifdef GUARDS
+	sz = sizes[blktype];
+#endif
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	/* If no page of the right size has a free block, make a new one. */
+	while ((retptr = subpage_takeblock(blktype)) == NULL) {
+		if (!subpage_newpage(blktype)) {
+			spinlock_release(&kmalloc_spinlock);
+			return NULL;
+		}
+	}
+
+#ifdef GUARDS
+	retptr = establishguardband(retptr, clientsz, sz);
+#endif
+#ifdef LABELS
+	retptr = establishlabel(retptr, label);
+#endif
+#ifdef HEAPPROFILE
+	heapsite_count(label, sizes[blktype], true);
+#endif
+
+	checksubpages();
+
+	spinlock_release(&kmalloc_spinlock);
+	return retptr;
+}
+
+/*
+ * Find the pageref of the heap page (chunk) that PTRADDR is on, or
+ * NULL if it is not on one.
+ */
+static
+struct pageref *
+subpage_findpage(vaddr_t ptraddr)
+{
+	struct pageref *pr;	// pageref for page we're freeing in
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	int blktype;		// from pagetypes[]
+	uint32_t pt;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	blktype = subpage_lookup(ptraddr, &prpage);
+	if (blktype < 0) {
+		return NULL;
+	}
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	pt = pagetypes[KVADDR_TO_PADDR(prpage) / PAGE_SIZE];
+	pr = pagerefbynum(PT_PAGEREF(pt));
+
+	/* check for corruption */
+	KASSERT(PR_BLOCKTYPE(pr) < NSIZES);
+	checksubpage(pr);
+	if (PR_PAGEADDR(pr) != prpage || (int)PR_BLOCKTYPE(pr) != blktype) {
+		panic("kmalloc: wrong pageref for heap page 0x%lx\n",
+		      (unsigned long)prpage);
+	}
+	return pr;
+}
+
+/*
+ * Take the free page (chunk) PR out of the heap and return its
+ * address, for the caller to free_kpages once it has released
+ * kmalloc_spinlock.
+ */
+static
+vaddr_t
+subpage_droppage(struct pageref *pr)
+{
+	vaddr_t prpage;
+	int blktype;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(pr->nfree == CHUNK_NBLOCKS(blktype));
+
+	if (sparechunks[blktype] == pr) {
+		sparechunks[blktype] = NULL;
+	}
+	remove_lists(pr, blktype);
+	setpagetypes(pr, false);
+	freepageref(pr);
+	return prpage;
+}
+
+/*
+ * Put the block at OFFSET back on the free list of page PR. If that
+ * makes the whole page free and it isn't kept as a spare chunk, take
+ * it out of the heap and return its address, as subpage_droppage
+ * does; otherwise return 0.
+ */
+static
+vaddr_t
+subpage_putblock(struct pageref *pr, vaddr_t offset)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
+
+	fla = prpage + offset;
+	fl = (struct freelist *)fla;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+
+		/* this block should not already be on the free list! */
+#ifdef SLOW
+		{
+			struct freelist *fl2;
+
+			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
+				KASSERT(fl2 != fl);
+			}
+		}
+#else
+		/* check just the head */
+		KASSERT(fl != fl->next);
+#endif
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= CHUNK_NBLOCKS(blktype));
+	if (pr->nfree == CHUNK_NBLOCKS(blktype)) {
+		/* Whole page is free. */
+		if (chunkpages[blktype] > 1 && sparechunks[blktype] == NULL) {
+			/* Keep it for next time. */
+			sparechunks[blktype] = pr;
+			return 0;
+		}
+		return subpage_droppage(pr);
+	}
+	return 0;
+}
+
+/*
+ * Give back the spare chunks. Returns the number of pages freed.
+ */
+static
+unsigned
+kheap_dropspares(void)
+{
+	vaddr_t prpage;
+	unsigned blktype, freed;
+
+	freed = 0;
+	for (blktype=0; blktype<NSIZES; blktype++) {
+		spinlock_acquire(&kmalloc_spinlock);
+		prpage = 0;
+		if (sparechunks[blktype] != NULL) {
+			prpage = subpage_droppage(sparechunks[blktype]);
+		}
+		spinlock_release(&kmalloc_spinlock);
+
+		if (prpage != 0) {
+			free_kpages(prpage);
+			freed += chunkpages[blktype];
+		}
+	}
+	return freed;
 }
 
 /*
@@ -1029,9 +1812,8 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
+	vaddr_t freepage;	// page to give back, or 0
 #ifdef GUARDS
 	size_t blocksize, smallerblocksize;
 #endif
@@ -1065,34 +1847,19 @@ subpage_kfree(void *ptr)
 
 	checksubpages();
 
-	/* Silence warnings with gcc 4.8 -Og (but not -O2) */
-	prpage = 0;
-	blktype = 0;
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = subpage_findpage(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
 		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
+	if (offset >= CHUNK_SIZE(blktype) || offset % sizes[blktype] != 0) {
 		panic("kfree: subpage free of invalid addr %p\n", ptr);
 	}
 
@@ -1101,6 +1868,11 @@ subpage_kfree(void *ptr)
 	smallerblocksize = blktype > 0 ? sizes[blktype - 1] : 0;
 	checkguardband(ptraddr, smallerblocksize, blocksize);
 #endif
+#ifdef HEAPPROFILE
+	/* The label is just before the client's pointer. */
+	heapsite_count(((struct malloclabel *)ptr)[-1].label,
+		       sizes[blktype], false);
+#endif
 
 	/*
 	 * Clear the block to 0xdeadbeef to make it easier to detect
@@ -1108,57 +1880,331 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef((void *)ptraddr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
+	freepage = subpage_putblock(pr, offset);
 
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	/* Call free_kpages without kmalloc_spinlock. */
+	spinlock_release(&kmalloc_spinlock);
+	if (freepage != 0) {
+		free_kpages(freepage);
+	}
 
-		/* this block should not already be on the free list! */
-#ifdef SLOW
-		{
-			struct freelist *fl2;
+#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+#endif
 
-			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
-				KASSERT(fl2 != fl);
+	return 0;
+}
+
+////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+//    Each cpu keeps a magazine of free blocks of each size in front
+//    of the subpage allocator, so most kmallocs and kfrees only take
+//    that cpu's magazine lock. An empty magazine is refilled, and a
+//    full one flushed, half a magazine at a time with one acquisition
+//    of kmalloc_spinlock. Magazines of bigger blocks are smaller, so
+//    a cpu never sits on more than KMAG_BYTES of any one size.
+//
+//    Blocks in a magazine are allocated as far as the subpage
+//    allocator is concerned, so they keep their pages in the heap;
+//    kheap_reclaim empties the magazines first. A magazine lock is
+//    never held while taking any other lock.
+//
+
+#ifdef MAGAZINES
+
+#define KMAG_MAX 32
+#define KMAG_BYTES 8192
+#define KMAG_SIZE(blktype) \
+	(KMAG_BYTES / sizes[blktype] < KMAG_MAX ? \
+	 KMAG_BYTES / sizes[blktype] : KMAG_MAX)
+#define KMAG_BATCH(blktype) (KMAG_SIZE(blktype) / 2)
+
+/* Bigger blocks than this (4K) don't have magazines. */
+#define KMAG_NSIZES 10
+
+struct kmalloc_magazine {
+	struct spinlock lock;
+	unsigned count[KMAG_NSIZES];	/* blocks in each magazine */
+	void *blocks[KMAG_NSIZES][KMAG_MAX];
+	unsigned alloc_hits, alloc_misses;
+	unsigned free_hits, free_misses;
+};
+
+static struct kmalloc_magazine kmags[MAXCPUS] = {
+	[0 ... MAXCPUS-1] = { .lock = SPINLOCK_INITIALIZER },
+};
+
+/*
+ * Lock and return this cpu's magazines, or NULL early in boot before
+ * there is a curcpu. The magazine lock keeps us on this cpu.
+ */
+static
+struct kmalloc_magazine *
+kmag_get(void)
+{
+	struct kmalloc_magazine *mag;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+
+	spl = splhigh();
+	mag = &kmags[curcpu->c_number];
+	spinlock_acquire(&mag->lock);
+	splx(spl);
+
+	return mag;
+}
+
+/*
+ * Get up to N blocks of type BLKTYPE from the subpage allocator, with
+ * one acquisition of kmalloc_spinlock. A page is only added if there
+ * are no free blocks at all. Returns the number of blocks.
+ */
+static
+unsigned
+subpage_getblocks(unsigned blktype, void **blocks, unsigned n)
+{
+	unsigned i;
+	void *block;
+
+	i = 0;
+	spinlock_acquire(&kmalloc_spinlock);
+	while (i < n) {
+		block = subpage_takeblock(blktype);
+		if (block == NULL) {
+			if (i > 0 || !subpage_newpage(blktype)) {
+				break;
 			}
+			continue;
 		}
-#else
-		/* check just the head */
-		KASSERT(fl != fl->next);
-#endif
+		blocks[i++] = block;
 	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
+	spinlock_release(&kmalloc_spinlock);
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
-	}
+	return i;
+}
 
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
+/*
+ * Give N (already deadbeefed) blocks back to the subpage allocator,
+ * with one acquisition of kmalloc_spinlock. Returns the number of
+ * pages that became free.
+ */
+static
+unsigned
+subpage_putblocks(void **blocks, unsigned n)
+{
+	vaddr_t freepages[KMAG_MAX];
+	struct pageref *pr;
+	vaddr_t ptraddr, freepage;
+	unsigned i, nfreepages;
+
+	KASSERT(n <= KMAG_MAX);
+
+	nfreepages = 0;
 	spinlock_acquire(&kmalloc_spinlock);
-	checksubpages();
+	for (i=0; i<n; i++) {
+		ptraddr = (vaddr_t)blocks[i];
+		pr = subpage_findpage(ptraddr);
+		KASSERT(pr != NULL);
+		freepage = subpage_putblock(pr, ptraddr - PR_PAGEADDR(pr));
+		if (freepage != 0) {
+			freepages[nfreepages++] = freepage;
+		}
+	}
 	spinlock_release(&kmalloc_spinlock);
-#endif
 
-	return 0;
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
+	return nfreepages;
+}
+
+/*
+ * Put N free blocks of type BLKTYPE in this cpu's magazine, and any
+ * that don't fit back in the subpage allocator.
+ */
+static
+void
+kmag_stash(unsigned blktype, void **blocks, unsigned n)
+{
+	struct kmalloc_magazine *mag;
+	unsigned i;
+
+	i = 0;
+	mag = kmag_get();
+	if (mag != NULL) {
+		while (i < n && mag->count[blktype] < KMAG_SIZE(blktype)) {
+			mag->blocks[blktype][mag->count[blktype]++] =
+				blocks[i++];
+		}
+		spinlock_release(&mag->lock);
+	}
+	if (i < n) {
+		subpage_putblocks(blocks + i, n - i);
+	}
+}
+
+/*
+ * kmalloc of a subpage block through the magazines.
+ */
+static
+void *
+kmag_kmalloc(size_t sz)
+{
+	struct kmalloc_magazine *mag;
+	void *blocks[KMAG_MAX];
+	unsigned blktype, n;
+	void *retptr;
+
+	blktype = blocktype(sz);
+	if (blktype >= KMAG_NSIZES) {
+		return subpage_kmalloc(sz);
+	}
+
+	mag = kmag_get();
+	if (mag == NULL) {
+		return subpage_kmalloc(sz);
+	}
+	if (mag->count[blktype] > 0) {
+		mag->alloc_hits++;
+		retptr = mag->blocks[blktype][--mag->count[blktype]];
+		spinlock_release(&mag->lock);
+		return retptr;
+	}
+	mag->alloc_misses++;
+	spinlock_release(&mag->lock);
+
+	n = subpage_getblocks(blktype, blocks, KMAG_BATCH(blktype));
+	if (n == 0) {
+		return NULL;
+	}
+	retptr = blocks[--n];
+	if (n > 0) {
+		kmag_stash(blktype, blocks, n);
+	}
+	return retptr;
 }
 
+/*
+ * kfree of a block on a heap page (chunk) at PRPAGE of type BLKTYPE
+ * through the magazines.
+ */
+static
+void
+kmag_kfree(void *ptr, unsigned blktype, vaddr_t prpage)
+{
+	struct kmalloc_magazine *mag;
+	void *blocks[KMAG_MAX];
+	unsigned n, top;
+
+	/* Check for proper positioning and alignment */
+	if (((vaddr_t)ptr - prpage) % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+	mag = blktype < KMAG_NSIZES ? kmag_get() : NULL;
+	if (mag == NULL) {
+		(void)subpage_kfree(ptr);
+		return;
+	}
+
+	/*
+	 * Clear the block to 0xdeadbeef to make it easier to detect
+	 * uses of dangling pointers.
+	 */
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	top = mag->count[blktype];
+	/* this block should not have just been freed! */
+	KASSERT(top == 0 || mag->blocks[blktype][top - 1] != ptr);
+
+	if (top < KMAG_SIZE(blktype)) {
+		mag->free_hits++;
+		mag->blocks[blktype][mag->count[blktype]++] = ptr;
+		spinlock_release(&mag->lock);
+		return;
+	}
+
+	/* Full: flush the older half, keeping the blocks most recently used. */
+	mag->free_misses++;
+	n = KMAG_BATCH(blktype);
+	memcpy(blocks, mag->blocks[blktype], n * sizeof(void *));
+	memmove(mag->blocks[blktype], mag->blocks[blktype] + n,
+		(top - n) * sizeof(void *));
+	mag->count[blktype] = top - n;
+	mag->blocks[blktype][mag->count[blktype]++] = ptr;
+	spinlock_release(&mag->lock);
+
+	subpage_putblocks(blocks, n);
+}
+
+/*
+ * Empty every magazine back into the subpage allocator. Returns the
+ * number of pages that became free.
+ */
+static
+unsigned
+kmag_drain_all(void)
+{
+	void *blocks[KMAG_MAX];
+	unsigned i, blktype, n, freed;
+
+	freed = 0;
+	for (i=0; i<MAXCPUS; i++) {
+		for (blktype=0; blktype<KMAG_NSIZES; blktype++) {
+			spinlock_acquire(&kmags[i].lock);
+			n = kmags[i].count[blktype];
+			memcpy(blocks, kmags[i].blocks[blktype],
+			       n * sizeof(void *));
+			kmags[i].count[blktype] = 0;
+			spinlock_release(&kmags[i].lock);
+
+			if (n > 0) {
+				freed += subpage_putblocks(blocks, n);
+			}
+		}
+	}
+	return freed;
+}
+
+/*
+ * Print the hit and miss counts of each cpu that has used its
+ * magazines. Only a snapshot.
+ */
+static
+void
+kmag_printstats(void)
+{
+	struct kmalloc_magazine *mag;
+	unsigned i, blktype, cached;
+
+	kprintf("kmalloc magazines:\n");
+	for (i=0; i<MAXCPUS; i++) {
+		mag = &kmags[i];
+		spinlock_acquire(&mag->lock);
+		cached = 0;
+		for (blktype=0; blktype<KMAG_NSIZES; blktype++) {
+			cached += mag->count[blktype] * sizes[blktype];
+		}
+		if (mag->alloc_hits + mag->alloc_misses +
+		    mag->free_hits + mag->free_misses > 0) {
+			kprintf("   cpu %u: kmalloc %u hits %u misses, "
+				"kfree %u hits %u misses, %u bytes cached\n",
+				i, mag->alloc_hits, mag->alloc_misses,
+				mag->free_hits, mag->free_misses, cached);
+		}
+		spinlock_release(&mag->lock);
+	}
+}
+
+#endif /* MAGAZINES */
+
 //
 ////////////////////////////////////////////////////////////
 
@@ -1170,6 +2216,8 @@ void *
 kmalloc(size_t sz)
 {
 	size_t checksz;
+	unsigned long npages;
+	vaddr_t address;
 #ifdef LABELS
 	vaddr_t label;
 #endif
@@ -1183,26 +2231,37 @@ kmalloc(size_t sz)
 #endif /* LABELS */
 
 	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD;
-	if (checksz >= LARGEST_SUBPAGE_SIZE) {
-		unsigned long npages;
-		vaddr_t address;
-
-		/* Round up to a whole number of pages. */
-		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
-		address = alloc_kpages(npages);
-		if (address==0) {
-			return NULL;
-		}
-		KASSERT(address % PAGE_SIZE == 0);
+	if (checksz <= LARGEST_BLOCK_SIZE) {
+		void *ptr;
 
-		return (void *)address;
+#if defined(LABELS)
+		ptr = subpage_kmalloc(sz, label);
+#elif defined(MAGAZINES)
+		ptr = kmag_kmalloc(sz);
+#else
+		ptr = subpage_kmalloc(sz);
+#endif
+		if (ptr != NULL || checksz <= PAGE_SIZE) {
+			return ptr;
+		}
+		/*
+		 * No chunk of several pages to be had; the block
+		 * may still fit in fewer whole pages.
+		 */
 	}
 
-#ifdef LABELS
-	return subpage_kmalloc(sz, label);
-#else
-	return subpage_kmalloc(sz);
+	/* Round up to a whole number of pages. */
+	npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
+	address = alloc_kpages(npages);
+	if (address==0) {
+		return NULL;
+	}
+	KASSERT(address % PAGE_SIZE == 0);
+#ifdef HEAPPROFILE
+	kheap_profile_alloc((void *)address, npages * PAGE_SIZE, label);
 #endif
+
+	return (void *)address;
 }
 
 /*
@@ -1211,6 +2270,25 @@ kmalloc(size_t sz)
 void
 kfree(void *ptr)
 {
+#ifdef MAGAZINES
+	vaddr_t prpage;
+	int blktype;
+
+	/*
+	 * The page says whether this is a heap block; if not, it's a
+	 * big allocation.
+	 */
+	if (ptr == NULL) {
+		return;
+	}
+	blktype = subpage_lookup((vaddr_t)ptr, &prpage);
+	if (blktype >= 0) {
+		kmag_kfree(ptr, blktype, prpage);
+	} else {
+		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
+		free_kpages((vaddr_t)ptr);
+	}
+#else
 	/*
 	 * Try subpage first; if that fails, assume it's a big allocation.
 	 */
@@ -1218,7 +2296,11 @@ kfree(void *ptr)
 		return;
 	} else if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
+#ifdef HEAPPROFILE
+		kheap_profile_free(ptr);
+#endif
 		free_kpages((vaddr_t)ptr);
 	}
+#endif
 }
 
@@ -0,0 +1,579 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <vm.h>
+#include <kmem.h>
+
+/*
+ * Object caches. See kmem.h.
+ *
+ * A slab is one page: a struct kmem_slab, the stack of indices of its
+ * free objects, then the objects. The free objects are constructed,
+ * so nothing is linked through them; the slab of an object is found
+ * by masking its address. Every slab is on one of three lists of its
+ * cache by how many objects it has free, and allocation prefers
+ * partly used slabs so that empty ones are left for reclaim.
+ */
+
+#define KMEM_ALIGN 8
+
+// Free objects a cache of whole-page objects keeps constructed
+#define KMEM_MAXSPARE 16
+
+// Slabs or spare objects kmem_reclaim takes off the caches at a time
+#define KMEM_REAP_BATCH 16
+
+struct kmem_slab
+{
+    struct kmem_cache *ks_cache;
+    struct kmem_slab *ks_prev;
+    struct kmem_slab *ks_next;
+    unsigned ks_nfree;
+    uint16_t ks_free[]; // indices of the free objects
+};
+
+struct kmem_cache
+{
+    const char *kc_name;
+    size_t kc_size;    // rounded up to KMEM_ALIGN
+    int (*kc_ctor)(void *obj);
+    void (*kc_dtor)(void *obj);
+    unsigned kc_perslab; // objects per slab; 0 for whole-page objects
+    size_t kc_offset;    // of the first object in a slab
+    unsigned kc_npages;  // per object, if kc_perslab is 0
+    struct kmem_cache *kc_next; // protected by kmem_spinlock
+
+    struct spinlock kc_lock; // protects everything below
+    struct kmem_slab *kc_full;
+    struct kmem_slab *kc_partial;
+    struct kmem_slab *kc_empty;
+    void *kc_spare[KMEM_MAXSPARE]; // whole-page objects
+    unsigned kc_nspare;
+
+    unsigned kc_inuse;  // objects allocated
+    unsigned kc_total;  // objects constructed, allocated or not
+    unsigned kc_pages;  // pages held
+    unsigned kc_allocs;
+    unsigned kc_constructed;
+    unsigned kc_reaped; // objects destroyed to give memory back
+    unsigned kc_reaping; // slabs and objects taken off but not yet freed
+};
+
+// A slab or spare object taken off its cache to be destroyed
+struct kmem_reap
+{
+    struct kmem_cache *kr_cache;
+    struct kmem_slab *kr_slab;
+    void *kr_obj;
+};
+
+// All caches, newest first
+static struct kmem_cache *kmem_caches;
+static struct spinlock kmem_spinlock = SPINLOCK_INITIALIZER;
+
+static size_t kmem_offset(unsigned perslab)
+{
+    return ROUNDUP(sizeof(struct kmem_slab) + perslab * sizeof(uint16_t), KMEM_ALIGN);
+}
+
+static void *kmem_slab_obj(struct kmem_cache *kc, struct kmem_slab *slab, unsigned i)
+{
+    return (void *)((vaddr_t)slab + kc->kc_offset + i * kc->kc_size);
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+                                     int (*ctor)(void *obj),
+                                     void (*dtor)(void *obj))
+{
+    struct kmem_cache *kc;
+    unsigned perslab;
+
+    KASSERT(size > 0);
+
+    kc = kmalloc(sizeof(*kc));
+    if (kc == NULL)
+    {
+        return NULL;
+    }
+
+    kc->kc_name = name;
+    kc->kc_size = ROUNDUP(size, KMEM_ALIGN);
+    kc->kc_ctor = ctor;
+    kc->kc_dtor = dtor;
+
+    perslab = (PAGE_SIZE - sizeof(struct kmem_slab)) / (kc->kc_size + sizeof(uint16_t));
+    while (perslab > 0 && kmem_offset(perslab) + perslab * kc->kc_size > PAGE_SIZE)
+    {
+        perslab--;
+    }
+    kc->kc_perslab = perslab;
+    kc->kc_offset = kmem_offset(perslab);
+    kc->kc_npages = perslab > 0 ? 1 : DIVROUNDUP(kc->kc_size, PAGE_SIZE);
+
+    spinlock_init(&kc->kc_lock);
+    kc->kc_full = NULL;
+    kc->kc_partial = NULL;
+    kc->kc_empty = NULL;
+    kc->kc_nspare = 0;
+    kc->kc_inuse = 0;
+    kc->kc_total = 0;
+    kc->kc_pages = 0;
+    kc->kc_allocs = 0;
+    kc->kc_constructed = 0;
+    kc->kc_reaped = 0;
+    kc->kc_reaping = 0;
+
+    spinlock_acquire(&kmem_spinlock);
+    kc->kc_next = kmem_caches;
+    kmem_caches = kc;
+    spinlock_release(&kmem_spinlock);
+
+    return kc;
+}
+
+////////////////////////////////////////////////////////////
+// Slabs
+
+/*
+ * The list a slab with NFREE free objects belongs on.
+ */
+static struct kmem_slab **kmem_slablist(struct kmem_cache *kc, unsigned nfree)
+{
+    if (nfree == 0)
+    {
+        return &kc->kc_full;
+    }
+    if (nfree == kc->kc_perslab)
+    {
+        return &kc->kc_empty;
+    }
+    return &kc->kc_partial;
+}
+
+static void kmem_slab_link(struct kmem_slab **list, struct kmem_slab *slab)
+{
+    slab->ks_prev = NULL;
+    slab->ks_next = *list;
+    if (*list != NULL)
+    {
+        (*list)->ks_prev = slab;
+    }
+    *list = slab;
+}
+
+static void kmem_slab_unlink(struct kmem_slab **list, struct kmem_slab *slab)
+{
+    if (slab->ks_prev != NULL)
+    {
+        slab->ks_prev->ks_next = slab->ks_next;
+    }
+    else
+    {
+        KASSERT(*list == slab);
+        *list = slab->ks_next;
+    }
+    if (slab->ks_next != NULL)
+    {
+        slab->ks_next->ks_prev = slab->ks_prev;
+    }
+    slab->ks_prev = slab->ks_next = NULL;
+}
+
+/*
+ * Destroy the first N objects of a slab and free its page.
+ */
+static void kmem_slab_destroy(struct kmem_cache *kc, struct kmem_slab *slab, unsigned n)
+{
+    if (kc->kc_dtor != NULL)
+    {
+        for (unsigned i = 0; i < n; i++)
+        {
+            kc->kc_dtor(kmem_slab_obj(kc, slab, i));
+        }
+    }
+    free_kpages((vaddr_t)slab);
+}
+
+/*
+ * Get a page and construct a slab of objects in it. Called without
+ * the cache lock, as the constructor may allocate.
+ */
+static struct kmem_slab *kmem_slab_create(struct kmem_cache *kc)
+{
+    struct kmem_slab *slab;
+    unsigned i;
+
+    vaddr_t page = alloc_kpages(1);
+    if (page == 0)
+    {
+        return NULL;
+    }
+
+    slab = (struct kmem_slab *)page;
+    slab->ks_cache = kc;
+    slab->ks_prev = slab->ks_next = NULL;
+
+    for (i = 0; i < kc->kc_perslab; i++)
+    {
+        if (kc->kc_ctor != NULL && kc->kc_ctor(kmem_slab_obj(kc, slab, i)) != 0)
+        {
+            kmem_slab_destroy(kc, slab, i);
+            return NULL;
+        }
+        // Lowest index on top, so objects go out in address order
+        slab->ks_free[kc->kc_perslab - 1 - i] = i;
+    }
+    slab->ks_nfree = kc->kc_perslab;
+
+    return slab;
+}
+
+/*
+ * Take a free object from a slab, moving it to the right list.
+ */
+static void *kmem_slab_take(struct kmem_cache *kc, struct kmem_slab *slab)
+{
+    struct kmem_slab **from, **to;
+    unsigned i;
+
+    KASSERT(slab->ks_nfree > 0);
+
+    from = kmem_slablist(kc, slab->ks_nfree);
+    i = slab->ks_free[--slab->ks_nfree];
+    to = kmem_slablist(kc, slab->ks_nfree);
+    if (to != from)
+    {
+        kmem_slab_unlink(from, slab);
+        kmem_slab_link(to, slab);
+    }
+
+    return kmem_slab_obj(kc, slab, i);
+}
+
+////////////////////////////////////////////////////////////
+// Allocation
+
+/*
+ * Allocate a whole-page object, reusing a spare one if possible.
+ */
+static void *kmem_page_alloc(struct kmem_cache *kc)
+{
+    void *obj = NULL;
+
+    spinlock_acquire(&kc->kc_lock);
+    if (kc->kc_nspare > 0)
+    {
+        obj = kc->kc_spare[--kc->kc_nspare];
+        kc->kc_allocs++;
+        kc->kc_inuse++;
+    }
+    spinlock_release(&kc->kc_lock);
+
+    if (obj != NULL)
+    {
+        return obj;
+    }
+
+    vaddr_t addr = alloc_kpages(kc->kc_npages);
+    if (addr == 0)
+    {
+        return NULL;
+    }
+    obj = (void *)addr;
+    if (kc->kc_ctor != NULL && kc->kc_ctor(obj) != 0)
+    {
+        free_kpages(addr);
+        return NULL;
+    }
+
+    spinlock_acquire(&kc->kc_lock);
+    kc->kc_allocs++;
+    kc->kc_constructed++;
+    kc->kc_inuse++;
+    kc->kc_total++;
+    kc->kc_pages += kc->kc_npages;
+    spinlock_release(&kc->kc_lock);
+
+    return obj;
+}
+
+/*
+ * Allocate an object from a slab, adding a slab if none has one free.
+ */
+static void *kmem_slab_alloc(struct kmem_cache *kc)
+{
+    struct kmem_slab *slab, *fresh;
+    void *obj;
+
+    spinlock_acquire(&kc->kc_lock);
+    while (kc->kc_partial == NULL && kc->kc_empty == NULL)
+    {
+        spinlock_release(&kc->kc_lock);
+        fresh = kmem_slab_create(kc);
+        if (fresh == NULL)
+        {
+            return NULL;
+        }
+        spinlock_acquire(&kc->kc_lock);
+        kmem_slab_link(&kc->kc_empty, fresh);
+        kc->kc_total += kc->kc_perslab;
+        kc->kc_constructed += kc->kc_perslab;
+        kc->kc_pages++;
+    }
+
+    slab = kc->kc_partial != NULL ? kc->kc_partial : kc->kc_empty;
+    obj = kmem_slab_take(kc, slab);
+    kc->kc_allocs++;
+    kc->kc_inuse++;
+    spinlock_release(&kc->kc_lock);
+
+    return obj;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *kc)
+{
+    void *obj = kc->kc_perslab == 0 ? kmem_page_alloc(kc) : kmem_slab_alloc(kc);
+
+    // Charge the object to our caller in the heap profile, if any
+    if (obj != NULL)
+    {
+        kheap_profile_alloc(obj, kc->kc_perslab == 0 ? kc->kc_npages * PAGE_SIZE : kc->kc_size,
+                            (vaddr_t)__builtin_return_address(0));
+    }
+    return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+    struct kmem_slab *slab, **from, **to;
+    unsigned i;
+
+    KASSERT(obj != NULL);
+    kheap_profile_free(obj);
+
+    if (kc->kc_perslab == 0)
+    {
+        KASSERT(((vaddr_t)obj & ~PAGE_FRAME) == 0);
+
+        spinlock_acquire(&kc->kc_lock);
+        KASSERT(kc->kc_inuse > 0);
+        kc->kc_inuse--;
+        if (kc->kc_nspare < KMEM_MAXSPARE)
+        {
+            kc->kc_spare[kc->kc_nspare++] = obj;
+            obj = NULL;
+        }
+        else
+        {
+            kc->kc_total--;
+            kc->kc_pages -= kc->kc_npages;
+        }
+        spinlock_release(&kc->kc_lock);
+
+        if (obj != NULL)
+        {
+            if (kc->kc_dtor != NULL)
+            {
+                kc->kc_dtor(obj);
+            }
+            free_kpages((vaddr_t)obj);
+        }
+        return;
+    }
+
+    slab = (struct kmem_slab *)((vaddr_t)obj & PAGE_FRAME);
+    KASSERT(slab->ks_cache == kc);
+    i = ((vaddr_t)obj - (vaddr_t)slab - kc->kc_offset) / kc->kc_size;
+    KASSERT(i < kc->kc_perslab);
+    KASSERT(obj == kmem_slab_obj(kc, slab, i));
+
+    spinlock_acquire(&kc->kc_lock);
+    KASSERT(slab->ks_nfree < kc->kc_perslab);
+    from = kmem_slablist(kc, slab->ks_nfree);
+    slab->ks_free[slab->ks_nfree++] = i;
+    to = kmem_slablist(kc, slab->ks_nfree);
+    if (to != from)
+    {
+        kmem_slab_unlink(from, slab);
+        kmem_slab_link(to, slab);
+    }
+    kc->kc_inuse--;
+    spinlock_release(&kc->kc_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Giving memory back
+
+/*
+ * Take one empty slab or spare object off a cache, to be destroyed by
+ * kmem_reap_free without the cache locked. Returns false if the cache
+ * has none.
+ */
+static bool kmem_cache_detach(struct kmem_cache *kc, struct kmem_reap *kr)
+{
+    kr->kr_cache = kc;
+    kr->kr_slab = NULL;
+    kr->kr_obj = NULL;
+
+    spinlock_acquire(&kc->kc_lock);
+    if (kc->kc_empty != NULL)
+    {
+        kr->kr_slab = kc->kc_empty;
+        kmem_slab_unlink(&kc->kc_empty, kr->kr_slab);
+        kc->kc_total -= kc->kc_perslab;
+        kc->kc_reaped += kc->kc_perslab;
+        kc->kc_pages--;
+    }
+    else if (kc->kc_nspare > 0)
+    {
+        kr->kr_obj = kc->kc_spare[--kc->kc_nspare];
+        kc->kc_total--;
+        kc->kc_reaped++;
+        kc->kc_pages -= kc->kc_npages;
+    }
+    else
+    {
+        spinlock_release(&kc->kc_lock);
+        return false;
+    }
+    kc->kc_reaping++;
+    spinlock_release(&kc->kc_lock);
+
+    return true;
+}
+
+/*
+ * Destroy what kmem_cache_detach took off. Returns the number of
+ * pages freed.
+ */
+static unsigned kmem_reap_free(struct kmem_reap *kr)
+{
+    struct kmem_cache *kc = kr->kr_cache;
+    unsigned freed;
+
+    if (kr->kr_slab != NULL)
+    {
+        kmem_slab_destroy(kc, kr->kr_slab, kc->kc_perslab);
+        freed = 1;
+    }
+    else
+    {
+        if (kc->kc_dtor != NULL)
+        {
+            kc->kc_dtor(kr->kr_obj);
+        }
+        free_kpages((vaddr_t)kr->kr_obj);
+        freed = kc->kc_npages;
+    }
+
+    // kmem_cache_destroy may be waiting for this
+    spinlock_acquire(&kc->kc_lock);
+    kc->kc_reaping--;
+    spinlock_release(&kc->kc_lock);
+
+    return freed;
+}
+
+/*
+ * Shrinker: destroy unused objects. The slabs and objects are taken
+ * off their caches in batches under the cache list lock, and only
+ * destroyed once it is released, since destructors take locks of
+ * their own and free_kpages takes the frame table's. Destructors
+ * don't sleep, so neither does this.
+ */
+unsigned kmem_reclaim(unsigned npages)
+{
+    struct kmem_reap reap[KMEM_REAP_BATCH];
+    struct kmem_cache *kc;
+    unsigned freed = 0, taken, n, i;
+
+    while (freed < npages)
+    {
+        n = 0;
+        taken = 0;
+        spinlock_acquire(&kmem_spinlock);
+        kc = kmem_caches;
+        while (kc != NULL && n < KMEM_REAP_BATCH && freed + taken < npages)
+        {
+            if (!kmem_cache_detach(kc, &reap[n]))
+            {
+                kc = kc->kc_next;
+                continue;
+            }
+            taken += reap[n].kr_slab != NULL ? 1 : kc->kc_npages;
+            n++;
+        }
+        spinlock_release(&kmem_spinlock);
+
+        if (n == 0)
+        {
+            break;
+        }
+        for (i = 0; i < n; i++)
+        {
+            freed += kmem_reap_free(&reap[i]);
+        }
+    }
+
+    return freed;
+}
+
+void kmem_cache_destroy(struct kmem_cache *kc)
+{
+    struct kmem_cache **p;
+
+    spinlock_acquire(&kmem_spinlock);
+    for (p = &kmem_caches; *p != kc; p = &(*p)->kc_next)
+    {
+        KASSERT(*p != NULL);
+    }
+    *p = kc->kc_next;
+    spinlock_release(&kmem_spinlock);
+
+    KASSERT(kc->kc_inuse == 0);
+    KASSERT(kc->kc_full == NULL && kc->kc_partial == NULL);
+
+    struct kmem_reap kr;
+    while (kmem_cache_detach(kc, &kr))
+    {
+        kmem_reap_free(&kr);
+    }
+    KASSERT(kc->kc_total == 0);
+
+    // Let a kmem_reclaim that got here first finish with the cache
+    spinlock_acquire(&kc->kc_lock);
+    while (kc->kc_reaping > 0)
+    {
+        spinlock_release(&kc->kc_lock);
+        thread_yield();
+        spinlock_acquire(&kc->kc_lock);
+    }
+    spinlock_release(&kc->kc_lock);
+
+    spinlock_cleanup(&kc->kc_lock);
+    kfree(kc);
+}
+
+void kmem_printstats(void)
+{
+    spinlock_acquire(&kmem_spinlock);
+    kprintf("Object caches:\n");
+    for (struct kmem_cache *kc = kmem_caches; kc != NULL; kc = kc->kc_next)
+    {
+        spinlock_acquire(&kc->kc_lock);
+        unsigned inuse = kc->kc_inuse;
+        unsigned total = kc->kc_total;
+        unsigned pages = kc->kc_pages;
+        unsigned allocs = kc->kc_allocs;
+        unsigned constructed = kc->kc_constructed;
+        unsigned reaped = kc->kc_reaped;
+        spinlock_release(&kc->kc_lock);
+
+        kprintf("  %-12s %5u bytes: %u/%u objects in use, %u pages; "
+                "%u allocs, %u constructed, %u reclaimed\n",
+                kc->kc_name, (unsigned)kc->kc_size, inuse, total, pages,
+                allocs, constructed, reaped);
+    }
+    spinlock_release(&kmem_spinlock);
+}
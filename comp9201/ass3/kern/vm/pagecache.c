@@ -0,0 +1,203 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vnode.h>
+#include <vm.h>
+#include <pagecache.h>
+
+#define PAGECACHE_BUCKETS 64
+
+struct pagecache_entry
+{
+    struct vnode *pe_vnode; // executable the page comes from
+    off_t pe_offset;        // file offset of the page's segment
+    vaddr_t pe_vaddr;       // page address in the address space
+    paddr_t pe_paddr;       // the shared frame
+    struct pagecache_entry *pe_next;
+};
+
+static struct pagecache_entry *pagecache[PAGECACHE_BUCKETS];
+static unsigned pagecache_npages;
+static unsigned pagecache_hits;
+static unsigned pagecache_fills;
+static unsigned pagecache_evictions;
+
+// Protects pagecache[] and the counters. Taken after an address
+// space's page table lock and before the frame table lock.
+static struct spinlock pagecache_spinlock = SPINLOCK_INITIALIZER;
+
+static unsigned pagecache_hash(struct vnode *v, off_t offset, vaddr_t vaddr)
+{
+    uintptr_t h = (uintptr_t)v / sizeof(void *);
+
+    h ^= (uintptr_t)offset ^ (vaddr / PAGE_SIZE);
+    return h % PAGECACHE_BUCKETS;
+}
+
+/*
+ * Find the entry for a page. Called with pagecache_spinlock held.
+ */
+static struct pagecache_entry *pagecache_find(struct vnode *v, off_t offset,
+                                              vaddr_t vaddr)
+{
+    struct pagecache_entry *pe;
+
+    for (pe = pagecache[pagecache_hash(v, offset, vaddr)]; pe != NULL;
+         pe = pe->pe_next)
+    {
+        if (pe->pe_vnode == v && pe->pe_offset == offset &&
+            pe->pe_vaddr == vaddr)
+        {
+            return pe;
+        }
+    }
+    return NULL;
+}
+
+paddr_t pagecache_lookup(struct vnode *v, off_t offset, vaddr_t vaddr)
+{
+    struct pagecache_entry *pe;
+    paddr_t paddr = 0;
+
+    spinlock_acquire(&pagecache_spinlock);
+    pe = pagecache_find(v, offset, vaddr);
+    if (pe != NULL)
+    {
+        frame_incref(pe->pe_paddr);
+        paddr = pe->pe_paddr;
+        pagecache_hits++;
+    }
+    spinlock_release(&pagecache_spinlock);
+
+    return paddr;
+}
+
+paddr_t pagecache_insert(struct vnode *v, off_t offset, vaddr_t vaddr,
+                         paddr_t paddr)
+{
+    struct pagecache_entry *pe, *newpe;
+    paddr_t cached;
+    unsigned h = pagecache_hash(v, offset, vaddr);
+
+    // Allocate first; kmalloc may have to evict
+    newpe = kmalloc(sizeof(*newpe));
+    if (newpe == NULL)
+    {
+        // Keep the page private
+        return paddr;
+    }
+
+    spinlock_acquire(&pagecache_spinlock);
+    pe = pagecache_find(v, offset, vaddr);
+    if (pe != NULL)
+    {
+        // Someone read the same page in at the same time
+        cached = pe->pe_paddr;
+        frame_incref(cached);
+        spinlock_release(&pagecache_spinlock);
+
+        kfree(newpe);
+        free_kpages(PADDR_TO_KVADDR(paddr));
+        return cached;
+    }
+
+    VOP_INCREF(v);
+    frame_setcached(paddr);
+    newpe->pe_vnode = v;
+    newpe->pe_offset = offset;
+    newpe->pe_vaddr = vaddr;
+    newpe->pe_paddr = paddr;
+    newpe->pe_next = pagecache[h];
+    pagecache[h] = newpe;
+    pagecache_npages++;
+    pagecache_fills++;
+    spinlock_release(&pagecache_spinlock);
+
+    return paddr;
+}
+
+bool pagecache_evict(struct vnode *v, off_t offset, vaddr_t vaddr,
+                     paddr_t paddr)
+{
+    struct pagecache_entry **pp, *pe;
+
+    spinlock_acquire(&pagecache_spinlock);
+    for (pp = &pagecache[pagecache_hash(v, offset, vaddr)]; (pe = *pp) != NULL;
+         pp = &pe->pe_next)
+    {
+        if (pe->pe_paddr == paddr)
+        {
+            break;
+        }
+    }
+    if (pe == NULL)
+    {
+        // A private copy; there was no room to cache it
+        spinlock_release(&pagecache_spinlock);
+        return true;
+    }
+
+    // Someone else may have just looked it up
+    if (!frame_uncache(paddr, 1))
+    {
+        spinlock_release(&pagecache_spinlock);
+        return false;
+    }
+    *pp = pe->pe_next;
+    pagecache_npages--;
+    pagecache_evictions++;
+    spinlock_release(&pagecache_spinlock);
+
+    // The region being paged still holds the vnode, so this is not
+    // the last reference
+    VOP_DECREF(pe->pe_vnode);
+    kfree(pe);
+    return true;
+}
+
+void pagecache_release(struct vnode *v)
+{
+    struct pagecache_entry **pp, *pe, *dead = NULL;
+
+    // A page no address space maps can't gain a mapping while we
+    // hold the lock: new mappings come from pagecache_lookup, or from
+    // forking an address space that already maps it.
+    spinlock_acquire(&pagecache_spinlock);
+    for (unsigned i = 0; i < PAGECACHE_BUCKETS; i++)
+    {
+        pp = &pagecache[i];
+        while ((pe = *pp) != NULL)
+        {
+            if (pe->pe_vnode == v && frame_uncache(pe->pe_paddr, 0))
+            {
+                *pp = pe->pe_next;
+                pe->pe_next = dead;
+                dead = pe;
+                pagecache_npages--;
+            }
+            else
+            {
+                pp = &pe->pe_next;
+            }
+        }
+    }
+    spinlock_release(&pagecache_spinlock);
+
+    while ((pe = dead) != NULL)
+    {
+        dead = pe->pe_next;
+        VOP_DECREF(pe->pe_vnode);
+        kfree(pe);
+    }
+}
+
+void pagecache_getstats(unsigned *npages, unsigned *hits, unsigned *fills,
+                        unsigned *evictions)
+{
+    spinlock_acquire(&pagecache_spinlock);
+    *npages = pagecache_npages;
+    *hits = pagecache_hits;
+    *fills = pagecache_fills;
+    *evictions = pagecache_evictions;
+    spinlock_release(&pagecache_spinlock);
+}
@@ -0,0 +1,272 @@
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <vm.h>
+#include <reclaim.h>
+
+/*
+ * Watermarks, in free frames, as a fraction of memory. The reclaim
+ * thread is woken below the high one and works until it is reached;
+ * below the low one allocating threads reclaim too.
+ */
+#define RECLAIM_LOW_FRACTION 64
+#define RECLAIM_HIGH_FRACTION 16
+#define RECLAIM_LOW_MIN 8
+
+// Most pages the reclaim thread asks for in one pass over the shrinkers
+#define RECLAIM_BATCH 16
+
+static struct shrinker *shrinkers; // in registration order
+static unsigned reclaim_low;       // 0 until reclaim_bootstrap
+static unsigned reclaim_high;
+
+// Protects the shrinker counters, the flags and the statistics below
+static struct spinlock reclaim_spinlock = SPINLOCK_INITIALIZER;
+static struct wchan *reclaim_wchan;
+static bool reclaim_kicked;  // the thread has been asked to run
+static bool reclaim_stalled; // its last run freed nothing
+
+static struct
+{
+    unsigned wakeups;    // runs of the reclaim thread
+    unsigned background; // pages it freed
+    unsigned direct;     // reclaims by allocating threads
+    unsigned direct_pages; // pages they freed
+    unsigned direct_fails; // ones that freed nothing
+} reclaimstats;
+
+/*
+ * Whether the current thread may run shrinkers that sleep.
+ */
+static bool reclaim_canblock(void)
+{
+    return CURCPU_EXISTS() && !curthread->t_in_interrupt &&
+           curthread->t_curspl == 0 && !curthread->t_reclaiming;
+}
+
+/*
+ * Run the shrinkers until NPAGES pages are freed; the ones that may
+ * sleep only if CANBLOCK.
+ */
+static unsigned reclaim_run(unsigned npages, bool canblock)
+{
+    unsigned freed = 0;
+
+    for (struct shrinker *sh = shrinkers; sh != NULL && freed < npages; sh = sh->sh_next)
+    {
+        if (sh->sh_mayblock && !canblock)
+        {
+            continue;
+        }
+
+        // Memory the shrinker allocates must not come back here
+        bool nested = curthread->t_reclaiming;
+        curthread->t_reclaiming = true;
+        unsigned n = sh->sh_shrink(npages - freed);
+        curthread->t_reclaiming = nested;
+
+        spinlock_acquire(&reclaim_spinlock);
+        sh->sh_calls++;
+        sh->sh_freed += n;
+        spinlock_release(&reclaim_spinlock);
+
+        freed += n;
+    }
+
+    return freed;
+}
+
+/*
+ * The reclaim thread. Once woken it keeps the high watermark of
+ * frames free for as long as the shrinkers make progress, so faults
+ * seldom have to page out themselves.
+ */
+static void reclaim_thread(void *data1, unsigned long data2)
+{
+    unsigned freeframes, totalframes, freed;
+
+    (void)data1;
+    (void)data2;
+
+    for (;;)
+    {
+        spinlock_acquire(&reclaim_spinlock);
+        while (!reclaim_kicked)
+        {
+            wchan_sleep(reclaim_wchan, &reclaim_spinlock);
+        }
+        reclaim_kicked = false;
+        reclaimstats.wakeups++;
+        spinlock_release(&reclaim_spinlock);
+
+        freed = 0;
+        for (;;)
+        {
+            ram_getusage(&freeframes, &totalframes);
+            if (freeframes >= reclaim_high)
+            {
+                break;
+            }
+
+            unsigned want = reclaim_high - freeframes;
+            unsigned n = reclaim_run(want < RECLAIM_BATCH ? want : RECLAIM_BATCH, true);
+            if (n == 0)
+            {
+                break;
+            }
+            freed += n;
+        }
+
+        spinlock_acquire(&reclaim_spinlock);
+        reclaimstats.background += freed;
+        reclaim_stalled = freeframes < reclaim_high && freed == 0;
+        spinlock_release(&reclaim_spinlock);
+    }
+}
+
+void reclaim_bootstrap(void)
+{
+    unsigned freeframes, totalframes;
+    int result;
+
+    reclaim_wchan = wchan_create("reclaim");
+    if (reclaim_wchan == NULL)
+    {
+        panic("reclaim_bootstrap: out of memory\n");
+    }
+
+    result = thread_fork("reclaim", NULL, reclaim_thread, NULL, 0);
+    if (result)
+    {
+        panic("reclaim_bootstrap: thread_fork failed: %s\n", strerror(result));
+    }
+
+    ram_getusage(&freeframes, &totalframes);
+    reclaim_high = totalframes / RECLAIM_HIGH_FRACTION;
+    reclaim_low = totalframes / RECLAIM_LOW_FRACTION;
+    if (reclaim_low < RECLAIM_LOW_MIN)
+    {
+        reclaim_low = RECLAIM_LOW_MIN;
+    }
+    if (reclaim_high < 2 * reclaim_low)
+    {
+        reclaim_high = 2 * reclaim_low;
+    }
+}
+
+void reclaim_register(struct shrinker *sh)
+{
+    struct shrinker **p;
+
+    for (p = &shrinkers; *p != NULL; p = &(*p)->sh_next)
+    {
+        // nothing
+    }
+    sh->sh_next = NULL;
+    *p = sh;
+}
+
+/*
+ * Reclaim in an allocating thread, with the shrinkers that may sleep
+ * only if CANBLOCK.
+ */
+static unsigned reclaim_direct(unsigned npages, bool canblock)
+{
+    unsigned freed;
+
+    if (reclaim_high == 0)
+    {
+        // Too early in boot
+        return 0;
+    }
+
+    if (CURCPU_EXISTS() && curthread->t_reclaiming)
+    {
+        // A shrinker is allocating; running the shrinkers again
+        // inside it could take its locks a second time
+        return 0;
+    }
+
+    freed = reclaim_run(npages, canblock);
+
+    spinlock_acquire(&reclaim_spinlock);
+    reclaimstats.direct++;
+    reclaimstats.direct_pages += freed;
+    if (freed == 0)
+    {
+        reclaimstats.direct_fails++;
+    }
+    spinlock_release(&reclaim_spinlock);
+
+    return freed;
+}
+
+/*
+ * Wake the reclaim thread below the high watermark, unless its last
+ * run got nowhere and memory has not recovered since. Below the low
+ * one also run the shrinkers that don't sleep here; paging out is
+ * left to the thread until an allocation would otherwise fail.
+ * Called after every allocation with the allocator's (approximate)
+ * free count, so the common case is the one comparison.
+ */
+void reclaim_check(unsigned freeframes)
+{
+    bool stalled;
+
+    if (freeframes >= reclaim_high)
+    {
+        if (reclaim_stalled)
+        {
+            spinlock_acquire(&reclaim_spinlock);
+            reclaim_stalled = false;
+            spinlock_release(&reclaim_spinlock);
+        }
+        return;
+    }
+
+    spinlock_acquire(&reclaim_spinlock);
+    stalled = reclaim_stalled;
+    if (!stalled && !reclaim_kicked)
+    {
+        reclaim_kicked = true;
+        wchan_wakeone(reclaim_wchan, &reclaim_spinlock);
+    }
+    spinlock_release(&reclaim_spinlock);
+
+    // Not from inside a shrinker, as in reclaim_direct
+    if (freeframes < reclaim_low && !stalled &&
+        !(CURCPU_EXISTS() && curthread->t_reclaiming))
+    {
+        reclaim_direct(reclaim_low - freeframes, false);
+    }
+}
+
+unsigned reclaim_pages(unsigned npages)
+{
+    return reclaim_direct(npages, reclaim_canblock());
+}
+
+void reclaim_printstats(void)
+{
+    spinlock_acquire(&reclaim_spinlock);
+    unsigned wakeups = reclaimstats.wakeups;
+    unsigned background = reclaimstats.background;
+    unsigned direct = reclaimstats.direct;
+    unsigned direct_pages = reclaimstats.direct_pages;
+    unsigned direct_fails = reclaimstats.direct_fails;
+    spinlock_release(&reclaim_spinlock);
+
+    kprintf("reclaim: watermarks %u/%u frames; thread ran %u times and freed %u pages\n",
+            reclaim_low, reclaim_high, wakeups, background);
+    kprintf("reclaim: %u direct reclaims freed %u pages, %u freed nothing\n",
+            direct, direct_pages, direct_fails);
+    for (struct shrinker *sh = shrinkers; sh != NULL; sh = sh->sh_next)
+    {
+        kprintf("reclaim: %s: %u calls, %u pages freed\n",
+                sh->sh_name, sh->sh_calls, sh->sh_freed);
+    }
+}
@@ -0,0 +1,141 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <spinlock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <swap.h>
+
+/*
+ * Swap lives on the first disk. Run sys161 with a disk attached as
+ * lhd0 to enable paging; without one we simply run out of memory as
+ * before.
+ */
+#define SWAP_DEVICE "lhd0:"
+
+static struct vnode *swap_vnode;  // raw device vnode, NULL if no swap
+static struct bitmap *swap_map;   // one bit per page-sized slot
+static unsigned swap_nslots;
+static unsigned swap_nused;
+
+// Protects swap_map and swap_nused
+static struct spinlock swap_spinlock = SPINLOCK_INITIALIZER;
+
+void swap_bootstrap(void)
+{
+    struct stat st;
+    int result;
+
+    result = vfs_swapon(SWAP_DEVICE, &swap_vnode);
+    if (result)
+    {
+        kprintf("swap: %s: %s; running without swap\n", SWAP_DEVICE,
+                strerror(result));
+        swap_vnode = NULL;
+        return;
+    }
+
+    result = VOP_STAT(swap_vnode, &st);
+    if (result)
+    {
+        panic("swap: cannot stat %s: %s\n", SWAP_DEVICE, strerror(result));
+    }
+
+    swap_nslots = st.st_size / PAGE_SIZE;
+    swap_map = bitmap_create(swap_nslots);
+    if (swap_map == NULL)
+    {
+        panic("swap: out of memory for the slot bitmap\n");
+    }
+
+    kprintf("swap: %u pages on %s\n", swap_nslots, SWAP_DEVICE);
+}
+
+int swap_alloc(unsigned *slot)
+{
+    int result;
+
+    if (swap_map == NULL)
+    {
+        return ENOSPC;
+    }
+
+    spinlock_acquire(&swap_spinlock);
+    result = bitmap_alloc(swap_map, slot);
+    if (result == 0)
+    {
+        swap_nused++;
+    }
+    spinlock_release(&swap_spinlock);
+
+    return result;
+}
+
+void swap_free(unsigned slot)
+{
+    KASSERT(slot < swap_nslots);
+
+    spinlock_acquire(&swap_spinlock);
+    bitmap_unmark(swap_map, slot);
+    swap_nused--;
+    spinlock_release(&swap_spinlock);
+}
+
+/*
+ * Move one page between a frame and its slot on the swap device.
+ */
+static int swap_io(unsigned slot, paddr_t paddr, enum uio_rw rw)
+{
+    struct iovec iov;
+    struct uio ku;
+    int result;
+
+    KASSERT(swap_vnode != NULL);
+    KASSERT(slot < swap_nslots);
+
+    uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+              (off_t)slot * PAGE_SIZE, rw);
+
+    if (rw == UIO_READ)
+    {
+        result = VOP_READ(swap_vnode, &ku);
+    }
+    else
+    {
+        result = VOP_WRITE(swap_vnode, &ku);
+    }
+    if (result)
+    {
+        return result;
+    }
+
+    if (ku.uio_resid != 0)
+    {
+        kprintf("swap: short transfer on slot %u\n", slot);
+        return EIO;
+    }
+
+    return 0;
+}
+
+int swap_in(unsigned slot, paddr_t paddr)
+{
+    return swap_io(slot, paddr, UIO_READ);
+}
+
+int swap_out(unsigned slot, paddr_t paddr)
+{
+    return swap_io(slot, paddr, UIO_WRITE);
+}
+
+void swap_getusage(unsigned *used, unsigned *total)
+{
+    spinlock_acquire(&swap_spinlock);
+    *used = swap_nused;
+    *total = swap_nslots;
+    spinlock_release(&swap_spinlock);
+}
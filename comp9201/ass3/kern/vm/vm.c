@@ -7,16 +7,1221 @@
 #include <machine/tlb.h>
 #include <spl.h>
 #include <proc.h>
+#include <cpu.h>
 #include <current.h>
+#include <uio.h>
+#include <vnode.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <swap.h>
+#include <pagecache.h>
+#include <reclaim.h>
+#include <kmem.h>
+#include <mips/trapframe.h>
+#include <platform/maxcpus.h>
 /* Place your page table functions here */
 
+// Paging and TLB counters, one set per cpu so that counting touches
+// no shared lock or cache line. They are only bumped with a spinlock
+// held, so interrupts are off and the thread stays on its cpu.
+// Readers add them up without locking.
+struct vmcounters
+{
+    unsigned faults[3];    // vm_fault() calls, by fault type
+    unsigned zerofills;    // pages given a frame of zeros
+    unsigned pagecopies;   // copy-on-write pages copied
+    unsigned pageins;  // pages read back from swap
+    unsigned pageouts; // pages written to swap
+    unsigned discards; // clean file-backed pages dropped instead
+    unsigned writebacks;   // dirty mmap() pages written to their file
+    unsigned zero_maps;    // read faults given the shared zero page
+    unsigned zero_copies;  // writes that replaced the zero page
+    unsigned fa_mapped;    // pages mapped by fault-around
+    unsigned fa_preloaded; // TLB entries preloaded by fault-around
+    unsigned aged;         // pages whose reference bit the pager cleared
+    unsigned refills;  // TLB entries loaded by vm_fault()
+    unsigned switches; // activations that changed the ASID
+    unsigned flushes;  // whole-TLB flushes on ASID rollover
+    unsigned shootdowns; // invalidations sent to other cpus
+    unsigned deferred;   // ones left until the other cpu activates
+};
+static struct vmcounters vmcounters[MAXCPUS];
+
+#define VMSTAT(field) (vmcounters[curcpu->c_number].field)
+
+/*
+ * Address space IDs. The MIPS tags TLB entries with a 6-bit ASID, so
+ * an address space keeps its entries across context switches. ASIDs
+ * are handed out in generations: when they run out a new generation
+ * starts, each cpu flushes its TLB before it next activates an
+ * address space, and address spaces get a fresh ASID the next time
+ * they are activated. An ASID is never reused within a generation.
+ */
+static struct spinlock asid_spinlock = SPINLOCK_INITIALIZER;
+static uint32_t asid_generation = 1;
+static unsigned asid_next = 0;
+
+// Each cpu that has activated an address space, by number, for
+// sending it shootdowns. Protected by asid_spinlock.
+static struct cpu *vm_cpus[MAXCPUS];
+
+unsigned vm_faultaround = 4;
+
+// One read-only page of zeros, mapped copy-on-write for reads of
+// untouched zero-fill pages. vm_bootstrap() holds a reference to it,
+// so it is never freed, never evicted, and a write always copies it.
+static paddr_t zero_frame;
+
+// Shrinkers for memory the VM can give back, defined below
+static struct shrinker ptpool_shrinker;
+static struct shrinker kmem_shrinker;
+static struct shrinker kheap_shrinker;
+static struct shrinker pageout_shrinker;
+
 void vm_bootstrap(void)
 {
-    /* Initialise any global components of your VM sub-system here.
-     *
-     * You may or may not need to add anything here depending what's
-     * provided or required by the assignment spec.
-     */
+    /* Initialise any global components of your VM sub-system here.
+     *
+     * You may or may not need to add anything here depending what's
+     * provided or required by the assignment spec.
+     */
+
+    vaddr_t kvaddr = alloc_kpages(1);
+    if (kvaddr == 0)
+    {
+        panic("vm_bootstrap: out of memory\n");
+    }
+    bzero((void *)kvaddr, PAGE_SIZE);
+    zero_frame = KVADDR_TO_PADDR(kvaddr);
+
+    swap_bootstrap();
+    frame_zeroer_start();
+
+    // Cheapest first: paging out costs I/O
+    reclaim_register(&ptpool_shrinker);
+    reclaim_register(&kmem_shrinker); // before the heap, which its destructors free into
+    reclaim_register(&kheap_shrinker);
+    reclaim_register(&pageout_shrinker);
+    reclaim_bootstrap();
+}
+
+void pt_wait(struct addrspace *as)
+{
+    wchan_sleep(as->as_ptwchan, &as->as_ptlock);
+}
+
+void pt_wakeup(struct addrspace *as)
+{
+    wchan_wakeall(as->as_ptwchan, &as->as_ptlock);
+}
+
+/*
+ * Second-level page tables. Each is one page, taken zeroed from the
+ * zeroing thread's supply. Tables are all zeroes again by the time
+ * as_destroy() gives them back, so up to PTPOOL_MAX of them are kept
+ * for reuse as they are, and the next address space to need one gets
+ * it without going to the frame allocator or zeroing anything. Free
+ * tables are chained through their first entry.
+ */
+#define PTPOOL_MAX 32
+
+static struct spinlock ptpool_spinlock = SPINLOCK_INITIALIZER;
+static paddr_t *ptpool;     // free tables
+static unsigned ptpool_nfree;
+static unsigned ptpool_inuse;  // tables in page tables now
+static unsigned ptpool_hits;   // tables handed out from the pool
+static unsigned ptpool_misses; // tables that had to be allocated
+
+paddr_t *pt_alloc_table(void)
+{
+    paddr_t *table;
+
+    spinlock_acquire(&ptpool_spinlock);
+    table = ptpool;
+    if (table != NULL)
+    {
+        ptpool = (paddr_t *)table[0];
+        table[0] = 0;
+        ptpool_nfree--;
+        ptpool_hits++;
+        ptpool_inuse++;
+    }
+    spinlock_release(&ptpool_spinlock);
+
+    if (table == NULL)
+    {
+        table = (paddr_t *)alloc_zeroed_kpage();
+        if (table == NULL)
+        {
+            return NULL;
+        }
+        spinlock_acquire(&ptpool_spinlock);
+        ptpool_misses++;
+        ptpool_inuse++;
+        spinlock_release(&ptpool_spinlock);
+    }
+
+    return table;
+}
+
+void pt_free_table(paddr_t *table)
+{
+    spinlock_acquire(&ptpool_spinlock);
+    ptpool_inuse--;
+    if (ptpool_nfree < PTPOOL_MAX)
+    {
+        table[0] = (paddr_t)ptpool;
+        ptpool = table;
+        ptpool_nfree++;
+        table = NULL;
+    }
+    spinlock_release(&ptpool_spinlock);
+
+    if (table != NULL)
+    {
+        free_kpages((vaddr_t)table);
+    }
+}
+
+/*
+ * Shrinker: free pooled page tables. They are only a cache of zeroed
+ * pages, so this never sleeps.
+ */
+static unsigned ptpool_shrink(unsigned npages)
+{
+    unsigned freed = 0;
+    paddr_t *table;
+
+    while (freed < npages)
+    {
+        spinlock_acquire(&ptpool_spinlock);
+        table = ptpool;
+        if (table != NULL)
+        {
+            ptpool = (paddr_t *)table[0];
+            table[0] = 0;
+            ptpool_nfree--;
+        }
+        spinlock_release(&ptpool_spinlock);
+
+        if (table == NULL)
+        {
+            break;
+        }
+        free_kpages((vaddr_t)table);
+        freed++;
+    }
+    return freed;
+}
+
+static struct shrinker ptpool_shrinker =
+    SHRINKER_INITIALIZER("page table pool", ptpool_shrink, false);
+static struct shrinker kmem_shrinker =
+    SHRINKER_INITIALIZER("object caches", kmem_reclaim, false);
+static struct shrinker kheap_shrinker =
+    SHRINKER_INITIALIZER("kernel heap", kheap_reclaim, false);
+
+paddr_t *as_lookup_pte(struct addrspace *as, vaddr_t vaddr, paddr_t **newtable)
+{
+    uint32_t I1 = PT_L1_INDEX(vaddr); // Level 1: 9 bits (user space only)
+    uint32_t I2 = PT_L2_INDEX(vaddr); // Level 2: 10 bits
+    // Offset : 12 bits
+
+    KASSERT(I1 < FIRST_LEVEL);
+
+    // If nothing in the first Level
+    if (as->pagetable[I1] == NULL)
+    {
+        if (newtable == NULL || *newtable == NULL)
+        {
+            return NULL;
+        }
+
+        as->pagetable[I1] = *newtable;
+        *newtable = NULL;
+        as->as_ptpages++;
+    }
+
+    return &as->pagetable[I1][I2];
+}
+
+/*
+ * Whether the page at VADDR in REGION starts out as all zeroes: it is
+ * anonymous, or lies wholly in the bss of an executable segment.
+ */
+static bool vm_zero_fill(struct region *region, vaddr_t vaddr)
+{
+    return region->vnode == NULL || vaddr + PAGE_SIZE <= region->file_vaddr ||
+           vaddr >= region->file_vaddr + region->file_size;
+}
+
+/*
+ * Whether pages of REGION are shared through the text page cache:
+ * those of read-only segments of an executable.
+ */
+static bool vm_cacheable(struct region *region)
+{
+    return region->vnode != NULL && !region->writeable && !region->mapped;
+}
+
+/*
+ * Fill the fresh page at KVADDR, which will be mapped at VADDR in
+ * REGION, from the region's backing executable. The part of the page
+ * that overlaps the segment's file image is read from the file and
+ * everything else (the bss tail, or any gap before the image) is
+ * zeroed.
+ */
+static int vm_fill_from_file(struct region *region, vaddr_t vaddr, vaddr_t kvaddr)
+{
+    vaddr_t file_start = region->file_vaddr;
+    vaddr_t file_end = file_start + region->file_size;
+    vaddr_t start = vaddr > file_start ? vaddr : file_start;
+    vaddr_t end = vaddr + PAGE_SIZE < file_end ? vaddr + PAGE_SIZE : file_end;
+
+    // Page lies wholly in the bss
+    if (start >= end)
+    {
+        bzero((void *)kvaddr, PAGE_SIZE);
+        return 0;
+    }
+
+    bzero((void *)kvaddr, start - vaddr);
+    bzero((void *)(kvaddr + (end - vaddr)), vaddr + PAGE_SIZE - end);
+
+    struct iovec iov;
+    struct uio ku;
+    uio_kinit(&iov, &ku, (void *)(kvaddr + (start - vaddr)), end - start,
+              region->file_offset + (start - file_start), UIO_READ);
+
+    int result = VOP_READ(region->vnode, &ku);
+    if (result)
+    {
+        return result;
+    }
+
+    if (ku.uio_resid != 0 && region->mapped)
+    {
+        // A mapped file may have been truncated since; read zeros
+        bzero((void *)(kvaddr + (end - vaddr) - ku.uio_resid), ku.uio_resid);
+    }
+    else if (ku.uio_resid != 0)
+    {
+        // short read; problem with executable?
+        kprintf("ELF: short read on demand load - file truncated?\n");
+        return ENOEXEC;
+    }
+
+    return 0;
+}
+
+/*
+ * Write the part of the page at PADDR, mapped at VADDR in REGION,
+ * that lies inside the region's file image back to the file. The
+ * file never grows: the rest of the last page is dropped.
+ */
+static int vm_write_page(struct region *region, vaddr_t vaddr, paddr_t paddr)
+{
+    vaddr_t file_start = region->file_vaddr;
+    vaddr_t file_end = file_start + region->file_size;
+    vaddr_t start = vaddr > file_start ? vaddr : file_start;
+    vaddr_t end = vaddr + PAGE_SIZE < file_end ? vaddr + PAGE_SIZE : file_end;
+
+    if (start >= end)
+    {
+        return 0;
+    }
+
+    struct iovec iov;
+    struct uio ku;
+    uio_kinit(&iov, &ku, (void *)(PADDR_TO_KVADDR(paddr) + (start - vaddr)), end - start,
+              region->file_offset + (start - file_start), UIO_WRITE);
+
+    int result = VOP_WRITE(region->vnode, &ku);
+    if (result)
+    {
+        return result;
+    }
+
+    if (ku.uio_resid != 0)
+    {
+        return EIO;
+    }
+
+    return 0;
+}
+
+/*
+ * Invalidate every TLB entry on this cpu. Interrupts must be off.
+ */
+static void vm_tlb_flush(void)
+{
+    for (int i = 0; i < NUM_TLB; i++)
+    {
+        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+    }
+}
+
+/*
+ * Invalidate this cpu's TLB entries for user pages tagged with ASID.
+ * Interrupts must be off; leaves some other ASID loaded.
+ */
+static void vm_tlb_flush_asid(unsigned asid)
+{
+    uint32_t hi, lo;
+
+    for (int i = 0; i < NUM_TLB; i++)
+    {
+        tlb_read(&hi, &lo, i);
+        if ((hi & TLBHI_VPAGE) < MIPS_KSEG0 &&
+            (hi & TLBHI_PID) >> TLBHI_PID_SHIFT == asid)
+        {
+            tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+        }
+    }
+}
+
+/*
+ * TLB shootdown. Since entries are tagged with an ASID, any cpu that
+ * has run AS in the current generation may still hold some of them.
+ * as_tlbcpus records those cpus. A cpu running AS right now is sent
+ * the invalidation with ipi_tlbshootdown; the rest cannot use the
+ * entries until they activate AS again, so they are just marked in
+ * as_tlbstale and drop all of AS's entries then. TLBHI is the page
+ * and ASID to invalidate, or TLBSHOOTDOWN_ALL for all of AS. Called
+ * with asid_spinlock held.
+ *
+ * The target handles the shootdown when it takes the interrupt. The
+ * pager, which changes other processes' pages, waits for that with
+ * ipi_tlbshootdown_wait before it reuses a frame; everyone else only
+ * changes the current process's pages, and a process runs on one
+ * cpu at a time.
+ */
+static void vm_tlb_send_shootdown(struct addrspace *as, uint32_t tlbhi)
+{
+    uint32_t others = as->as_tlbcpus & ~((uint32_t)1 << curcpu->c_number);
+    struct tlbshootdown ts;
+
+    if (others == 0)
+    {
+        return;
+    }
+
+    ts.ts_tlbhi = tlbhi;
+    ts.ts_asid_gen = as->as_asid_gen;
+
+    for (unsigned i = 0; i < MAXCPUS; i++)
+    {
+        if ((others & ((uint32_t)1 << i)) == 0)
+        {
+            continue;
+        }
+        if (cpupagetables[i] == (vaddr_t)as->pagetable)
+        {
+            ipi_tlbshootdown(vm_cpus[i], &ts);
+            VMSTAT(shootdowns)++;
+        }
+        else if ((as->as_tlbstale & ((uint32_t)1 << i)) == 0)
+        {
+            as->as_tlbstale |= (uint32_t)1 << i;
+            VMSTAT(deferred)++;
+        }
+    }
+}
+
+void vm_tlb_activate(struct addrspace *as)
+{
+    uint32_t me = (uint32_t)1 << curcpu->c_number;
+
+    spinlock_acquire(&asid_spinlock);
+
+    if (as->as_asid_gen != asid_generation)
+    {
+        // Out of ASIDs; start a new generation
+        if (asid_next == NUM_ASIDS)
+        {
+            asid_generation++;
+            asid_next = 0;
+        }
+        as->as_asid = asid_next++;
+        as->as_asid_gen = asid_generation;
+
+        // No cpu has entries with the new ASID yet
+        as->as_tlbcpus = 0;
+        as->as_tlbstale = 0;
+    }
+
+    // Entries from an older generation may carry our ASID
+    if (curcpu->c_asid_generation != asid_generation)
+    {
+        vm_tlb_flush();
+        curcpu->c_asid_generation = asid_generation;
+        VMSTAT(flushes)++;
+    }
+    else if (as->as_tlbstale & me)
+    {
+        // Invalidations were skipped while AS ran elsewhere
+        vm_tlb_flush_asid(as->as_asid);
+    }
+    as->as_tlbstale &= ~me;
+    as->as_tlbcpus |= me;
+    vm_cpus[curcpu->c_number] = curcpu->c_self;
+
+    if (curcpu->c_asid != as->as_asid)
+    {
+        VMSTAT(switches)++;
+    }
+    curcpu->c_asid = as->as_asid;
+    tlb_setasid(as->as_asid);
+    cpupagetables[curcpu->c_number] = (vaddr_t)as->pagetable;
+
+    spinlock_release(&asid_spinlock);
+}
+
+/*
+ * Entries for AS can only be in this cpu's TLB if AS has an ASID from
+ * the generation the TLB holds; anything older has been flushed, and
+ * the TLB will be flushed before AS's new ASID is ever loaded here.
+ * Both functions leave the current ASID loaded afterwards.
+ */
+
+void vm_tlb_flush_as(struct addrspace *as)
+{
+    spinlock_acquire(&asid_spinlock);
+    if (as->as_asid_gen == curcpu->c_asid_generation)
+    {
+        vm_tlb_flush_asid(as->as_asid);
+        tlb_setasid(curcpu->c_asid);
+    }
+    vm_tlb_send_shootdown(as, TLBSHOOTDOWN_ALL);
+    spinlock_release(&asid_spinlock);
+}
+
+void vm_tlb_destroy_as(struct addrspace *as)
+{
+    spinlock_acquire(&asid_spinlock);
+    if (as->as_asid_gen == curcpu->c_asid_generation)
+    {
+        vm_tlb_flush_asid(as->as_asid);
+        tlb_setasid(curcpu->c_asid);
+    }
+
+    // A cpu that last ran AS keeps walking its page table in the
+    // refill handler until it activates another address space
+    for (unsigned i = 0; i < MAXCPUS; i++)
+    {
+        if (cpupagetables[i] == (vaddr_t)as->pagetable)
+        {
+            cpupagetables[i] = 0;
+        }
+    }
+    spinlock_release(&asid_spinlock);
+}
+
+/*
+ * Drop any translation for VADDR in AS from this cpu's TLB, and have
+ * the other cpus drop theirs. The page is only guaranteed gone from
+ * other cpus' TLBs after vm_tlb_sync().
+ */
+static void vm_tlb_invalidate(struct addrspace *as, vaddr_t vaddr)
+{
+    uint32_t hi = (vaddr & PAGE_FRAME) | (as->as_asid << TLBHI_PID_SHIFT);
+
+    spinlock_acquire(&asid_spinlock);
+    if (as->as_asid_gen == curcpu->c_asid_generation)
+    {
+        int index = tlb_probe(hi, 0);
+        if (index >= 0)
+        {
+            tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+        }
+        tlb_setasid(curcpu->c_asid);
+    }
+    vm_tlb_send_shootdown(as, hi);
+    spinlock_release(&asid_spinlock);
+}
+
+/*
+ * Wait until the shootdowns sent so far have reached the other cpus.
+ * Must be called without spinlocks held.
+ */
+static void vm_tlb_sync(void)
+{
+    ipi_tlbshootdown_wait();
+}
+
+/*
+ * The pager has cleared the reference bit of the page at VADDR in AS,
+ * whose entry is PTE. Clear PTE_ACCESSED too and drop the TLB entry,
+ * so the next use of the page goes through vm_fault() and sets both
+ * again. Called with the page table lock of AS held.
+ */
+static void vm_age_page(struct addrspace *as, vaddr_t vaddr, paddr_t *pte)
+{
+    if (*pte & PTE_ACCESSED)
+    {
+        *pte &= ~(paddr_t)PTE_ACCESSED;
+        vm_tlb_invalidate(as, vaddr);
+        VMSTAT(aged)++;
+    }
+}
+
+/*
+ * Pick a page to evict with the clock in the frame table. Each owned
+ * frame the hand comes to is looked at with the page table lock of
+ * its owner held, since only that keeps the mapping still; a frame
+ * that is no longer mapped there as it was, or is busy, is passed
+ * over. A page used since the hand last came by is aged and passed
+ * over too, as is cached text another process has mapped since. Two
+ * full sweeps are enough to find a victim if there is one.
+ *
+ * Returns the victim's frame, with its address space in *ASP locked
+ * and pinned (see frame_next_owned), its address, entry and region in
+ * *VADDRP, *PTEP and *REGIONP, and no owner, so no other pager picks
+ * it. Returns 0 if there is nothing to evict.
+ */
+static paddr_t vm_pick_victim(struct addrspace **asp, vaddr_t *vaddrp,
+                              paddr_t **ptep, struct region **regionp)
+{
+    unsigned freeframes, totalframes, budget;
+    struct addrspace *as;
+    struct region *region;
+    vaddr_t vaddr;
+    paddr_t paddr, *pte;
+
+    ram_getusage(&freeframes, &totalframes);
+    budget = 2 * totalframes;
+
+    while ((paddr = frame_next_owned(&as, &vaddr, &budget)) != 0)
+    {
+        spinlock_acquire(&as->as_ptlock);
+
+        pte = as_lookup_pte(as, vaddr, NULL);
+        if (pte != NULL && (*pte & (TLBLO_VALID | PTE_BUSY)) == TLBLO_VALID &&
+            (*pte & PAGE_FRAME) == paddr)
+        {
+            switch (frame_claim(paddr, as, vaddr))
+            {
+            case FRAME_AGED:
+                vm_age_page(as, vaddr, pte);
+                break;
+
+            case FRAME_VICTIM:
+                region = as_find_region(as, vaddr);
+                KASSERT(region != NULL);
+                if (!vm_cacheable(region) ||
+                    pagecache_evict(region->vnode, region->file_offset, vaddr, paddr))
+                {
+                    *asp = as;
+                    *vaddrp = vaddr;
+                    *ptep = pte;
+                    *regionp = region;
+                    return paddr;
+                }
+                break;
+
+            default:
+                break;
+            }
+        }
+
+        spinlock_release(&as->as_ptlock);
+        frame_unpin(as);
+    }
+
+    return 0;
+}
+
+/*
+ * Push one user page out of memory to make room. Pages of read-only
+ * file-backed regions are simply dropped, since vm_fault() can read
+ * them back from the executable; cached text leaves the page cache
+ * with them. Pages of mmap()ed files go back to the file if they are
+ * dirty; everything else is written to swap. Only the victim's page
+ * table lock is taken, so faults in other address spaces carry on
+ * meanwhile. Returns 0 once a frame has been freed, or ENOMEM if
+ * there is nothing left to evict or no swap space for it.
+ */
+static int vm_evict(void)
+{
+    struct addrspace *as;
+    vaddr_t vaddr;
+    unsigned slot;
+    paddr_t paddr, *pte;
+    struct region *region;
+
+    paddr = vm_pick_victim(&as, &vaddr, &pte, &region);
+    if (paddr == 0)
+    {
+        return ENOMEM;
+    }
+
+    paddr_t old = *pte;
+    if (region->vnode != NULL && !region->writeable)
+    {
+        *pte = 0;
+        vm_tlb_invalidate(as, vaddr);
+        VMSTAT(discards)++;
+        as->as_vmstat.vs_discards++;
+        spinlock_release(&as->as_ptlock);
+        frame_unpin(as);
+
+        vm_tlb_sync();
+        free_kpages(PADDR_TO_KVADDR(paddr));
+        return 0;
+    }
+
+    if (region->mapped)
+    {
+        // Anyone touching the page waits until it is gone. The
+        // region stays put: munmap waits for busy pages too.
+        *pte = paddr | PTE_BUSY;
+        vm_tlb_invalidate(as, vaddr);
+        spinlock_release(&as->as_ptlock);
+
+        // The owner may be running on another cpu; make sure it
+        // has stopped writing the page before we save it
+        vm_tlb_sync();
+        int result = (old & TLBLO_DIRTY) ? vm_write_page(region, vaddr, paddr) : 0;
+
+        spinlock_acquire(&as->as_ptlock);
+        if (result)
+        {
+            *pte = old;
+            frame_touch(paddr, as, vaddr);
+            pt_wakeup(as);
+            spinlock_release(&as->as_ptlock);
+            frame_unpin(as);
+            return ENOMEM;
+        }
+        *pte = 0;
+        if (old & TLBLO_DIRTY)
+        {
+            VMSTAT(writebacks)++;
+        }
+        else
+        {
+            VMSTAT(discards)++;
+            as->as_vmstat.vs_discards++;
+        }
+        pt_wakeup(as);
+        spinlock_release(&as->as_ptlock);
+        frame_unpin(as);
+
+        free_kpages(PADDR_TO_KVADDR(paddr));
+        return 0;
+    }
+
+    if (swap_alloc(&slot))
+    {
+        // Out of swap; give the frame its owner back
+        frame_touch(paddr, as, vaddr);
+        spinlock_release(&as->as_ptlock);
+        frame_unpin(as);
+        return ENOMEM;
+    }
+
+    // Anyone touching the page from now on waits for the write
+    *pte = paddr | PTE_BUSY;
+    vm_tlb_invalidate(as, vaddr);
+    spinlock_release(&as->as_ptlock);
+
+    vm_tlb_sync();
+    int result = swap_out(slot, paddr);
+
+    spinlock_acquire(&as->as_ptlock);
+    if (result)
+    {
+        swap_free(slot);
+        *pte = old;
+        frame_touch(paddr, as, vaddr);
+        pt_wakeup(as);
+        spinlock_release(&as->as_ptlock);
+        frame_unpin(as);
+        return ENOMEM;
+    }
+    *pte = PTE_MKSWAP(slot);
+    VMSTAT(pageouts)++;
+    as->as_vmstat.vs_pageouts++;
+    pt_wakeup(as);
+    spinlock_release(&as->as_ptlock);
+    frame_unpin(as);
+
+    free_kpages(PADDR_TO_KVADDR(paddr));
+    return 0;
+}
+
+/*
+ * Shrinker: page out user pages, to keep frames free for the kernel
+ * and for faults. Sleeps on swap and file I/O.
+ */
+static unsigned vm_pageout_shrink(unsigned npages)
+{
+    unsigned freed;
+
+    for (freed = 0; freed < npages; freed++)
+    {
+        if (vm_evict())
+        {
+            break;
+        }
+    }
+    return freed;
+}
+
+static struct shrinker pageout_shrinker =
+    SHRINKER_INITIALIZER("pageout", vm_pageout_shrink, true);
+
+// Frames vm_unmap_range holds back until the TLBs have let go of them
+#define VM_UNMAP_BATCH 32
+
+/*
+ * Free the frames unmapped so far, once no TLB can reach them. Called
+ * without spinlocks held.
+ */
+static void vm_unmap_free(paddr_t *frames, unsigned n)
+{
+    if (n == 0)
+    {
+        return;
+    }
+    vm_tlb_sync();
+    for (unsigned i = 0; i < n; i++)
+    {
+        free_kpages(PADDR_TO_KVADDR(frames[i]));
+    }
+}
+
+/*
+ * Unmap every page between START and END. Each page's translations
+ * are invalidated before its frame is freed, so no cpu can still
+ * reach a frame once it has been reused.
+ */
+void vm_unmap_range(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+    paddr_t frames[VM_UNMAP_BATCH];
+    unsigned nframes = 0;
+
+    spinlock_acquire(&as->as_ptlock);
+    for (vaddr_t va = start; va < end; va += PAGE_SIZE)
+    {
+        // Let interrupts in between second-level tables, and free
+        // a full batch of frames
+        if (PT_L2_INDEX(va) == 0 || nframes == VM_UNMAP_BATCH)
+        {
+            spinlock_release(&as->as_ptlock);
+            vm_unmap_free(frames, nframes);
+            nframes = 0;
+            spinlock_acquire(&as->as_ptlock);
+        }
+
+        paddr_t *pte = as_lookup_pte(as, va, NULL);
+        if (pte == NULL)
+        {
+            continue;
+        }
+
+        // The pager may be writing the page out
+        while (*pte & PTE_BUSY)
+        {
+            pt_wait(as);
+        }
+
+        if (*pte & PTE_SWAPPED)
+        {
+            swap_free(PTE_SWAP_SLOT(*pte));
+        }
+        else if (*pte != 0)
+        {
+            vm_tlb_invalidate(as, va);
+            frames[nframes++] = *pte & PAGE_FRAME;
+        }
+        *pte = 0;
+    }
+    spinlock_release(&as->as_ptlock);
+
+    vm_unmap_free(frames, nframes);
+}
+
+int vm_msync_region(struct addrspace *as, struct region *region)
+{
+    KASSERT(region->mapped);
+
+    for (vaddr_t va = region->vaddress; va < region->vaddress + region->size; va += PAGE_SIZE)
+    {
+        spinlock_acquire(&as->as_ptlock);
+
+        paddr_t *pte = as_lookup_pte(as, va, NULL);
+        if (pte == NULL)
+        {
+            spinlock_release(&as->as_ptlock);
+            continue;
+        }
+
+        while (*pte & PTE_BUSY)
+        {
+            pt_wait(as);
+        }
+
+        paddr_t old = *pte;
+        if ((old & (TLBLO_VALID | TLBLO_DIRTY)) != (TLBLO_VALID | TLBLO_DIRTY))
+        {
+            spinlock_release(&as->as_ptlock);
+            continue;
+        }
+
+        // Write-protect the page so the next store marks it dirty
+        // again, and hold a reference so the pager leaves the frame
+        // alone during the write
+        paddr_t paddr = old & PAGE_FRAME;
+        frame_incref(paddr);
+        *pte = (old & ~(paddr_t)TLBLO_DIRTY) | PTE_BUSY;
+        vm_tlb_invalidate(as, va);
+        spinlock_release(&as->as_ptlock);
+
+        int result = vm_write_page(region, va, paddr);
+
+        spinlock_acquire(&as->as_ptlock);
+        *pte = result ? old : old & ~(paddr_t)TLBLO_DIRTY;
+        free_kpages(PADDR_TO_KVADDR(paddr));
+        frame_touch(paddr, as, va);
+        if (result == 0)
+        {
+            VMSTAT(writebacks)++;
+        }
+        pt_wakeup(as);
+        spinlock_release(&as->as_ptlock);
+
+        if (result)
+        {
+            return result;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Allocate a frame for a user page, evicting other pages if memory
+ * is full. If ZERO is set the frame comes back cleared, preferably
+ * by the zeroing thread. Must be called without spinlocks held.
+ * Returns the kernel address of the frame, or 0 if nothing could be
+ * freed.
+ */
+static vaddr_t vm_alloc_page(bool zero)
+{
+    vaddr_t kvaddr;
+
+    while ((kvaddr = zero ? alloc_zeroed_kpage() : alloc_kpages(1)) == 0)
+    {
+        if (vm_evict())
+        {
+            return 0;
+        }
+    }
+    return kvaddr;
+}
+
+/*
+ * Read the swapped page described by PTE into a new frame and hand
+ * back a resident entry for it. Used by as_copy(), so the child gets
+ * a private copy and the parent's slot is left alone.
+ */
+int vm_swapcopy(paddr_t pte, paddr_t *ret)
+{
+    KASSERT(pte & PTE_SWAPPED);
+
+    vaddr_t kvaddr = vm_alloc_page(false);
+    if (kvaddr == 0)
+    {
+        return ENOMEM;
+    }
+
+    int result = swap_in(PTE_SWAP_SLOT(pte), KVADDR_TO_PADDR(kvaddr));
+    if (result)
+    {
+        free_kpages(kvaddr);
+        return result;
+    }
+
+    *ret = KVADDR_TO_PADDR(kvaddr) | TLBLO_VALID;
+    return 0;
+}
+
+/*
+ * Give the page at VADDR a private, resident frame: fill a fresh page
+ * from swap or from the backing file, or copy a page shared
+ * copy-on-write. Text pages are instead shared with every process
+ * running the same executable through the page cache. Called with
+ * the page table lock of AS held; the entry is marked busy while the
+ * lock is dropped to allocate and fill the frame, so other faults on
+ * the page and the pager wait for us. Returns with
+ * the lock held again. Pages of mapped files are only made writable
+ * for a WRITE, so that TLBLO_DIRTY tells which ones were modified.
+ */
+static int vm_make_resident(struct addrspace *as, struct region *region,
+                            vaddr_t vaddr, paddr_t *pte, bool write)
+{
+    paddr_t old = *pte;
+    int result = 0;
+
+    *pte |= PTE_BUSY;
+    spinlock_release(&as->as_ptlock);
+
+    // Replacing the zero page, or a fresh page that starts out as zeros
+    bool zero = (old & TLBLO_VALID) ? (old & PAGE_FRAME) == zero_frame
+                                    : !(old & PTE_SWAPPED) && vm_zero_fill(region, vaddr);
+
+    // Text another process has read in already
+    bool cacheable = old == 0 && !zero && vm_cacheable(region);
+    paddr_t cached = cacheable ? pagecache_lookup(region->vnode, region->file_offset, vaddr) : 0;
+
+    vaddr_t kvaddr = cached ? PADDR_TO_KVADDR(cached) : vm_alloc_page(zero);
+    if (kvaddr == 0)
+    {
+        result = ENOMEM;
+    }
+    else if (cached)
+    {
+        // Shared, and never written
+    }
+    else if (zero)
+    {
+        // vm_alloc_page already cleared it
+    }
+    else if (old & TLBLO_VALID)
+    {
+        // Copy-on-write. The source is shared, so it has no owner
+        // and the pager will not take it from under us.
+        memmove((void *)kvaddr, (const void *)PADDR_TO_KVADDR(old & PAGE_FRAME), PAGE_SIZE);
+    }
+    else if (old & PTE_SWAPPED)
+    {
+        result = swap_in(PTE_SWAP_SLOT(old), KVADDR_TO_PADDR(kvaddr));
+    }
+    else
+    {
+        // Demand-load segments of the executable, or pages of a
+        // mapped file, on first touch
+        result = vm_fill_from_file(region, vaddr, kvaddr);
+        if (result == 0 && cacheable)
+        {
+            kvaddr = PADDR_TO_KVADDR(pagecache_insert(region->vnode, region->file_offset,
+                                                      vaddr, KVADDR_TO_PADDR(kvaddr)));
+        }
+    }
+
+    if (result && kvaddr != 0)
+    {
+        free_kpages(kvaddr);
+    }
+
+    spinlock_acquire(&as->as_ptlock);
+    if (result)
+    {
+        *pte = old;
+        pt_wakeup(as);
+        return result;
+    }
+
+    // Page table update
+    *pte = (KVADDR_TO_PADDR(kvaddr) & PAGE_FRAME) | TLBLO_VALID;
+    if (region->writeable && (write || !region->mapped))
+    {
+        *pte |= TLBLO_DIRTY;
+    }
+
+    if (zero)
+    {
+        VMSTAT(zerofills)++;
+        as->as_vmstat.vs_zerofills++;
+    }
+    else if (old & TLBLO_VALID)
+    {
+        VMSTAT(pagecopies)++;
+        as->as_vmstat.vs_pagecopies++;
+    }
+
+    if (old & TLBLO_VALID)
+    {
+        // Drop our reference to the shared frame
+        if ((old & PAGE_FRAME) == zero_frame)
+        {
+            VMSTAT(zero_copies)++;
+        }
+        free_kpages(PADDR_TO_KVADDR(old & PAGE_FRAME));
+    }
+    else if (old & PTE_SWAPPED)
+    {
+        swap_free(PTE_SWAP_SLOT(old));
+        VMSTAT(pageins)++;
+        as->as_vmstat.vs_pageins++;
+    }
+    pt_wakeup(as);
+
+    return 0;
+}
+
+/*
+ * Map the zero page read-only at the untouched page whose entry is
+ * PTE. Called with the page table lock held.
+ */
+static void vm_map_zero(paddr_t *pte)
+{
+    frame_incref(zero_frame);
+    *pte = zero_frame | TLBLO_VALID;
+    VMSTAT(zero_maps)++;
+}
+
+/*
+ * Map the page at VADDR ahead of use for fault-around. Only pages that
+ * need no I/O are mapped, and only from frames the zeroing thread has
+ * already cleared: nothing is read, zeroed, reclaimed or evicted for
+ * a page that may never be touched. After a read fault the zero page
+ * is mapped, so a sparse reader costs no memory; after a write fault
+ * a fresh page is, since it will probably be written too. Once there
+ * are no cleared frames left *NOCLEAN is set and no more fresh pages
+ * are tried. Called with the page table lock of AS held.
+ */
+static bool vm_prefault(struct addrspace *as, struct region *region,
+                        vaddr_t vaddr, paddr_t *pte, bool write,
+                        bool *noclean)
+{
+    // Pages with part of the file image in them would need a read,
+    // unless they are text some process has already read
+    if (!vm_zero_fill(region, vaddr))
+    {
+        if (!vm_cacheable(region))
+        {
+            return false;
+        }
+        paddr_t paddr = pagecache_lookup(region->vnode, region->file_offset, vaddr);
+        if (paddr == 0)
+        {
+            return false;
+        }
+        *pte = paddr | TLBLO_VALID;
+        frame_adopt(paddr, as, vaddr);
+        return true;
+    }
+
+    if (!write)
+    {
+        vm_map_zero(pte);
+        return true;
+    }
+
+    if (*noclean)
+    {
+        return false;
+    }
+    vaddr_t kvaddr = take_zeroed_kpage();
+    if (kvaddr == 0)
+    {
+        *noclean = true;
+        return false;
+    }
+
+    *pte = (KVADDR_TO_PADDR(kvaddr) & PAGE_FRAME) | TLBLO_VALID;
+    if (region->writeable)
+    {
+        *pte |= TLBLO_DIRTY;
+    }
+    frame_adopt(*pte & PAGE_FRAME, as, vaddr);
+    VMSTAT(zerofills)++;
+    as->as_vmstat.vs_zerofills++;
+
+    return true;
+}
+
+/*
+ * After a TLB miss at FAULTADDRESS, map the untouched pages of the
+ * surrounding vm_faultaround-aligned block of REGION and load the
+ * block's translations into TLB slots nobody is using. Live entries,
+ * including those of other address spaces, are never displaced.
+ * Called with the page table lock of AS held, so interrupts are off.
+ */
+static void vm_fault_around(struct addrspace *as, struct region *region,
+                            vaddr_t faultaddress, bool write)
+{
+    unsigned window = vm_faultaround;
+    unsigned freeslots[VM_FAULTAROUND_MAX];
+    unsigned nfree = 0;
+    bool noclean = false;
+    uint32_t hi, lo;
+
+    if (window <= 1)
+    {
+        return;
+    }
+    if (window > VM_FAULTAROUND_MAX)
+    {
+        window = VM_FAULTAROUND_MAX;
+    }
+
+    vaddr_t start = faultaddress - (faultaddress / PAGE_SIZE % window) * PAGE_SIZE;
+    vaddr_t end = start + window * PAGE_SIZE;
+    if (start < region->vaddress)
+    {
+        start = region->vaddress;
+    }
+    if (end > region->vaddress + region->size)
+    {
+        end = region->vaddress + region->size;
+    }
+
+    for (int i = 0; i < NUM_TLB && nfree < window; i++)
+    {
+        tlb_read(&hi, &lo, i);
+        if ((hi & TLBHI_VPAGE) >= MIPS_KSEG0 || (lo & TLBLO_VALID) == 0)
+        {
+            freeslots[nfree++] = i;
+        }
+    }
+
+    for (vaddr_t va = start; va < end; va += PAGE_SIZE)
+    {
+        if (va == faultaddress)
+        {
+            continue;
+        }
+
+        // Don't allocate page tables for speculation
+        paddr_t *pte = as_lookup_pte(as, va, NULL);
+        if (pte == NULL)
+        {
+            continue;
+        }
+
+        if (*pte == 0)
+        {
+            if (!vm_prefault(as, region, va, pte, write, &noclean))
+            {
+                continue;
+            }
+            as->as_fa_mapped++;
+            VMSTAT(fa_mapped)++;
+        }
+
+        if ((*pte & (TLBLO_VALID | PTE_BUSY)) != TLBLO_VALID || nfree == 0)
+        {
+            continue;
+        }
+
+        hi = va | (as->as_asid << TLBHI_PID_SHIFT);
+        if (tlb_probe(hi, 0) >= 0)
+        {
+            continue;
+        }
+        // Not used yet, so leave the reference bits clear; the clock
+        // may still take the page, and the next refill after it
+        // leaves the TLB goes through vm_fault()
+        tlb_write(hi, *pte & ~(paddr_t)PTE_SOFTBITS, freeslots[--nfree]);
+        as->as_fa_preloaded++;
+        VMSTAT(fa_preloaded)++;
+    }
+
+    // tlb_read may have left another ASID loaded
+    tlb_setasid(as->as_asid);
 }
 
 int vm_fault(int faulttype, vaddr_t faultaddress)
@@ -43,79 +1248,345 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
     // Align the fault address to a page boundary.
     faultaddress &= PAGE_FRAME;
 
-    // Check if read_only
-    if (faulttype == VM_FAULT_READONLY)
+    // Check the address belongs to a region, growing the stack down
+    // to it if that is allowed
+    struct region *region = as_find_region(as, faultaddress);
+    if (region == NULL)
     {
-        return EFAULT;
+        if (as_grow_stack(as, faultaddress))
+        {
+            return EFAULT;
+        }
+        region = as->stack;
     }
 
-    paddr_t paddr = KVADDR_TO_PADDR(faultaddress);
-    uint32_t I1 = paddr >> 21;         // Level 1: 11 bits
-    uint32_t I2 = (paddr << 11) >> 23; // Level 2: 9 bit
-    // Offset : 12 bits
-
-    // If nothing in the first Level
-    if (as->pagetable[I1] == NULL)
+    switch (faulttype)
     {
-        as->pagetable[I1] = (paddr_t *)kmalloc(sizeof(paddr_t) * FIRST_LEVEL);
-        if (as->pagetable[I1] == NULL)
+    case VM_FAULT_READONLY:
+        // A write to a read-only page is only legal if the page is shared copy-on-write
+        if (!region->writeable)
         {
-            return ENOMEM;
+            return EFAULT;
         }
+        break;
 
-        for (int i = 0; i < SECOND_LEVEL; i++)
-        {
-            as->pagetable[I1][i] = 0;
-        }
+    case VM_FAULT_READ:
+    case VM_FAULT_WRITE:
+        break;
+
+    default:
+        return EINVAL;
+    }
+
+    bool write = faulttype != VM_FAULT_READ;
+    paddr_t *pte;
+
+    // A new second-level table has to be allocated before we take
+    // the page table lock, as that may reclaim. If another thread installs
+    // one first, ours goes back to the pool.
+    paddr_t *newtable = NULL;
+    if (as->pagetable[PT_L1_INDEX(faultaddress)] == NULL)
+    {
+        newtable = pt_alloc_table();
+    }
+
+    spinlock_acquire(&as->as_ptlock);
+    VMSTAT(faults[faulttype])++;
+    switch (faulttype)
+    {
+    case VM_FAULT_READ:
+        as->as_vmstat.vs_readfaults++;
+        break;
+    case VM_FAULT_WRITE:
+        as->as_vmstat.vs_writefaults++;
+        break;
+    default:
+        as->as_vmstat.vs_readonlyfaults++;
+        break;
     }
 
-    // Check if page table entry is mapped
-    if (as->pagetable[I1][I2] == 0)
+    for (;;)
     {
+        pte = as_lookup_pte(as, faultaddress, &newtable);
+        if (pte == NULL)
+        {
+            // No table, and none allocated (or no memory for one)
+            spinlock_release(&as->as_ptlock);
+            newtable = pt_alloc_table();
+            if (newtable == NULL && vm_evict())
+            {
+                return ENOMEM;
+            }
+            spinlock_acquire(&as->as_ptlock);
+            continue;
+        }
+
+        // Being paged in or out by someone else
+        if (*pte & PTE_BUSY)
+        {
+            pt_wait(as);
+            continue;
+        }
 
-        struct region *cur;
-        for (cur = as->region_list; cur != NULL; cur = cur->next)
+        if (*pte & TLBLO_VALID)
         {
-            // Check if the region is valid
-            if (faultaddress >= cur->vaddress &&
-                faultaddress < (cur->vaddress + (cur->size * PAGE_SIZE)))
+            if (!write || !region->writeable || (*pte & TLBLO_DIRTY))
             {
-                continue; // if valid, check next slot
+                break;
             }
-            else
+
+            // Write to a copy-on-write page. If we hold the only
+            // reference the frame is simply made writable again.
+            if (frame_getref(*pte & PAGE_FRAME) == 1)
             {
-                return -1; // else, report error
+                *pte |= TLBLO_DIRTY;
+                break;
             }
         }
+        else if (*pte == 0 && !write && vm_zero_fill(region, faultaddress))
+        {
+            // Reading an untouched page; share the zero page until
+            // the first store
+            vm_map_zero(pte);
+            break;
+        }
 
-        // Page allocation
-        vaddr_t v_page = alloc_kpages(1);
-        if (v_page == 0)
+        int result = vm_make_resident(as, region, faultaddress, pte, write);
+        if (result)
         {
-            return ENOMEM;
+            spinlock_release(&as->as_ptlock);
+            if (newtable != NULL)
+            {
+                pt_free_table(newtable);
+            }
+            return result;
         }
+    }
+
+    // Only pages the pager can see may be refilled without us; a
+    // shared frame keeps coming back here until it has an owner
+    if (frame_touch(*pte & PAGE_FRAME, as, faultaddress))
+    {
+        *pte |= PTE_ACCESSED;
+    }
+
+    // Get hi and lo. The ASID cannot change under us: only
+    // activating this address space on this cpu changes it.
+    uint32_t hi = (faultaddress & PAGE_FRAME) | (as->as_asid << TLBHI_PID_SHIFT);
+    uint32_t lo = *pte & ~(paddr_t)PTE_SOFTBITS;
+
+    // Load the TLB entry; the page table lock already has interrupts off. A
+    // read-only fault means the old entry is still there and must be
+    // replaced in place. Either way the processor is left with our
+    // ASID loaded.
+    int index = tlb_probe(hi, 0);
+    if (index >= 0)
+    {
+        tlb_write(hi, lo, index);
+    }
+    else
+    {
+        tlb_random(hi, lo);
+    }
 
-        // Page table update
-        as->pagetable[I1][I2] = (KVADDR_TO_PADDR(v_page) & PAGE_FRAME) | TLBLO_DIRTY | TLBLO_VALID;
+    // Read-only faults are for pages that are already mapped
+    if (faulttype != VM_FAULT_READONLY)
+    {
+        vm_fault_around(as, region, faultaddress, write);
     }
-    // Get hi and lo
-    uint32_t hi = faultaddress & PAGE_FRAME;
-    uint32_t lo = as->pagetable[I1][I2];
+    VMSTAT(refills)++;
+    spinlock_release(&as->as_ptlock);
 
-    // Disable interrupts and load TLB entries
-    int spl = splhigh();
-    tlb_random(hi, lo);
-    splx(spl);
+    if (newtable != NULL)
+    {
+        pt_free_table(newtable);
+    }
 
     return 0;
 }
 
 /*
- * SMP-specific functions.  Unused in our UNSW configuration.
+ * Add up the counters of every cpu. struct vmcounters is nothing but
+ * unsigneds, so it is summed as an array. Another cpu may be counting
+ * as we read, so the totals are only a snapshot.
+ */
+static void vm_sumcounters(struct vmcounters *total)
+{
+    unsigned *dst = (unsigned *)total;
+
+    bzero(total, sizeof(*total));
+    for (unsigned i = 0; i < MAXCPUS; i++)
+    {
+        const unsigned *src = (const unsigned *)&vmcounters[i];
+        for (unsigned j = 0; j < sizeof(*total) / sizeof(unsigned); j++)
+        {
+            dst[j] += src[j];
+        }
+    }
+}
+
+void vm_getstats(struct addrspace *as, struct vmstat *vs)
+{
+    unsigned freeframes, totalframes;
+
+    if (as != NULL)
+    {
+        spinlock_acquire(&as->as_ptlock);
+        *vs = as->as_vmstat;
+        vs->vs_ptpages = as->as_ptpages;
+        spinlock_release(&as->as_ptlock);
+
+        // The refill handler doesn't know whose entries it loads
+        vs->vs_tlbfast = 0;
+        vs->vs_tlbmisses = vs->vs_readfaults + vs->vs_writefaults;
+    }
+    else
+    {
+        struct vmcounters total;
+        unsigned fast = 0;
+
+        vm_sumcounters(&total);
+        for (unsigned i = 0; i < MAXCPUS; i++)
+        {
+            fast += cpurefills[i];
+        }
+
+        vs->vs_tlbfast = fast;
+        vs->vs_tlbmisses = fast + total.faults[VM_FAULT_READ] + total.faults[VM_FAULT_WRITE];
+        vs->vs_readfaults = total.faults[VM_FAULT_READ];
+        vs->vs_writefaults = total.faults[VM_FAULT_WRITE];
+        vs->vs_readonlyfaults = total.faults[VM_FAULT_READONLY];
+        vs->vs_zerofills = total.zerofills;
+        vs->vs_pagecopies = total.pagecopies;
+        vs->vs_pageins = total.pageins;
+        vs->vs_pageouts = total.pageouts;
+        vs->vs_discards = total.discards;
+
+        spinlock_acquire(&ptpool_spinlock);
+        vs->vs_ptpages = ptpool_inuse;
+        spinlock_release(&ptpool_spinlock);
+    }
+
+    ram_getusage(&freeframes, &totalframes);
+    vs->vs_framesfree = freeframes;
+    vs->vs_framesused = totalframes - freeframes;
+}
+
+/*
+ * Print the fault counters of each cpu that has taken a fault, and
+ * the totals.
+ */
+void vm_printcounters(void)
+{
+    struct vmstat vs;
+
+    kprintf("cpu  tlbfast    reads   writes readonly zerofill   copies  pageins pageouts\n");
+    for (unsigned i = 0; i < MAXCPUS; i++)
+    {
+        const struct vmcounters *c = &vmcounters[i];
+        if (cpurefills[i] + c->faults[VM_FAULT_READ] + c->faults[VM_FAULT_WRITE] +
+                c->faults[VM_FAULT_READONLY] == 0)
+        {
+            continue;
+        }
+        kprintf("%3u %8u %8u %8u %8u %8u %8u %8u %8u\n", i, cpurefills[i],
+                c->faults[VM_FAULT_READ], c->faults[VM_FAULT_WRITE],
+                c->faults[VM_FAULT_READONLY], c->zerofills, c->pagecopies,
+                c->pageins, c->pageouts);
+    }
+
+    vm_getstats(NULL, &vs);
+    kprintf("all %8u %8u %8u %8u %8u %8u %8u %8u\n", vs.vs_tlbfast,
+            vs.vs_readfaults, vs.vs_writefaults, vs.vs_readonlyfaults,
+            vs.vs_zerofills, vs.vs_pagecopies, vs.vs_pageins, vs.vs_pageouts);
+    kprintf("%u TLB misses, %u frames free, %u used, %u page table pages\n",
+            vs.vs_tlbmisses, vs.vs_framesfree, vs.vs_framesused, vs.vs_ptpages);
+}
+
+/*
+ * Print paging statistics.
+ */
+void vm_printstats(void)
+{
+    unsigned freeframes, totalframes, swapused, swaptotal;
+    unsigned pc_pages, pc_hits, pc_fills, pc_evictions;
+    struct vmcounters total;
+
+    ram_getusage(&freeframes, &totalframes);
+    swap_getusage(&swapused, &swaptotal);
+    pagecache_getstats(&pc_pages, &pc_hits, &pc_fills, &pc_evictions);
+    vm_sumcounters(&total);
+
+    spinlock_acquire(&ptpool_spinlock);
+    unsigned pt_inuse = ptpool_inuse;
+    unsigned pt_nfree = ptpool_nfree;
+    unsigned pt_hits = ptpool_hits;
+    unsigned pt_misses = ptpool_misses;
+    spinlock_release(&ptpool_spinlock);
+
+    unsigned pageins = total.pageins;
+    unsigned pageouts = total.pageouts;
+    unsigned discards = total.discards;
+    unsigned writebacks = total.writebacks;
+    unsigned aged = total.aged;
+    unsigned zero_maps = total.zero_maps;
+    unsigned zero_copies = total.zero_copies;
+    unsigned fa_mapped = total.fa_mapped;
+    unsigned fa_preloaded = total.fa_preloaded;
+    unsigned refills = total.refills;
+    unsigned switches = total.switches;
+    unsigned flushes = total.flushes;
+    unsigned shootdowns = total.shootdowns;
+    unsigned deferred = total.deferred;
+
+    kprintf("vm: %u/%u frames free, %u/%u swap pages used\n",
+            freeframes, totalframes, swapused, swaptotal);
+    frame_printstats();
+    kprintf("vm: %u page-ins, %u page-outs, %u clean pages discarded\n",
+            pageins, pageouts, discards);
+    kprintf("vm: %u dirty mapped pages written back, %u pages aged\n",
+            writebacks, aged);
+    kprintf("vm: %u TLB refills in vm_fault, %u address space switches (%u.%02u refills/switch), %u TLB flushes\n",
+            refills, switches,
+            switches ? refills / switches : 0,
+            switches ? refills * 100 / switches % 100 : 0,
+            flushes);
+    kprintf("vm: %u TLB shootdowns sent, %u deferred to the next activation\n",
+            shootdowns, deferred);
+    kprintf("vm: %u zero page mappings, %u copied on write\n",
+            zero_maps, zero_copies);
+    kprintf("vm: page tables: %u pages in use, %u pooled; %u taken from the pool, %u allocated\n",
+            pt_inuse, pt_nfree, pt_hits, pt_misses);
+    kprintf("vm: text page cache: %u pages, %u hits, %u pages read in, %u evicted\n",
+            pc_pages, pc_hits, pc_fills, pc_evictions);
+    kprintf("vm: fault-around window %u: %u pages mapped and %u TLB entries loaded ahead\n",
+            vm_faultaround, fa_mapped, fa_preloaded);
+    reclaim_printstats();
+}
+
+/*
+ * SMP-specific functions.
  */
 
+/*
+ * Carry out a shootdown sent by vm_tlb_send_shootdown(). Called from the
+ * IPI handler with interrupts off. An entry from another ASID
+ * generation cannot be in our TLB: we either flushed it already or
+ * will before we load anything from the new generation.
+ */
 void vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-    (void)ts;
-    panic("vm tried to do tlb shootdown?!\n");
+    if (ts->ts_tlbhi == TLBSHOOTDOWN_ALL)
+    {
+        vm_tlb_flush();
+    }
+    else if (ts->ts_asid_gen == curcpu->c_asid_generation)
+    {
+        int index = tlb_probe(ts->ts_tlbhi, 0);
+        if (index >= 0)
+        {
+            tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+        }
+    }
+    tlb_setasid(curcpu->c_asid);
 }
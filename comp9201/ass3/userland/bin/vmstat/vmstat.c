@@ -0,0 +1,121 @@
+/*
+ * vmstat - print VM counters
+ * usage: vmstat
+ *        vmstat -p pid
+ *        vmstat program [args...]
+ *
+ * With no arguments, prints the counters of the whole system since
+ * boot. With -p, prints those of one process. Otherwise runs the
+ * program, waits for it, and prints how much each system counter
+ * went up while it ran, for tuning workloads like matmult and
+ * parallelvm. The frame and page table counts are always current
+ * values rather than differences.
+ *
+ * This program uses these system calls:
+ *    vmstat spawn waitpid __time write _exit
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+static
+void
+show(const struct vmstat *vs, const struct vmstat *base)
+{
+	static const struct vmstat zero;
+
+	if (base == NULL) {
+		base = &zero;
+	}
+
+#define SHOW(field, what) \
+	printf("%12u  %s\n", vs->field - base->field, what)
+
+	SHOW(vs_tlbmisses, "TLB misses");
+	SHOW(vs_tlbfast, "  refilled without a fault");
+	SHOW(vs_readfaults, "read faults");
+	SHOW(vs_writefaults, "write faults");
+	SHOW(vs_readonlyfaults, "read-only faults");
+	SHOW(vs_zerofills, "pages zero-filled");
+	SHOW(vs_pagecopies, "pages copied on write");
+	SHOW(vs_pageins, "pages read from swap");
+	SHOW(vs_pageouts, "pages written to swap");
+	SHOW(vs_discards, "clean file pages dropped");
+#undef SHOW
+
+	printf("%12u  frames free\n", vs->vs_framesfree);
+	printf("%12u  frames used\n", vs->vs_framesused);
+	printf("%12u  page table pages\n", vs->vs_ptpages);
+}
+
+static
+void
+getstats(pid_t pid, struct vmstat *vs)
+{
+	if (vmstat(pid, vs) < 0) {
+		if (pid == VMSTAT_SYSTEM) {
+			err(1, "vmstat");
+		}
+		err(1, "pid %d", pid);
+	}
+}
+
+static
+void
+runit(char **args)
+{
+	struct vmstat before, after;
+	time_t startsecs, endsecs;
+	unsigned long startnsecs, endnsecs;
+	unsigned long ms;
+	pid_t pid;
+	int status;
+
+	getstats(VMSTAT_SYSTEM, &before);
+	__time(&startsecs, &startnsecs);
+
+	pid = spawnvp(args[0], args, NULL, 0);
+	if (pid < 0) {
+		err(1, "%s", args[0]);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+
+	__time(&endsecs, &endnsecs);
+	getstats(VMSTAT_SYSTEM, &after);
+
+	/* Milliseconds keep this within 32 bits */
+	ms = (endsecs - startsecs) * 1000UL;
+	ms = ms + endnsecs / 1000000 - startnsecs / 1000000;
+
+	printf("%s: exit status %d, %lu.%03lu s\n", args[0],
+	       WIFEXITED(status) ? WEXITSTATUS(status) : -1,
+	       ms / 1000, ms % 1000);
+	show(&after, &before);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct vmstat vs;
+
+	if (argc == 1) {
+		getstats(VMSTAT_SYSTEM, &vs);
+		show(&vs, NULL);
+	}
+	else if (!strcmp(argv[1], "-p")) {
+		if (argc != 3) {
+			errx(1, "Usage: vmstat [-p pid | program [args...]]");
+		}
+		getstats(atoi(argv[2]), &vs);
+		show(&vs, NULL);
+	}
+	else {
+		runit(argv + 1);
+	}
+	return 0;
+}
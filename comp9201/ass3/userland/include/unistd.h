@@ -40,10 +40,14 @@
  */
 #include <kern/fcntl.h>
 #include <kern/ioctl.h>
+#include <kern/mman.h>
 #include <kern/reboot.h>
 #include <kern/seek.h>
+#include <kern/spawn.h>
 #include <kern/time.h>
+#include <kern/resource.h>	/* after kern/time.h, for struct timeval */
 #include <kern/unistd.h>
+#include <kern/vmstat.h>
 #include <kern/wait.h>
 
 
@@ -148,6 +152,8 @@ int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 int __time(time_t *seconds, unsigned long *nanoseconds);
 ssize_t __getcwd(char *buf, size_t buflen);
+int getrlimit(int resource, struct rlimit *rlp);	/* RLIMIT_STACK only */
+int setrlimit(int resource, const struct rlimit *rlp);	/* ditto */
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
 
@@ -156,18 +162,35 @@ ssize_t __getcwd(char *buf, size_t buflen);
  */
 
 int execvp(const char *prog, char *const *args); /* calls execv */
+pid_t spawnvp(const char *prog, char *const *args,
+	      const struct spawn_action *actions, int nactions); /* spawn */
 char *getcwd(char *buf, size_t buflen);		/* calls __getcwd */
 time_t time(time_t *seconds);			/* calls __time */
 
 /* UNSW versions of mmap() and munmap()
  * This are simplified compared to the standard version on UNIX
  * You should implement this version as this is what we expect to test.
+ *
+ * PROT_READ and PROT_WRITE come from <kern/mman.h>. Mappings are
+ * shared with the file: msync() writes the mapping at ADDR back, as
+ * munmap() and exit do.
  */
 
-#define PROT_READ 1
-#define PROT_WRITE 2
-
 void *mmap(size_t length, int prot, int fd, off_t offset);
 int munmap(void *addr);
+int msync(void *addr);
+
+/* UNSW spawn(): fork() then execv() in the child, in one go, without
+ * copying the parent. The file actions from <kern/spawn.h> are applied
+ * to the child's file table first. Returns the child's pid, or -1 if
+ * the program could not be started.
+ */
+pid_t spawn(const char *prog, char *const *args,
+	    const struct spawn_action *actions, int nactions);
+
+/* UNSW vmstat(): get the VM counters of process PID, or of the whole
+ * system if PID is VMSTAT_SYSTEM. struct vmstat is in <kern/vmstat.h>.
+ */
+int vmstat(pid_t pid, struct vmstat *vs);
 
 #endif /* _UNISTD_H_ */
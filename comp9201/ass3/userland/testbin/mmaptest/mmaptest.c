@@ -0,0 +1,121 @@
+/*
+ * mmaptest - check file-backed mmap(), msync() and munmap()
+ *
+ * Writes a file of known contents, maps it, checks the mapping sees
+ * the file, then changes the mapping and checks that msync() and
+ * munmap() get the changes back into the file. The file is a little
+ * over a few pages long so the last page is only partly file.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define FILENAME "mmaptest.dat"
+#define FILESIZE (3 * 4096 + 100)
+
+static char buf[FILESIZE];
+
+static
+char
+pattern(int i, int gen)
+{
+	return (char)('a' + (i / 7 + gen) % 26);
+}
+
+static
+void
+checkfile(int gen)
+{
+	int fd, i;
+	ssize_t len;
+
+	fd = open(FILENAME, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", FILENAME);
+	}
+	len = read(fd, buf, sizeof(buf));
+	if (len != FILESIZE) {
+		errx(1, "%s: read returned %ld", FILENAME, (long)len);
+	}
+	for (i = 0; i < FILESIZE; i++) {
+		if (buf[i] != pattern(i, gen)) {
+			errx(1, "%s: byte %d is %c, expected %c",
+			     FILENAME, i, buf[i], pattern(i, gen));
+		}
+	}
+	close(fd);
+}
+
+int
+main(void)
+{
+	int fd, i;
+	char *p;
+
+	/* Write the file the ordinary way */
+	fd = open(FILENAME, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: create", FILENAME);
+	}
+	for (i = 0; i < FILESIZE; i++) {
+		buf[i] = pattern(i, 0);
+	}
+	if (write(fd, buf, FILESIZE) != FILESIZE) {
+		err(1, "%s: write", FILENAME);
+	}
+	close(fd);
+
+	fd = open(FILENAME, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s: open", FILENAME);
+	}
+	p = mmap(FILESIZE, PROT_READ | PROT_WRITE, fd, 0);
+	if (p == (void *)-1) {
+		err(1, "mmap");
+	}
+	/* The mapping stays valid after close */
+	close(fd);
+
+	printf("Checking the mapping matches the file...\n");
+	for (i = 0; i < FILESIZE; i++) {
+		if (p[i] != pattern(i, 0)) {
+			errx(1, "mapping: byte %d is %c, expected %c",
+			     i, p[i], pattern(i, 0));
+		}
+	}
+	/* Past the end of the file reads as zeros */
+	if (p[FILESIZE] != 0) {
+		errx(1, "mapping: byte past end of file is not zero");
+	}
+
+	printf("Checking msync writes changes back...\n");
+	for (i = 0; i < FILESIZE; i++) {
+		p[i] = pattern(i, 1);
+	}
+	/* Scribbling past the end must not grow the file */
+	p[FILESIZE] = 'x';
+	if (msync(p)) {
+		err(1, "msync");
+	}
+	checkfile(1);
+
+	printf("Checking munmap writes changes back...\n");
+	for (i = 0; i < FILESIZE; i++) {
+		p[i] = pattern(i, 2);
+	}
+	if (munmap(p)) {
+		err(1, "munmap");
+	}
+	checkfile(2);
+
+	if (munmap(p) == 0) {
+		errx(1, "munmap of an unmapped address succeeded");
+	}
+
+	remove(FILENAME);
+	printf("Passed mmaptest.\n");
+	return 0;
+}
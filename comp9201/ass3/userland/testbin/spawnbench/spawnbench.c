@@ -0,0 +1,109 @@
+/*
+ * spawnbench - compare process launch with fork+execv and spawn
+ *
+ * Starts /bin/true over and over, first with fork() and execv() in
+ * the child, then with spawn(), waiting for each one to exit, and
+ * prints how long each launch took. Run it with an argument to
+ * change the number of launches, or a second one to run something
+ * other than /bin/true.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define NLAUNCHES 50
+
+static
+void
+waitfor(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "pid %d: unexpected exit status %d", pid, status);
+	}
+}
+
+static
+void
+forkexec(char **args)
+{
+	pid_t pid;
+
+	pid = fork();
+	switch (pid) {
+	    case -1:
+		err(1, "fork");
+	    case 0:
+		/* child */
+		execv(args[0], args);
+		warn("%s", args[0]);
+		_exit(1);
+	    default:
+		/* parent */
+		break;
+	}
+	waitfor(pid);
+}
+
+static
+void
+dospawn(char **args)
+{
+	pid_t pid;
+
+	pid = spawn(args[0], args, NULL, 0);
+	if (pid < 0) {
+		err(1, "%s: spawn", args[0]);
+	}
+	waitfor(pid);
+}
+
+static
+void
+timeit(const char *what, void (*launch)(char **), char **args, int n)
+{
+	time_t startsecs, endsecs;
+	unsigned long startnsecs, endnsecs;
+	unsigned long us;
+	int i;
+
+	__time(&startsecs, &startnsecs);
+	for (i=0; i<n; i++) {
+		launch(args);
+	}
+	__time(&endsecs, &endnsecs);
+
+	/* Work in microseconds to stay within 32 bits */
+	us = (endsecs - startsecs) * 1000000UL;
+	us = us + endnsecs / 1000 - startnsecs / 1000;
+
+	printf("spawnbench: %-10s %d launches in %lu.%06lu s, %lu us each\n",
+	       what, n, us / 1000000, us % 1000000, us / n);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *args[2];
+	int n;
+
+	n = NLAUNCHES;
+	if (argc > 1) {
+		n = atoi(argv[1]);
+		if (n <= 0) {
+			errx(1, "Usage: spawnbench [launches [program]]");
+		}
+	}
+	args[0] = argc > 2 ? argv[2] : (char *)"/bin/true";
+	args[1] = NULL;
+
+	timeit("fork+execv", forkexec, args, n);
+	timeit("spawn", dospawn, args, n);
+	return 0;
+}
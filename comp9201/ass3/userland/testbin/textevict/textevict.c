@@ -0,0 +1,93 @@
+/*
+ * textevict - check that text pages are evicted under memory pressure
+ *
+ * Reads through a large constant table, which the linker puts in the
+ * read-only segment with the code, then dirties more fresh heap pages
+ * than there are free frames so that the pager has to make room. The
+ * table is left alone meanwhile, so its pages should be among the
+ * first to go, dropped rather than written to swap; vmstat() counts
+ * how many of this process's pages were. Finally the table is read
+ * again, from the executable, and checked.
+ *
+ * Needs swap for the heap pages pushed out after the table's.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PAGESIZE   4096
+#define TABLEPAGES 64
+#define EXTRAPAGES 64		/* heap pages beyond the free frames */
+#define FILL       0x5a
+
+static const unsigned char table[TABLEPAGES * PAGESIZE] = {
+	[0 ... TABLEPAGES * PAGESIZE - 1] = FILL
+};
+
+static
+unsigned
+checktable(void)
+{
+	volatile const unsigned char *p = table;
+	unsigned i, bad;
+
+	bad = 0;
+	for (i = 0; i < sizeof(table); i++) {
+		if (p[i] != FILL) {
+			bad++;
+		}
+	}
+	return bad;
+}
+
+static
+void
+getstats(pid_t pid, struct vmstat *vs)
+{
+	if (vmstat(pid, vs) < 0) {
+		err(1, "vmstat");
+	}
+}
+
+int
+main(void)
+{
+	struct vmstat sys, before, after;
+	unsigned npages, i, bad;
+	char *mem;
+
+	if (checktable() != 0) {
+		errx(1, "table is wrong before the test");
+	}
+
+	getstats(VMSTAT_SYSTEM, &sys);
+	getstats(getpid(), &before);
+
+	npages = sys.vs_framesfree + EXTRAPAGES;
+	mem = sbrk(npages * PAGESIZE);
+	if (mem == (void *)-1) {
+		err(1, "sbrk of %u pages", npages);
+	}
+	for (i = 0; i < npages; i++) {
+		mem[i * PAGESIZE] = (char)i;
+	}
+
+	getstats(getpid(), &after);
+	printf("textevict: %u heap pages dirtied, %u written to swap, "
+	       "%u clean pages dropped\n", npages,
+	       after.vs_pageouts - before.vs_pageouts,
+	       after.vs_discards - before.vs_discards);
+
+	bad = checktable();
+	if (bad != 0) {
+		errx(1, "%u bytes of the table are wrong after eviction", bad);
+	}
+	if (after.vs_discards == before.vs_discards) {
+		errx(1, "no text pages were evicted");
+	}
+
+	printf("textevict: passed\n");
+	return 0;
+}
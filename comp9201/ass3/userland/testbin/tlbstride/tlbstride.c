@@ -0,0 +1,66 @@
+/*
+ * tlbstride - time TLB refills
+ *
+ * Touches one word in each of more pages than the TLB has entries,
+ * over and over, so that nearly every access takes a TLB miss on a
+ * resident page. Prints the average time per access, which is mostly
+ * the cost of the refill path. Run it with an argument to change the
+ * number of passes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PAGESIZE 4096
+#define NPAGES   256		/* four times the 64-entry TLB */
+#define NPASSES  200
+
+static char pages[NPAGES * PAGESIZE];
+
+int
+main(int argc, char *argv[])
+{
+	time_t startsecs, endsecs;
+	unsigned long startnsecs, endnsecs;
+	unsigned long us, accesses;
+	volatile char *p;
+	int i, pass, npasses;
+	unsigned sum;
+
+	npasses = NPASSES;
+	if (argc > 1) {
+		npasses = atoi(argv[1]);
+		if (npasses <= 0) {
+			errx(1, "Usage: tlbstride [passes]");
+		}
+	}
+
+	/* Fault everything in first so we only time refills */
+	for (i = 0; i < NPAGES; i++) {
+		pages[i * PAGESIZE] = (char)i;
+	}
+
+	sum = 0;
+	p = pages;
+	__time(&startsecs, &startnsecs);
+	for (pass = 0; pass < npasses; pass++) {
+		for (i = 0; i < NPAGES; i++) {
+			sum += p[i * PAGESIZE];
+		}
+	}
+	__time(&endsecs, &endnsecs);
+
+	/* Work in microseconds to stay within 32 bits */
+	us = (endsecs - startsecs) * 1000000UL;
+	us = us + endnsecs / 1000 - startnsecs / 1000;
+	accesses = (unsigned long)npasses * NPAGES;
+
+	printf("tlbstride: %d passes over %d pages in %lu.%06lu s\n",
+	       npasses, NPAGES, us / 1000000, us % 1000000);
+	printf("tlbstride: %lu ns per access (checksum %u)\n",
+	       (us / accesses) * 1000 + (us % accesses) * 1000 / accesses,
+	       sum);
+	return 0;
+}